@@ -11,18 +11,48 @@
 #ifdef __APPLE__
     #include <GLUT/GLUT.h>
     #include <OpenGL/OpenGL.h>
+    #include <OpenGL/glext.h>
+    #define GL_DO_NOT_WARN_IF_MULTI_GL_VERSION_HEADERS_INCLUDED
+    #include <OpenGL/gl3.h>
     #include <OpenGL/glu.h>
 #else
+    #define GL_GLEXT_PROTOTYPES
     #include <GL/freeglut.h>
     #include <GL/gl.h>
     #include <GL/glu.h>
+    #include <EGL/egl.h>
+    #include <EGL/eglext.h>
 #endif
 
 /* Standard Libraries */
 #include <iostream>
 #include <math.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
+/* SIMD, for moving trains a few at a time */
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 /* Loader Library */
 
 #pragma mark - OpenGL
@@ -32,69 +62,483 @@
 void init();
 void display();
 void key(unsigned char key, int x, int y);
+void viewKey(unsigned char key);
 void reshape(int width, int height);
-void timedLoop(int val);
+void idle();
+
+/* Anti-aliasing, between drawing the scene and showing it */
+void buildAntialiasing();
+void resizeAntialiasing(int width, int height);
+void beginAntialiasedFrame();
+void finishAntialiasedFrame();
+void destroyAntialiasing();
 
 #pragma mark - Scenery
 
 /* Train parts */
 
-void trackWithID(int id);
-void wheel();
+void trainOnTrack(int trainID);
+void wheel(int lod);                //  Which level of detail?
+void wheels(const GLfloat *carTransforms, int carCount);    //  Wheels for a whole train
 void car(int carID, int trainID);   //  Which car in which train is it?
 void train(int trainID);            //  What train are we rendering?
 
 /* Tracks */
 
-void trackSegmentOfLength(GLfloat length);
-void railOfLength(GLfloat length);
-void tie();
-void track();
+struct MeshBuilder;
+
+void trackSegment(MeshBuilder *builder, int trackID, int segment);
+void railOfLength(MeshBuilder *builder, float x, float y, float z, float directionX, float directionZ, GLfloat length);
+void tie(MeshBuilder *builder, float x, float y, float z, float directionX, float directionZ);
+
+/* The track, streamed into a ring of segments around the camera */
+void buildStaticTrackBatch();
+void streamTrack(float cameraZ);
+void streamTrackAroundCamera();
+void drawStaticTrackBatch();
+void destroyStaticTrackBatch();
+
+/* Wheel meshes, one per level of detail */
+void buildWheelMeshes();
+void destroyWheelMeshes();
+
+/* Distant trains, drawn as quads from an atlas of pictures of a car */
+void buildImpostors();
+void destroyImpostors();
+void beginImpostors();
+bool queueTrainImpostors(int trainID);
+void drawImpostors();
+
+/* Or every train, moved along its track by the vertex shader */
+void buildGpuTrains();
+void destroyGpuTrains();
+void drawGpuTrains();
+
+/* Frustum culling, over a grid laid along the line */
+void buildSceneGrid();
+void updateFrustum();
+void cullScene();
+
+/* Occlusion culling, against a small depth buffer of the platforms and trains in view */
+void cullOccluded();
 
 /* Platform */
 void platform(int platformID);
+void platformSpotlight(int platformID);
+
+/* Instancing, for geometry that repeats */
+bool instancingSupported = false;
+void buildInstanceProgram();
+void destroyInstanceProgram();
+
+/* Floor tiles for every platform, drawn with one instanced call */
+void buildInstancedTiles();
+void drawInstancedTiles();
+void destroyInstancedTiles();
 
 /* Lighting */
 void setLightColor(GLenum light, float *ambientColor, float *specularColor, float *diffuseColor);
 void configureSpotlight(GLenum lightID, float *position, float *direction, float angle, float exponent);
 void configureAmbientLight(GLenum lightID, float *position, float *direction, float *color);
 
+/* GL state cache, which drops changes that wouldn't change anything */
+void resetStateCache();
+void enableState(GLenum capability);
+void disableState(GLenum capability);
+bool stateEnabled(GLenum capability);
+void setColor4fv(const GLfloat *color);
+void setColor3f(GLfloat red, GLfloat green, GLfloat blue);
+void forgetColor();
+const GLfloat *currentColor();
+
 /* Alternates between two colors */
 float *alternatingColor;
 void alternateColor(float *firstColor, float *secondColor);
 
-/* Creates vertices of a rect prism with given dimensions */
+/* Draws a rect prism with given dimensions, in the current color */
 void rectangularPrism(float width, float height, float length);
 
+/* One mesh per size of prism, built the first time it's drawn */
+int prismMeshFor(float width, float height, float length);
+void drawPrismMesh(int prism);
+void destroyPrismMeshes();
 
-#pragma mark - Globals
+/* Meshes drawn one at a time are queued, and drawn together once the scene's done */
+void flushDrawList();
+void destroyDrawList();
+
+/* Emits a rect prism, centered on x, y, z, into a mesh builder, optionally turned to run along a direction */
+void appendPrism(MeshBuilder *builder, float x, float y, float z, float width, float height, float length, const float *color);
+void appendTurnedPrism(MeshBuilder *builder, float x, float y, float z, float width, float height, float length, float directionX, float directionZ, const float *color);
 
-//  A quadric used for drawing wheels
-GLUquadric *quadric;
+/* Groups what's emitted between them into one separately drawable part */
+void beginMeshPart(MeshBuilder *builder);
+void endMeshPart(MeshBuilder *builder);
+
+
+#pragma mark - Globals
 
 //  Automatic train animation
 bool paused = false;
 
 /* Train Controls */
-int traintrackCount = 0;                //  How many tracks are there?
-int traintrackUserControlled = 0;       //  Which track is the user controlling?
-bool *traintrackShowTrain = new bool;   //  Does this track show a train?
-int *traintrackDirection = new int;     //  Is the train going North or South?
+int trainUserControlled = 0;            //  Which train is the user controlling?
+
+#pragma mark - Registry
+
+/*
+ 
+ Tracks and trains are kept in parallel arrays, indexed by ID.
+ They're allocated once at startup, sized from the configuration,
+ and never grow, so nothing is allocated from frame to frame.
+ 
+ */
+
+typedef struct
+{
+    int count;
+    float *offsetX;             //  Where is the track, across the line?
+    int *direction;             //  Do its trains go North or South?
+    bool *showTrains;           //  Does this track show its trains?
+    int *firstPiece;            //  Where its path starts, in the track paths
+    int *pieceCount;
+    float *length;              //  How long it is, following its path
+} TrackRegistry;
+
+/*
+ 
+ Every track's path, one spline piece after another, each
+ resampled at even distances along it. See Track Paths.
+ 
+ */
+
+//  Samples along each piece, not counting the one at its start
+#define PATH_SAMPLES_PER_PIECE 64
+
+typedef struct
+{
+    float x;
+    float z;
+} PathPoint;
+
+typedef struct
+{
+    int pieceCount;
+    float *start;               //  How far along its track each piece starts
+    float *length;
+    float *x;                   //  PATH_SAMPLES_PER_PIECE + 1 samples per piece
+    float *z;
+    float *tangentX;            //  Which way the track runs at each sample
+    float *tangentZ;
+} TrackPaths;
+
+typedef struct
+{
+    int count;
+    int *trackID;               //  Which track is the train on?
+    float *positionX;           //  Where is it, relative to its track?
+    float *positionY;
+    float *positionZ;
+    double *distance;           //  How far along its track's path is it? Doubles, so a long line never rounds a tick away
+    int *direction;             //  Is the train going North or South?
+    float *speed;               //  How far does it move each tick?
+    double *velocity;           //  Its speed, signed by its direction, along its track
+    double *trackLength;        //  Its track's length, copied here so a tick needn't look it up
+    long *baseTick;             //  The motion tick its distance was taken on, when the GPU moves it
+    bool *visible;              //  Did it survive culling this frame?
+} TrainRegistry;
+
+typedef struct
+{
+    int count;
+    float *position;            //  x, y and z for each light, in world space
+    float *direction;           //  Where each spotlight points
+    float *color;               //  Red, green and blue
+    float *radius;              //  Nothing further away is lit
+    float *cosCutoff;           //  How wide the spotlight is, or -1 for all around
+} StationLightRegistry;
+
+typedef struct
+{
+    int count;
+    int *parent;                //  Which node is it placed relative to, or -1 for the root?
+    float *local;               //  A 4x4 matrix for each node, relative to its parent
+    float *world;               //  Its parent's world transform, times its local one
+    bool *dirty;                //  Has it moved since its world transform was worked out?
+    bool *updated;              //  Was its world transform worked out in the last update?
+    int firstTrainNode;
+    int carsPerTrain;
+} SceneGraph;
+
+/*
+ 
+ The simulation thread owns the positions in the train registry.
+ Rendering only sees copies of them, in snapshots published after
+ each tick.
+ 
+ */
+
+typedef struct
+{
+    double time;                //  When was it published, in seconds?
+    long motionTick;            //  How many ticks had moved the trains by then
+    float *positionX;
+    float *positionY;
+    float *positionZ;
+    double *distance;
+} TrainSnapshot;
+
+TrackRegistry tracks;
+TrackPaths trackPaths;
+TrainRegistry trains;
+StationLightRegistry stationLights;
+SceneGraph sceneGraph;
+
+//  Where the trains are drawn this frame
+TrainSnapshot drawnTrains;
+
+/* How big the registries are, set from the command line */
+
+#define DEFAULT_TRACK_COUNT 2
+#define DEFAULT_TRAINS_PER_TRACK 1
+#define DEFAULT_CARS_PER_TRAIN 10
+#define DEFAULT_TRACK_LENGTH 1000.0f
+#define DEFAULT_PLATFORM_COUNT 4
+#define DEFAULT_FIXTURES_PER_PLATFORM 0
+#define DEFAULT_HEADLESS_FRAMES 300
+#define DEFAULT_ANTIALIAS_SAMPLES 4
+#define DEFAULT_IMPOSTOR_DISTANCE 120.0f
+
+typedef struct
+{
+    int trackCount;
+    int trainsPerTrack;
+    int carsPerTrain;
+    float trackLength;          //  Each way from the middle of the line
+    int platformCount;
+    int fixturesPerPlatform;    //  Ceiling lights over each platform
+    
+    bool headless;              //  Render offscreen, without a window?
+    bool benchmark;             //  Run the benchmark suite, headless
+    int headlessFrames;         //  How many frames to time, when headless
+    const char *screenshotPath; //  Where to save the last headless frame
+    
+    const char *statsCSVPath;   //  Where to stream per frame statistics
+    const char *statsJSONPath;
+    
+    const char *recordPath;     //  Where to record keyboard input
+    const char *replayPath;     //  A recording to play back instead
+    
+    bool shaderRenderer;        //  Core profile shaders, or fixed function?
+    int antialiasSamples;       //  Samples a pixel to multisample with, or 0
+    bool fxaa;                  //  Smooth edges in a pass after the scene instead?
+    bool occlusionCulling;      //  Skip what's hidden behind the platforms and trains?
+    float impostorDistance;     //  Trains further away than this are drawn as impostors, unless it's 0
+    bool gpuTrainMotion;        //  Have the vertex shader move the trains, from a tick count?
+    
+    int simulationThreads;      //  How many threads move the trains, or 0 for one per core
+    
+    const char *networkPath;        //  A compiled network to lay the scene out from
+    const char *networkSourcePath;  //  A description to compile into networkPath, instead of running
+} Configuration;
+
+Configuration configuration = {DEFAULT_TRACK_COUNT, DEFAULT_TRAINS_PER_TRACK, DEFAULT_CARS_PER_TRAIN, DEFAULT_TRACK_LENGTH, DEFAULT_PLATFORM_COUNT, DEFAULT_FIXTURES_PER_PLATFORM, false, false, DEFAULT_HEADLESS_FRAMES, NULL, NULL, NULL, NULL, NULL, true, DEFAULT_ANTIALIAS_SAMPLES, false, true, DEFAULT_IMPOSTOR_DISTANCE, false, 0, NULL, NULL};
+
+void parseArguments(int argc, char **argv);
+void createRegistries(Configuration *configuration);
+void destroyRegistries();
+void placeTrains(float firstTrainZ);
+void placePlatforms(Configuration *configuration);
+void placeStationLights(Configuration *configuration);
 
-/* configures a track */
-void installTrack(bool showTrain, int direction);
+/* Each track's path, a spline resampled by distance along it */
+float buildTrackPath(int trackID, const PathPoint *points, int pointCount);
+void allocateTrackPaths(int pieceCount);
+void destroyTrackPaths();
+void trackPointAt(int trackID, double distance, PathPoint *position, PathPoint *tangent);
+double trackDistanceAtZ(int trackID, float z);
+void placeTrainOnTrack(int trainID);
+
+/* A network description, compiled offline, and mapped in at startup */
+bool compileNetwork(const char *sourcePath, const char *binaryPath);
+bool mapNetwork(const char *path);
+void unmapNetwork();
+
+/* Simulation, on its own thread unless we're stepping it ourselves */
+void startSimulation(bool threaded);
+void stopSimulation();
+void queueTrainCommand(unsigned char key, int trainID);
+void interpolateTrains();
+void stepSimulation(double seconds);
+
+/* Input recording and replay, a tick at a time */
+void openInputFiles();
+void closeInputFiles();
+void recordViewKey(unsigned char key);
+void applyReplayedViewKeys();
+bool replayingInput();
+
+/* Offscreen rendering, for benchmarks and CI */
+int runHeadless();
+int timeHeadlessRun();
+double timeHeadlessFrame();
+
+/* Scripted camera paths, over a range of scene sizes */
+bool addBenchmarkSweep(const char *sweep);
+bool selectBenchmarkPaths(const char *names);
+int runBenchmark();
+
+/* A matrix stack of our own, which falls through to OpenGL's with fixed function */
+void pushMatrix();
+void popMatrix();
+void translateMatrix(GLfloat x, GLfloat y, GLfloat z);
+void rotateMatrix(GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
+void perspectiveMatrix(GLfloat fovy, GLfloat aspect, GLfloat zNear, GLfloat zFar);
+void loadIdentityMatrix();
+void identityMatrix(GLfloat *matrix);
+void getModelviewMatrix(GLfloat *matrix);
+void getProjectionMatrix(GLfloat *matrix);
+void loadMatrix(const GLfloat *matrix);
+void multiplyMatrix(const GLfloat *matrix);
+void multiplyMatrices(const GLfloat *left, const GLfloat *right, GLfloat *result);
+
+/* Cached world transforms for everything placed in the scene, redone only when something moves */
+//  The yellow strips, then the pillars, under each platform
+#define PLATFORM_STRIP_NODES 2
+#define PLATFORM_PILLAR_NODES 6
+#define PLATFORM_NODES (1 + PLATFORM_STRIP_NODES + PLATFORM_PILLAR_NODES)
+
+void createSceneGraph(Configuration *configuration);
+void destroySceneGraph();
+void placeSceneNode(int node, float x, float y, float z, float directionX, float directionZ);
+void placeTrainNodes(int trainID);
+void updateSceneGraph();
+void setSceneView();
+void loadSceneNode(int node);
+int platformNode(int platformID);
+int platformStripNode(int platformID, int strip);
+int platformPillarNode(int platformID, int pillar);
+int trainNode(int trainID);
+int carNode(int trainID, int carID);
+
+/* The core profile renderer, and the light state it keeps in place of OpenGL's */
+bool buildShaderRenderer();
+void destroyShaderRenderer();
+void prepareShaderDraw(bool instanceColors, int transforms);
+void drawPlatformMesh();
+void drawCarMesh();
+void lightfv(GLenum light, GLenum name, const GLfloat *values);
+void lightf(GLenum light, GLenum name, GLfloat value);
+void enableLight(GLenum light);
+void toggleShaderLighting();
+
+//  Where a draw's modelview comes from, for prepareShaderDraw()
+#define SHADER_DRAW_MODELVIEW 0         //  The Draw block
+#define SHADER_INSTANCE_MODELVIEWS 1    //  An attribute per instance
+#define SHADER_TRAIN_MOTION 2           //  The Draw block, times where each car is, worked out by the shader
+
+/* Station lights, binned into clusters of the view for the shader renderer */
+void buildLightClusters();
+void destroyLightClusters();
+void resizeLightClusters(int width, int height);
+void binStationLights();
+
+#pragma mark - Statistics
+
+/*
+ 
+ Every frame counts what it submits and times its major sections,
+ so we can see where the milliseconds go. Times are in ms, and
+ accumulate over every call to a section during the frame.
+ 
+ */
+
+typedef enum
+{
+    STATS_DISPLAY,
+    STATS_SCENE,
+    STATS_TRACK,
+    STATS_PLATFORM,
+    STATS_TRAIN,
+    STATS_LIGHTS,
+    STATS_SUBMIT,
+    STATS_SECTION_COUNT
+} StatsSection;
+
+/* What the GPU's doing, for timestamp queries to charge its time to */
+
+typedef enum
+{
+    GPU_PASS_CLEAR,
+    GPU_PASS_PLATFORM,
+    GPU_PASS_TRACK,
+    GPU_PASS_TRAIN,
+    GPU_PASS_POST,
+    GPU_PASS_COUNT
+} GpuPass;
+
+//  What work submitted now counts towards, timed or not, so queued draws can say
+GpuPass scenePass = GPU_PASS_CLEAR;
+
+typedef struct
+{
+    long frame;
+    double sectionTime[STATS_SECTION_COUNT];
+    
+    int drawCalls;          //  glDrawElements and friends
+    int beginEndPairs;      //  Immediate mode glBegin/glEnd pairs
+    long vertices;          //  Vertices submitted, either way
+    int matrixPushes;
+    int lightChanges;       //  glLight calls, and lights switched on
+    int filteredChanges;    //  State changes the cache dropped, since they changed nothing
+    int transformUpdates;   //  Scene graph nodes whose world transforms were worked out again
+    int streamedSegments;   //  Track segments streamed into the ring
+    int stationLights;      //  Station fixtures binned into clusters
+    int occluded;           //  Segments, platforms and trains in view, but hidden behind others
+    int impostors;          //  Cars drawn as impostors
+    double tickTime;        //  How long the latest simulation tick took to move the trains, in ms
+    double gpuTime[GPU_PASS_COUNT];     //  GPU ms per pass, measured a few frames back
+    long gpuFrame;          //  Which frame the GPU times are from, or -1 if there aren't any yet
+} FrameStats;
+
+FrameStats frameStats;          //  The frame being drawn
+FrameStats lastFrameStats;      //  The frame before, for the overlay
+
+bool showStats = false;
+
+double secondsNow();
+
+/* Times a section of a frame, from here to the end of the scope */
+
+struct SectionTimer
+{
+    StatsSection section;
+    double start;
+    
+    SectionTimer(StatsSection section) : section(section), start(secondsNow()) {}
+    ~SectionTimer() { frameStats.sectionTime[section] += 1000.0 * (secondsNow() - start); }
+};
+
+void beginPrimitives(GLenum mode);
+void endPrimitives();
+
+void openStatsFiles();
+void closeStatsFiles();
+void finishFrameStats();
+void drawStatsOverlay();
+
+/* Timestamp queries around each pass, read back a few frames later */
+void buildGpuTimers();
+void destroyGpuTimers();
+void beginGpuFrame();
+void markGpuPass(GpuPass pass);
+void endGpuFrame();
 
 #pragma mark - Position
 
 // Math Yay
 #define DEG2RAD 0.0174532925
 
-//  Used for positioning trainsalong the track
-typedef struct { float x, y, z; } Vector3f;
-
-//  Position is per train
-std::vector<Vector3f> position;
-
 #define DEFAULT_X_TRANSLATE 0.0f
 #define DEFAULT_Y_TRANSLATE -1.1f
 #define DEFAULT_Z_TRANSLATE -5.0f
@@ -126,7 +570,7 @@ float blue[4] = {0.2f, .2f, 0.6f, 1.0f};
 #define WINDOW_WIDTH 480
 #define WINDOW_HEIGHT 320
 #define FRUSTUM_DEPTH 1000.0
-#define SCREEN_FPS 30.0
+#define SIMULATION_HZ 30.0        //  Trains move as fast as they did under the old 30 FPS timer
 
 #pragma mark - Train Constants
 
@@ -136,26 +580,112 @@ float blue[4] = {0.2f, .2f, 0.6f, 1.0f};
 #define TIE_HEIGHT 0.02
 #define TIE_DEPTH 0.04
 #define TRACK_SEGMENT_LENGTH 4.0
-#define TRACK_LENGTH 1000.0
+#define TRACK_BED_Y -0.6
+
+/* Tracks alternate sides of the platforms, working outwards */
+#define TRACK_OFFSET 1.5f
+#define TRACK_SPACING 2.0f
 
 /*  Car constants */
 #define CAR_LENGTH 2.0
 #define CAR_HEIGHT 1.1
-#define CARS_PER_TRAIN 10
 #define LIGHTS_PER_TRAIN 2
 
+/* Train constants */
+#define TRAIN_SPEED 0.1f
+#define TRAIN_SPACING 60.0f         //  Between trains on the same track
+#define TRAIN_START_Z 3.0f
+#define TRAIN_RESET_Z -3.0f
+
 /* Platform Constants */
-#define PLATFORM_LENGTH 30.0f
+#define PLATFORM_LENGTH 30.0f      //  Unless a network says otherwise
+#define PLATFORM_Y -0.4f
+
+/* The first few platforms keep their original spots, and the rest spread out from there */
+#define MAX_PLATFORM_COUNT 64
+#define PLATFORM_SPACING (PLATFORM_LENGTH*6)
+
+const float defaultPlatformOffsetZ[DEFAULT_PLATFORM_COUNT] = {-(PLATFORM_LENGTH*3), -(PLATFORM_LENGTH/2), (PLATFORM_LENGTH*3), (PLATFORM_LENGTH*3)};
+
+int platformCount = 0;
+float platformOffsetZ[MAX_PLATFORM_COUNT];
+
+/* There are only so many fixed function lights to go around */
+#define MAX_PLATFORM_LIGHTS 8
+
+/* The shader renderer has room for lots more, in the ceiling over each platform */
+#define MAX_FIXTURES_PER_PLATFORM 64
+#define FIXTURE_HEIGHT 1.5f         //  Above the platform
+#define FIXTURE_RADIUS 4.0f
+#define FIXTURE_CONE 60.0f          //  Degrees, either side of straight down
+
+const float fixtureColor[3] = {1.0f, 0.85f, 0.6f};
+
+/* What the camera can see this frame, filled in by cullScene() */
+bool platformVisible[MAX_PLATFORM_COUNT];
 
 /* Main Program */
 
 int main(int argc, char ** argv)
 {
+    //  Headless runs happen where there's no window system to talk to
+    bool headless = false;
+    
+    for (int i = 1; i < argc; i++) {
+        headless = headless || !strcmp(argv[i], "--headless") || !strcmp(argv[i], "--benchmark") || !strcmp(argv[i], "--compile-network");
+    }
+    
     //  The glut initialization function
-    glutInit(&argc, argv);
+    if (!headless) {
+        glutInit(&argc, argv);
+    }
+    
+    //  Whatever GLUT didn't recognize is ours
+    parseArguments(argc, argv);
+    
+    //  Compiling a network is all there is to do, when that's what was asked for
+    if (configuration.networkSourcePath) {
+        return compileNetwork(configuration.networkSourcePath, configuration.networkPath) ? 0 : 1;
+    }
+    
+    //  A network lays the scene out itself
+    if (configuration.networkPath) {
+        if (!mapNetwork(configuration.networkPath)) {
+            return 1;
+        }
+        
+        atexit(unmapNetwork);
+    }
+    
+    //  A replay brings its own scene size with it
+    openInputFiles();
+    atexit(closeInputFiles);
+    
+    //  Every track and train, allocated once
+    createRegistries(&configuration);
+    placePlatforms(&configuration);
+    placeStationLights(&configuration);
+    createSceneGraph(&configuration);
+    
+    //  Per frame statistics, if anyone asked for them
+    openStatsFiles();
+    atexit(closeStatsFiles);
+    
+    if (configuration.headless) {
+        return runHeadless();
+    }
+    
+    //  Set up display settings, asking for a core profile for the shader renderer
+#ifdef __APPLE__
+    glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GL_DOUBLE | (configuration.shaderRenderer ? GLUT_3_2_CORE_PROFILE : 0));
+#else
+    if (configuration.shaderRenderer) {
+        glutInitContextVersion(3, 2);
+        glutInitContextProfile(GLUT_CORE_PROFILE);
+    }
     
-    //  Set up display settings
     glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GL_DOUBLE);
+#endif
     
     //  Configure initial windowing settings
     glutInitWindowPosition(0, 0);
@@ -176,8 +706,12 @@ int main(int argc, char ** argv)
     //  Register the function that handles key down events
     glutKeyboardFunc(key);
     
-    //Set main loop
-	glutTimerFunc( 1000 / SCREEN_FPS, timedLoop, 0 );
+    //  Draw frames as fast as the display allows
+    glutIdleFunc(idle);
+    
+    //  Trains move on their own thread, at a fixed rate
+    startSimulation(true);
+    atexit(stopSimulation);
     
     //  Invoke the main loop
     glutMainLoop();
@@ -192,26 +726,64 @@ void init()
     //  Clear color
     glClearColor(0.0, 0.0, 0.0, 1.0);
     
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
+    //  Start from what a new context has
+    resetStateCache();
+    
+    disableState(GL_CULL_FACE);
+    enableState(GL_DEPTH_TEST);
+    
+    //  The core profile draws everything with its own shader. Otherwise,
+    //  there's a program shared by everything that's drawn with instancing.
+    if (configuration.shaderRenderer) {
+        if (!buildShaderRenderer()) {
+            std::cerr << "Couldn't build the shader renderer. Try --renderer fixed." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    else {
+        buildInstanceProgram();
+        
+        if (stationLights.count > 0) {
+            std::cerr << "Fixed function has no room for the station fixtures, so they stay dark." << std::endl;
+        }
+        
+        if (configuration.gpuTrainMotion) {
+            std::cerr << "Fixed function can't move the trains in a shader, so they're moved on the CPU." << std::endl;
+            configuration.gpuTrainMotion = false;
+        }
+    }
+    
+    //  The track's ring, which is streamed into as the camera moves
+    buildStaticTrackBatch();
     
-    //  Create a quadric for our glu cylinders
-    quadric = gluNewQuadric();
+    //  Neither do the platform floors
+    buildInstancedTiles();
     
-    // Ensure that we don't destroy colors with lighting
-    glEnable(GL_COLOR_MATERIAL);
+    //  Every wheel shares a handful of meshes
+    buildWheelMeshes();
     
-    //  Turn on lighting
-    glEnable(GL_LIGHTING);
-    glShadeModel(GL_SMOOTH);
+    //  And distant trains share an atlas of pictures
+    buildImpostors();
     
-    //Anti-aliasing
-    glEnable (GL_POLYGON_SMOOTH);
-    glEnable (GL_BLEND);
-
-    //This causes triangles to show.
-    //    glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glHint (GL_POLYGON_SMOOTH_HINT, GL_NICEST);
+    //  Unless the shader moves the trains, from their paths and a clock
+    buildGpuTrains();
+    
+    //  The shader renderer does its own lighting, and is done here
+    if (!configuration.shaderRenderer) {
+        
+        // Ensure that we don't destroy colors with lighting
+        enableState(GL_COLOR_MATERIAL);
+        
+        //  Turn on lighting
+        enableState(GL_LIGHTING);
+        glShadeModel(GL_SMOOTH);
+    }
+    
+    //  Edges are smoothed after the scene's drawn, so nothing opaque needs blending
+    disableState(GL_BLEND);
+    buildAntialiasing();
+    
+    buildGpuTimers();
 }
 
 
@@ -220,6 +792,18 @@ void reshape(int width, int height)
     
     float ratio = (float)width / (float)height;
     
+    //  The shader renderer keeps its own matrices. The glFrustum()
+    //  call below fails on its negative near plane, so it has no
+    //  part in them either.
+    if (configuration.shaderRenderer) {
+        perspectiveMatrix(45, ratio, 1.0, FRUSTUM_DEPTH);
+        loadIdentityMatrix();
+        glViewport(0, 0, width, height);
+        resizeLightClusters(width, height);
+        resizeAntialiasing(width, height);
+        return;
+    }
+    
     // Apply perspective matrix
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
@@ -229,9 +813,11 @@ void reshape(int width, int height)
     
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();
+    loadIdentityMatrix();
     
     // Change the camera to a 3D view
     	glViewport(0, 0, width, height);
+    resizeAntialiasing(width, height);
     glFrustum( -1 * (float) width/2,
               (float) width/2,
               -10.0,
@@ -243,68 +829,92 @@ void reshape(int width, int height)
 
 void displayTrainScene()
 {
+    SectionTimer timer(STATS_SCENE);
     
     //  Clear the previous frame
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
     // Push world matrix
-    glPushMatrix();
+    pushMatrix();
     {
         
-        glTranslated(translate[0], translate[1], translate[2]);
-        glRotatef(trackRotation[1], 0, 1, 0);
-        glRotatef(trackRotation[0], 1, 0, 0);
+        translateMatrix(translate[0], translate[1], translate[2]);
+        rotateMatrix(trackRotation[1], 0, 1, 0);
+        rotateMatrix(trackRotation[0], 1, 0, 0);
         
-        glPushMatrix();
-        {
-            glTranslatef(0.0f, -0.4f, -(PLATFORM_LENGTH*3
-                                        ));
-            platform(0);
+        //  Only the trains move, so only their subtrees are redone,
+        //  unless the shader's moving them
+        if (!configuration.gpuTrainMotion) {
+            for (int i = 0; i < trains.count; i++) {
+                placeTrainNodes(i);
+            }
         }
-        glPopMatrix();
         
-        glPushMatrix();
-        {
-            glTranslatef(0.0f, -0.4f, -(PLATFORM_LENGTH/2));
-            platform(1);
-        }
-        glPopMatrix();
+        updateSceneGraph();
+        setSceneView();
         
-        glPushMatrix();
-        {
-            glTranslatef(0.0f, -0.4f, (PLATFORM_LENGTH*3));
-            platform(2);
-        }
-        glPopMatrix();
+        //  Bring in the track around the camera, before it's culled
+        streamTrackAroundCamera();
         
+        //  Work out what the camera can see
+        updateFrustum();
+        cullScene();
         
-        glPushMatrix();
-        {
-            glTranslatef(0.0f, -0.4f, (PLATFORM_LENGTH*3));
-            platform(3);
+        //  The shader renderer lights the stations from their fixtures,
+        //  which were all set up once, so it only has to sort them
+        if (configuration.shaderRenderer) {
+            binStationLights();
         }
-        glPopMatrix();
         
-        //  Reset the number of trains
-        traintrackCount = 0;
+        markGpuPass(GPU_PASS_PLATFORM);
         
-        glPushMatrix();
-        {
-            glTranslatef(1.5f, 0.0f, 0.0f);
-            installTrack(1, 0);
+        for (int i = 0; i < platformCount; i++) {
+            pushMatrix();
+            {
+                loadSceneNode(platformNode(i));
+                
+                if (platformVisible[i]) {
+                    platform(i);
+                }
+                
+                //  These have never had a direction, so they've never
+                //  lit anything, and the shader renderer leaves them out
+                if (i < MAX_PLATFORM_LIGHTS && !configuration.shaderRenderer) {
+                    platformSpotlight(i);
+                }
+            }
+            popMatrix();
         }
-        glPopMatrix();
         
-        glPushMatrix();
-        {
-            glTranslatef(-1.5f, 0.0f, 0.0f);
-            installTrack(1, 1);
+        //  Every platform's floor tiles, once the platform lights are set
+        if (instancingSupported) {
+            drawInstancedTiles();
+        }
+        
+        markGpuPass(GPU_PASS_TRAIN);
+        
+        //  Every car of every train, wherever the shader works out it is
+        if (configuration.gpuTrainMotion) {
+            drawGpuTrains();
+        }
+        else {
+            beginImpostors();
+            
+            for (int i = 0; i < trains.count; i++) {
+                trainOnTrack(i);
+            }
+            
+            //  Every distant car, in a single draw
+            drawImpostors();
         }
-        glPopMatrix();
+        
+        //  Every track, in a single draw
+        markGpuPass(GPU_PASS_TRACK);
+        drawStaticTrackBatch();
         
     }
     
-    glPopMatrix();
+    popMatrix();
 }
 
 /* Test view */
@@ -316,27 +926,29 @@ void displayCar()
  
     
     // Push world matrix
-    glPushMatrix();
+    pushMatrix();
     {
-        glTranslated(translate[0], translate[1], translate[2]);
+        translateMatrix(translate[0], translate[1], translate[2]);
         
-        glPushMatrix();
+        pushMatrix();
         {
-            glTranslatef(0, -CAR_HEIGHT, 0);
-            glBegin(GL_QUADS);
-            glColor4fv(yellow);
+            translateMatrix(0, -CAR_HEIGHT, 0);
+            setColor4fv(yellow);
             rectangularPrism(100, 1, 100);
-            glEnd();
             
-            glTranslatef(0, CAR_HEIGHT, 0);
+            translateMatrix(0, CAR_HEIGHT, 0);
+            
+            GLfloat carTransform[16];
+            identityMatrix(carTransform);
             
             car(0, 0);
+            wheels(carTransform, 1);
             
         }
-        glPopMatrix();
+        popMatrix();
         
     }
-    glPopMatrix();
+    popMatrix();
     
 }
 
@@ -344,18 +956,56 @@ void displayCar()
 
 void display()
 {
-//    displayCar();
-    
-    glPushMatrix();
     {
-        glRotated(worldRotation[1], 0, 1, 0);
-        displayTrainScene();
+        SectionTimer timer(STATS_DISPLAY);
+        
+    //    displayCar();
+        
+        //  Catch the view up with a replay
+        applyReplayedViewKeys();
+        
+        //  Place the trains between the last two simulation ticks
+        interpolateTrains();
+        
+        //  The scene goes into a framebuffer of its own, to be smoothed
+        beginGpuFrame();
+        beginAntialiasedFrame();
+        
+        pushMatrix();
+        {
+            rotateMatrix(worldRotation[1], 0, 1, 0);
+            displayTrainScene();
+        }
+        popMatrix();
+        
+        //  Everything that was queued, sorted by mesh
+        flushDrawList();
+        
+        markGpuPass(GPU_PASS_POST);
+        finishAntialiasedFrame();
+        endGpuFrame();
+        
+        //  Last frame's numbers, over this frame
+        if (showStats) {
+            drawStatsOverlay();
+        }
+        
+        // Flush and swap.
+        if (!configuration.headless) {
+            glutSwapBuffers();
+        }
+        
+        glFlush();
     }
-    glPopMatrix();
     
-    // Flush and swap.
-    glutSwapBuffers();
-    glFlush();
+    finishFrameStats();
+}
+
+/* Keeps frames coming, as fast as the display allows */
+
+void idle()
+{
+    glutPostRedisplay();
 }
 
 
@@ -382,12 +1032,42 @@ void display()
 
 void key(unsigned char key, int x, int y)
 {
-    float deltaPos = 0.1;
+    //  While replaying, the recording is the only input
+    if (replayingInput()) {
+        return;
+    }
     
-    if (traintrackDirection[traintrackUserControlled] == 0) {
-        deltaPos *= -1;
+    //  Everything but the trains changes right away
+    viewKey(key);
+    
+    switch (key) {
+        case 'z':
+        case 'x':
+        case 'r':
+        case 'p':
+            //  The simulation thread owns the trains, if there are any
+            if (trains.count > 0) {
+                queueTrainCommand(key, trainUserControlled);
+            }
+            break;
+        default:
+            //  So that replays see the same view
+            recordViewKey(key);
+            break;
     }
+    
+    glutPostRedisplay();
+}
+
+/*
+ 
+ Applies whatever a key does to the view. The trains' side of
+ things is handled by the simulation, in applyTrainCommand().
+ 
+ */
 
+void viewKey(unsigned char key)
+{
     switch (key) {
         case 'a':
             translate[0]++;
@@ -407,35 +1087,32 @@ void key(unsigned char key, int x, int y)
         case 's':
             translate[2]--;
             break;
-        case 'z':
-            position[traintrackUserControlled].x -= sin(DEG2RAD * trackRotation[1]) * deltaPos;
-            position[traintrackUserControlled].z += cos(DEG2RAD * trackRotation[1]) * deltaPos;
-            break;
-        case 'x':
-            position[traintrackUserControlled].x += sin(DEG2RAD * trackRotation[1]) * deltaPos;
-            position[traintrackUserControlled].z -= cos(DEG2RAD * trackRotation[1]) * deltaPos;
-            break;
         case 'l':
         {
-            bool light = glIsEnabled(GL_LIGHTING);
+            if (configuration.shaderRenderer) {
+                toggleShaderLighting();
+                break;
+            }
+            
+            bool light = stateEnabled(GL_LIGHTING);
             
             if (light) {
-                glDisable(GL_LIGHTING);
+                disableState(GL_LIGHTING);
             }
             else
             {
                 
-                glEnable(GL_LIGHTING);
+                enableState(GL_LIGHTING);
             }
         }
             break;
         case 't':
             
-            if (traintrackUserControlled < traintrackCount-1) {
-                traintrackUserControlled++;
+            if (trainUserControlled < trains.count-1) {
+                trainUserControlled++;
             }
             else{
-                traintrackUserControlled = 0;
+                trainUserControlled = 0;
             }
             
             break;
@@ -447,12 +1124,6 @@ void key(unsigned char key, int x, int y)
             worldRotation[0] = 0;
             worldRotation[1] = 0;
             worldRotation[2] = 0;
-
-            for (int i = 0; i < position.size(); i++) {
-                position[i].x = 0.0f;
-                position[i].y = 0.0f;
-                position[i].z = -3.0f;
-            }
             
             translate[0]= DEFAULT_X_TRANSLATE;
             translate[1]= DEFAULT_Y_TRANSLATE;
@@ -464,136 +1135,89 @@ void key(unsigned char key, int x, int y)
         case 'k':
             worldRotation[1]--;
             break;
-        case 'p':
-            paused = !paused;
+        case 'i':
+            showStats = !showStats;
             break;
         default:
             break;
     }
-
-    
-    glutPostRedisplay();
 }
 
 /* Cleans up at the end of our program */
 
 void cleanup()
 {
-    gluDeleteQuadric(quadric);
-}
-
-#pragma mark - Rail Line Drawing
-
-/* configures a track */
-void installTrack(bool showTrain, int direction)
-{
-    traintrackShowTrain[traintrackCount] = showTrain;
-    traintrackDirection[traintrackCount] = direction;
+    destroyStaticTrackBatch();
+    destroyInstancedTiles();
+    destroyWheelMeshes();
+    destroyImpostors();
+    destroyGpuTrains();
+    destroyPrismMeshes();
+    destroyDrawList();
+    destroyAntialiasing();
+    destroyGpuTimers();
     
-//    if(position.size() < NUMBER_OF_TRACKS){
-        Vector3f vector = {0.0f, 0.0, 3.0f};
-        position.push_back(vector);
-//    }
-
-    trackWithID(traintrackCount);
-    traintrackCount++;
+    if (configuration.shaderRenderer) {
+        destroyShaderRenderer();
+    }
+    else {
+        destroyInstanceProgram();
+    }
+    
+    destroyRegistries();
 }
 
-void trackWithID(int id)
+#pragma mark - Rail Line Drawing
+
+/* Draws a train, wherever it is on its track */
+void trainOnTrack(int trainID)
 {
+    int trackID = trains.trackID[trainID];
     
-    if(traintrackShowTrain[id]){
-        //  New matrix allows train movement along the track.
-        glPushMatrix();
+    if(tracks.showTrains[trackID] && trains.visible[trainID]){
+        
+        //  Far enough away, and pictures of its cars will do
+        if (queueTrainImpostors(trainID)) {
+            return;
+        }
+        
+        //  The train's node follows it along the track
+        pushMatrix();
         {
-            //  Controllable translation applies only to the car
-            glTranslatef(position[id].x, position[id].y, position[id].z);
+            loadSceneNode(trainNode(trainID));
         
             // Render the train
-            train(id);
+            train(trainID);
         }
-        glPopMatrix();
+        popMatrix();
     }
     
-    // Render the track
-    glPushMatrix();
-    {
-        //  Move track down
-        glTranslatef(0, -0.6, 0);
-        
-        //  Render the track
-        track();
-    }
-    glPopMatrix();
+    //  The track itself lives in the static batch
 }
 
 #pragma mark - Car Parts
 
-void wheel()
-{
-    glPushMatrix();
-    {
-        //  Rotate the wheels to be aligned with the track
-        glRotatef(90, 0.0, 1.0, 0);
-        
-        //  Make them dark gray
-        glColor4fv(darkGray);
-        gluCylinder(quadric, 0.08, 0.06, 0.05, 32, 32);
-    }
-    glPopMatrix();
-}
+/* Draws the body of a car. The wheels are drawn for the whole train at once, by wheels(). */
 
 void car(int carID, int trainID)
 {
     /*  Car */
     
-    const float xFromCarCenter = 0.5;
-    const float yFromCarCenter = 0.5;
-    
-    glPushMatrix();
-    {
-        glTranslatef(0, 0.04, 0);
-        
-        glBegin(GL_QUADS);
-        {
-            glColor3f(0.7f, 0.7f, 0.71f);
-            rectangularPrism(1.0, CAR_HEIGHT, CAR_LENGTH);
-            
-        }
-        glEnd();
-    }
-    
-    glPopMatrix();
-    
-    /* 4 Wheels */
-    
-    glPushMatrix();
-    {
-        glTranslatef(-xFromCarCenter, -yFromCarCenter, CAR_LENGTH/2.0);
-        wheel();
-    }
-    glPopMatrix();
-    
-    glPushMatrix();
-    {
-        glTranslatef(xFromCarCenter, -yFromCarCenter, CAR_LENGTH/2.0);
-        wheel();
+    //  Or the same, from a mesh, for the shader renderer
+    if (configuration.shaderRenderer) {
+        drawCarMesh();
+        return;
     }
-    glPopMatrix();
     
-    glPushMatrix();
+    pushMatrix();
     {
-        glTranslatef(-xFromCarCenter, -yFromCarCenter, -CAR_LENGTH/2.0);
-        wheel();
+        translateMatrix(0, 0.04, 0);
+        
+        setColor3f(0.7f, 0.7f, 0.71f);
+        rectangularPrism(1.0, CAR_HEIGHT, CAR_LENGTH);
     }
-    glPopMatrix();
     
-    glPushMatrix();
-    {
-        glTranslatef(xFromCarCenter, -yFromCarCenter, -CAR_LENGTH/2.0);
-        wheel();
-    }
-    glPopMatrix();
+    popMatrix();
 }
 
 
@@ -601,44 +1225,39 @@ void car(int carID, int trainID)
 
 void train(int trainID)
 {
-    glPushMatrix();
-    {
-        
-        float numCars = 10;
-        
-        for (int i = 0; i <numCars; i++) {
+    SectionTimer timer(STATS_TRAIN);
+    
+    for (int i = 0; i < configuration.carsPerTrain; i++) {
+        pushMatrix();
+        {
+            loadSceneNode(carNode(trainID, i));
             car(i, trainID);
-            glTranslatef(0, 0, -CAR_LENGTH*1.2);
         }
+        popMatrix();
     }
-    glPopMatrix();
+    
+    /* Every wheel on the train, following its cars */
+    
+    wheels(&sceneGraph.local[carNode(trainID, 0) * 16], configuration.carsPerTrain);
 }
 
 #pragma mark - Track
 
-void track()
-{
-    
-    /* Add track in segments */
-    
-    float backOfTrack = -TRACK_LENGTH;
-    
-    //  Start from the back and keep adding ties
-    while (backOfTrack < TRACK_LENGTH)
-    {
-        glPushMatrix();
-        {
-            glTranslatef(0, 0, backOfTrack);
-            trackSegmentOfLength(TRACK_SEGMENT_LENGTH);
-        }
-        glPopMatrix();
-        
-        backOfTrack += TRACK_SEGMENT_LENGTH;
-    }
-}
+/*
+ 
+ The track doesn't draw anything itself. Instead, a segment at a
+ time is emitted into a mesh builder, in world space, and streamed
+ into the track's ring by streamTrack().
+ 
+ */
+
+/* Emits a segment of a track, following its path */
 
-void trackSegmentOfLength(GLfloat length)
+void trackSegment(MeshBuilder *builder, int trackID, int segment)
 {
+    float start = segment * TRACK_SEGMENT_LENGTH;
+    
+    PathPoint position, direction;
     
     /* Add railroad ties to the tracks */
     
@@ -646,63 +1265,34 @@ void trackSegmentOfLength(GLfloat length)
     float segmentPosition = 0;
     
     //  Start from the back and keep adding ties
-    while (segmentPosition < (float)length)
+    while (segmentPosition < (float)TRACK_SEGMENT_LENGTH)
     {
-        glPushMatrix();
-        {
-            glTranslatef(0, 0, segmentPosition);
-            tie();
-        }
-        glPopMatrix();
+        trackPointAt(trackID, start + segmentPosition, &position, &direction);
+        tie(builder, position.x, TRACK_BED_Y, position.z, direction.x, direction.z);
         
         segmentPosition += spaceBetweenTies + (TIE_DEPTH*5);
     }
 
     
-    /* Now add the rails. */
+    /* Now add the rails, across from the start of the segment */
     
-    glPushMatrix();
-    {
-        glTranslatef(-0.45, 0, 0);
-        railOfLength(length);
-    }
-    glPopMatrix();
+    trackPointAt(trackID, start, &position, &direction);
     
-    glPushMatrix();
-    {
-        glTranslatef(0.5, 0, 0);
-        railOfLength(length);
-    }
-    glPopMatrix();
+    float rails[3] = {-0.45f, 0.5f, 0.2f};      //  The last is the third rail - 600V!
     
-    /* The third rail - 600V! */
-    glPushMatrix();
-    {
-        glTranslatef(0.2, 0, 0);
-        railOfLength(length);
+    for (int i = 0; i < 3; i++) {
+        railOfLength(builder, position.x + rails[i] * direction.z, TRACK_BED_Y, position.z - rails[i] * direction.x, direction.x, direction.z, TRACK_SEGMENT_LENGTH);
     }
-    glPopMatrix();
-    
 }
 
-void tie()
+void tie(MeshBuilder *builder, float x, float y, float z, float directionX, float directionZ)
 {
-    glBegin(GL_QUADS);
-    {
-        glColor3fv(darkBrown);
-        rectangularPrism(TIE_WIDTH, TIE_HEIGHT, TIE_DEPTH);
-    }
-    glEnd();
+    appendTurnedPrism(builder, x, y, z, TIE_WIDTH, TIE_HEIGHT, TIE_DEPTH, directionX, directionZ, darkBrown);
 }
 
-void railOfLength(GLfloat length)
+void railOfLength(MeshBuilder *builder, float x, float y, float z, float directionX, float directionZ, GLfloat length)
 {
-    glBegin(GL_QUADS);
-    {
-        glColor3f(0.3, 0.3, 0.3);
-        rectangularPrism(0.06, 0.04, length);
-    }
-    glEnd();
+    appendTurnedPrism(builder, x, y, z, 0.06, 0.04, length, directionX, directionZ, darkGray);
 }
 
 #pragma mark - Subway Station
@@ -715,7 +1305,8 @@ float stripHeight = 0.02f;
 
 float tileSide = stripWidth*4;
 float tileRows = (platformWidth-stripWidth)/tileSide;
-float tileColumns = PLATFORM_LENGTH/tileSide;
+float platformLength = PLATFORM_LENGTH;
+float tileColumns = platformLength/tileSide;
 
 float pillarHeight = tileSide*6;
 
@@ -723,50 +1314,34 @@ float pillarHeight = tileSide*6;
 
 void safetyStrip()
 {
-    glBegin(GL_QUADS);
-    {
-        rectangularPrism(stripWidth, stripHeight, PLATFORM_LENGTH);
-    }
-    glEnd();
+    rectangularPrism(stripWidth, stripHeight, platformLength);
 }
 
 /* Draws a square tile on the platform */
 
 void horizontalTile()
 {
-    glBegin(GL_QUADS);
-    {
-        rectangularPrism(tileSide, stripHeight, tileSide);
-    }
-    glEnd();
+    rectangularPrism(tileSide, stripHeight, tileSide);
 }
 
 /* Draws a base for the platform */
 
 void platformBase()
 {
-    glBegin(GL_QUADS);
-    {
-        glColor4fv(darkGray);
-        
-        //  Platform surface
-        rectangularPrism(platformWidth, platformHeight, PLATFORM_LENGTH);
-    }
-    glEnd();
+    setColor4fv(darkGray);
+    
+    //  Platform surface
+    rectangularPrism(platformWidth, platformHeight, platformLength);
 }
 
 /* Draws a pillar */
 void pillar()
 {
-    glBegin(GL_QUADS);
-    {
-        //  Make it blue
-        glColor4fv(blue);
-        
-        //  Platform surface
-        rectangularPrism(tileSide, pillarHeight, tileSide);
-    }
-    glEnd();
+    //  Make it blue
+    setColor4fv(blue);
+    
+    //  Platform surface
+    rectangularPrism(tileSide, pillarHeight, tileSide);
 }
 
 /*
@@ -777,7 +1352,16 @@ void pillar()
  */
 void platform(int platformID)
 {
-    glPushMatrix();
+    SectionTimer timer(STATS_PLATFORM);
+    
+    //  The core profile has no immediate mode, so the shader
+    //  renderer draws all of this, but the tiles, from one mesh
+    if (configuration.shaderRenderer) {
+        drawPlatformMesh();
+        return;
+    }
+    
+    pushMatrix();
     {
         //  Draw the base of the platform
         platformBase();
@@ -786,25 +1370,26 @@ void platform(int platformID)
         //  Safety Strips
         //
         
-        glColor4fv(yellow);  //  Draw em yellow
+        setColor4fv(yellow);  //  Draw em yellow
         
-        glPushMatrix();
+        pushMatrix();
         {
-            glTranslatef(-platformWidth/2-stripWidth, platformHeight/2+stripHeight, 0);
+            loadSceneNode(platformStripNode(platformID, 0));
             safetyStrip();
         }
-        glPopMatrix();
+        popMatrix();
         
-        glPushMatrix();
+        pushMatrix();
         {
-            glTranslatef(platformWidth/2+stripWidth, platformHeight/2+stripHeight, 0);
+            loadSceneNode(platformStripNode(platformID, 1));
             safetyStrip();
         }
-        glPopMatrix();
+        popMatrix();
         
         /* Floor Tiles */
         
-        glPushMatrix();
+        //  Without instancing, fall back to drawing each tile
+        if (!instancingSupported)
         {
             for (int i = 0; i <tileRows;i++) {
                 
@@ -814,101 +1399,68 @@ void platform(int platformID)
                     
                     alternateColor(lightGray, darkGray);
                     
-                    glPushMatrix();
+                    pushMatrix();
                     {
                         //
                         //  Adjust for the tile and platform offset
                         //
                         
                         float tileOriginX = (-platformWidth/2)+tileSide/2+tileSide*i;
-                        float tileOriginZ = (-PLATFORM_LENGTH/2)+tileSide*j;
+                        float tileOriginZ = (-platformLength/2)+tileSide*j;
                         
-                        glTranslatef(tileOriginX, platformHeight/2 + stripHeight, tileOriginZ);
+                        translateMatrix(tileOriginX, platformHeight/2 + stripHeight, tileOriginZ);
                         horizontalTile();
                     }
-                    glPopMatrix();
+                    popMatrix();
                 }
             }
         }
-        glPopMatrix();
         
         /* Pillars */
         
-        {
-        //  Front left
-        glPushMatrix();
-        {
-            glTranslatef(-platformWidth/2+tileSide, platformHeight/2+(pillarHeight/2), PLATFORM_LENGTH/2 - tileSide);
-            pillar();
-        }
-        glPopMatrix();
-        
-        //  Front right
-        glPushMatrix();
-        {
-            glTranslatef(platformWidth/2-tileSide, platformHeight/2+(pillarHeight/2), PLATFORM_LENGTH/2 - tileSide);
-            pillar();
-        }
-        glPopMatrix();
-        
-        //  Middle right
-        glPushMatrix();
-        {
-            glTranslatef(platformWidth/2-tileSide, platformHeight/2+(pillarHeight/2), 0);
-            pillar();
-        }
-        glPopMatrix();
-        
-        //  Middle Left
-        glPushMatrix();
-        {
-            glTranslatef(-platformWidth/2+tileSide, platformHeight/2+(pillarHeight/2), 0);
-            pillar();
-        }
-        glPopMatrix();
-        
-        //  Back right
-        glPushMatrix();
-        {
-            glTranslatef(platformWidth/2-tileSide, platformHeight/2+(pillarHeight/2), -PLATFORM_LENGTH/2 + tileSide);
-            pillar();
-        }
-        glPopMatrix();
-        
-        //  Back left
-        glPushMatrix();
-        {
-            glTranslatef(-platformWidth/2+tileSide, platformHeight/2+(pillarHeight/2), -PLATFORM_LENGTH/2 + tileSide);
-            pillar();
-        }
-        glPopMatrix();
+        //  Front, middle and back, on either side
+        for (int pillarID = 0; pillarID < PLATFORM_PILLAR_NODES; pillarID++) {
+            pushMatrix();
+            {
+                loadSceneNode(platformPillarNode(platformID, pillarID));
+                pillar();
+            }
+            popMatrix();
         }
-        
-        /* Platform spotlight */
-        
-        float lightID = platformID;
-        
-        GLfloat position[4] = {0,-(platformHeight/2)+pillarHeight*2,0,1};
-        GLfloat direction[4] = {0, 0, 0};
-        GLfloat ambient[4] = {0.7, 0.7, 0.7, 0.1};
-        GLfloat specular[4] = {0.7, 0.7, 0.7, 0.1};
-        GLfloat diffuse[4] = {0.7, 0.7, 0.7, 0.01};
-    
-        configureSpotlight(lightID, position, direction, 90, 2);
-        configureAmbientLight(lightID, position, direction, ambient);
-        setLightColor(lightID, ambient, specular, diffuse);
     }    
-    glPopMatrix();
+    popMatrix();
+    
+}
+
+/*
+ 
+ Configures the light over a platform. This is separate from
+ platform(), since the light still shines when the platform
+ itself has been culled.
+ 
+ */
+void platformSpotlight(int platformID)
+{
+    float lightID = platformID;
+    
+    GLfloat position[4] = {0,-(platformHeight/2)+pillarHeight*2,0,1};
+    GLfloat direction[4] = {0, 0, 0};
+    GLfloat ambient[4] = {0.7, 0.7, 0.7, 0.1};
+    GLfloat specular[4] = {0.7, 0.7, 0.7, 0.1};
+    GLfloat diffuse[4] = {0.7, 0.7, 0.7, 0.01};
     
+    configureSpotlight(lightID, position, direction, 90, 2);
+    configureAmbientLight(lightID, position, direction, ambient);
+    setLightColor(lightID, ambient, specular, diffuse);
 }
 
 #pragma mark - Lighting
 
 void setLightColor(GLenum light, float *ambientColor, float *specularColor, float *diffuseColor)
 {
-    if(ambientColor)    glLightfv(light, GL_AMBIENT, ambientColor);
-    if(specularColor)   glLightfv(light, GL_SPECULAR, specularColor);
-    if(diffuseColor)    glLightfv(light, GL_DIFFUSE, diffuseColor);
+    if(ambientColor)    lightfv(light, GL_AMBIENT, ambientColor);
+    if(specularColor)   lightfv(light, GL_SPECULAR, specularColor);
+    if(diffuseColor)    lightfv(light, GL_DIFFUSE, diffuseColor);
 }
 
 /* Converts an int to a gl #defined light */
@@ -933,14 +1485,14 @@ void configureSpotlight(GLenum lightID, float *position, float *direction, float
     // "unwrap" the light
     lightID = _glLightForInt(lightID);
     
-    glLightfv(lightID, GL_POSITION, position );
-    glLightfv(lightID, GL_SPOT_DIRECTION, direction);
-    glLightf(lightID, GL_SPOT_CUTOFF, angle); // angle is 0 to 90 or 180
-    glLightf(lightID, GL_SPOT_EXPONENT, exponent); // exponent is 0 to 128
+    lightfv(lightID, GL_POSITION, position );
+    lightfv(lightID, GL_SPOT_DIRECTION, direction);
+    lightf(lightID, GL_SPOT_CUTOFF, angle); // angle is 0 to 90 or 180
+    lightf(lightID, GL_SPOT_EXPONENT, exponent); // exponent is 0 to 128
     
-    glLightf(lightID, GL_LINEAR_ATTENUATION, 1.0);
+    lightf(lightID, GL_LINEAR_ATTENUATION, 1.0);
     
-    glEnable(lightID);
+    enableLight(lightID);
 }
 
 /* Configures a light as an ambient light */
@@ -949,11 +1501,11 @@ void configureAmbientLight(GLenum lightID, float *position, float *direction, fl
     // "unwrap" the light
     lightID = _glLightForInt(lightID);
     
-    glLightfv(lightID, GL_POSITION, position );
-    glLightfv(lightID, GL_SPOT_DIRECTION, direction);
-    glLightfv(lightID, GL_AMBIENT, color);
+    lightfv(lightID, GL_POSITION, position );
+    lightfv(lightID, GL_SPOT_DIRECTION, direction);
+    lightfv(lightID, GL_AMBIENT, color);
     
-    glEnable(lightID);
+    enableLight(lightID);
 }
 
 
@@ -961,132 +1513,8073 @@ void configureAmbientLight(GLenum lightID, float *position, float *direction, fl
 
 /*
  
- Calls the prism function without a texture
+ Draws a prism centered on the origin, from the cached mesh for
+ its size, in the current color.
  
  */
 
 void rectangularPrism(float width, float height, float length){
     
-    glEnable(GL_NORMALIZE);
+    drawPrismMesh(prismMeshFor(width, height, length));
+}
+
+
+#pragma mark - Static Batches
+
+/*
+ 
+ Geometry that never moves is emitted once into a MeshBuilder,
+ with its final position baked in, then uploaded into a vertex
+ buffer and an index buffer. Drawing it is then a single call,
+ instead of a few dozen immediate mode calls per prism.
+ 
+ */
+
+typedef struct
+{
+    GLfloat position[3];
+    GLfloat normal[3];
+    GLubyte color[4];
+} BatchVertex;
+
+//  Where the shader renderer's program reads each part of a vertex
+#define POSITION_ATTRIBUTE 0
+#define NORMAL_ATTRIBUTE 1
+#define COLOR_ATTRIBUTE 2
+
+typedef struct
+{
+    float min[3];
+    float max[3];
+} Bounds;
+
+/* A range of a batch's indices that can be drawn (or culled) on its own */
+
+typedef struct
+{
+    GLuint firstIndex;
+    GLsizei indexCount;
+    Bounds bounds;
+} MeshPart;
+
+struct MeshBuilder
+{
+    std::vector<BatchVertex> vertices;
+    std::vector<GLuint> indices;
+    std::vector<MeshPart> parts;
     
+    //  Where the part being built starts
+    GLuint partFirstVertex;
+    GLuint partFirstIndex;
+};
+
+typedef struct
+{
+    GLuint vertexBuffer;
+    GLuint indexBuffer;
+    GLsizei indexCount;
+    std::vector<MeshPart> parts;
+} StaticBatch;
+
+StaticBatch trackBatch;
+
+/* Outward normals, and the corners of each face, counterclockwise when seen from outside */
+
+static const float prismFaceNormals[6][3] =
+{
+    { 0,  0, -1},   //  Back
+    { 0,  0,  1},   //  Front
+    { 0,  1,  0},   //  Top
+    { 0, -1,  0},   //  Bottom
+    {-1,  0,  0},   //  Left
+    { 1,  0,  0}    //  Right
+};
+
+static const float prismFaceCorners[6][4][3] =
+{
+    {{ 1, -1, -1}, {-1, -1, -1}, {-1,  1, -1}, { 1,  1, -1}},
+    {{-1, -1,  1}, { 1, -1,  1}, { 1,  1,  1}, {-1,  1,  1}},
+    {{-1,  1,  1}, { 1,  1,  1}, { 1,  1, -1}, {-1,  1, -1}},
+    {{-1, -1, -1}, { 1, -1, -1}, { 1, -1,  1}, {-1, -1,  1}},
+    {{-1, -1, -1}, {-1, -1,  1}, {-1,  1,  1}, {-1,  1, -1}},
+    {{ 1, -1,  1}, { 1, -1, -1}, { 1,  1, -1}, { 1,  1,  1}}
+};
+
+void appendPrism(MeshBuilder *builder, float x, float y, float z, float width, float height, float length, const float *color)
+{
+    appendTurnedPrism(builder, x, y, z, width, height, length, 0, 1, color);
+}
+
+/*
+ 
+ The same, turned about y so that its length runs along a unit
+ direction, (directionX, directionZ), instead of along z.
+ 
+ */
+
+void appendTurnedPrism(MeshBuilder *builder, float x, float y, float z, float width, float height, float length, float directionX, float directionZ, const float *color)
+{
     float faceWidth = width/2;
     float faceHeight = height/2;
     float faceLength = length/2;
     
-    /* Back Normal */
-    glNormal3f(faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    
-    /* Back Surface */
-    glVertex3d(faceWidth, faceHeight, -faceLength);
-    glVertex3d(faceWidth, -faceHeight, -faceLength);
-    glVertex3d(-faceWidth, -faceHeight, -faceLength);
-    glVertex3d(-faceWidth, faceHeight, -faceLength);
-    
-    /* Front Normal */
-    glNormal3f(faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    
-    /* Front Surface */
-    glVertex3d(faceWidth, faceHeight, faceLength);
-    glVertex3d(faceWidth, -faceHeight, faceLength);
-    glVertex3d(-faceWidth, -faceHeight, faceLength);
-    glVertex3d(-faceWidth, faceHeight, faceLength);
-    
-    /* Top Normal */
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, -faceHeight, faceLength);
-    glNormal3f(-faceWidth, -faceHeight, faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    
-    /* Top Surface */
-    glVertex3d(faceWidth, faceHeight, -faceLength);
-    glVertex3d(-faceWidth, faceHeight, -faceLength);
-    glVertex3d(-faceWidth, faceHeight, faceLength);
-    glVertex3d(faceWidth, faceHeight, faceLength);
-    
-    
-    /* Bottom Normal */
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, -faceHeight, faceLength);
-    glNormal3f(-faceWidth, -faceHeight, faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    
-    /* Bottom Surface */
-    glVertex3d(faceWidth, -faceHeight, -faceLength);
-    glVertex3d(-faceWidth, -faceHeight, -faceLength);
-    glVertex3d(-faceWidth, -faceHeight, faceLength);
-    glVertex3d(faceWidth, -faceHeight, faceLength);
-    
-    /* Left Normal */
-    glNormal3f(faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    
-    /* Left Surface */
-    glVertex3d(-faceWidth, faceHeight, -faceLength);
-    glVertex3d(-faceWidth, -faceHeight, -faceLength);
-    glVertex3d(-faceWidth, -faceHeight, faceLength);
-    glVertex3d(-faceWidth, faceHeight, faceLength);
-    
-    /* Right Normal */
-    glNormal3f(faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, -faceLength);
-    glNormal3f(-faceWidth, faceHeight, faceLength);
-    glNormal3f(faceWidth, faceHeight, faceLength);
-    
-    /* Right Surface */
-    glVertex3d(faceWidth, faceHeight, -faceLength);
-    glVertex3d(faceWidth, -faceHeight, -faceLength);
-    glVertex3d(faceWidth, -faceHeight, faceLength);
-    glVertex3d(faceWidth, faceHeight, faceLength);
-    
-    glDisable(GL_NORMALIZE);
+    for (int face = 0; face < 6; face++) {
+        
+        GLuint firstVertex = (GLuint)builder->vertices.size();
+        
+        for (int corner = 0; corner < 4; corner++) {
+            
+            BatchVertex vertex;
+            
+            float across = prismFaceCorners[face][corner][0] * faceWidth;
+            float along = prismFaceCorners[face][corner][2] * faceLength;
+            
+            //  Across turns to (directionZ, -directionX), and along to the direction
+            vertex.position[0] = x + (across * directionZ + along * directionX);
+            vertex.position[1] = y + prismFaceCorners[face][corner][1] * faceHeight;
+            vertex.position[2] = z + (along * directionZ - across * directionX);
+            
+            const float *normal = prismFaceNormals[face];
+            
+            vertex.normal[0] = normal[0] * directionZ + normal[2] * directionX;
+            vertex.normal[1] = normal[1];
+            vertex.normal[2] = normal[2] * directionZ - normal[0] * directionX;
+            
+            for (int i = 0; i < 4; i++) {
+                vertex.color[i] = (GLubyte)(color[i] * 255.0f + 0.5f);
+            }
+            
+            builder->vertices.push_back(vertex);
+        }
+        
+        //  Two triangles per face
+        GLuint faceIndices[6] = {0, 1, 2, 0, 2, 3};
+        
+        for (int i = 0; i < 6; i++) {
+            builder->indices.push_back(firstVertex + faceIndices[i]);
+        }
+    }
 }
 
+/* Everything emitted between these two calls becomes one part of the mesh */
 
-#pragma mark - Animation
-
-/* Timer */
+void beginMeshPart(MeshBuilder *builder)
+{
+    builder->partFirstVertex = (GLuint)builder->vertices.size();
+    builder->partFirstIndex = (GLuint)builder->indices.size();
+}
 
-void updateTrain(int id)
+void endMeshPart(MeshBuilder *builder)
 {
+    MeshPart part;
     
-    float deltaPos = -0.1;
+    part.firstIndex = builder->partFirstIndex;
+    part.indexCount = (GLsizei)(builder->indices.size() - builder->partFirstIndex);
     
-    if(paused)
-    {
-        return;
+    for (int i = 0; i < 3; i++) {
+        part.bounds.min[i] = builder->vertices[builder->partFirstVertex].position[i];
+        part.bounds.max[i] = part.bounds.min[i];
     }
     
-    if (traintrackDirection[id] == 0) {
-        deltaPos *= -1;
+    for (size_t v = builder->partFirstVertex; v < builder->vertices.size(); v++) {
+        for (int i = 0; i < 3; i++) {
+            part.bounds.min[i] = fminf(part.bounds.min[i], builder->vertices[v].position[i]);
+            part.bounds.max[i] = fmaxf(part.bounds.max[i], builder->vertices[v].position[i]);
+        }
     }
     
-    position[id].x -= sin(DEG2RAD * trackRotation[1]) * deltaPos;
-    position[id].z += cos(DEG2RAD * trackRotation[1]) * deltaPos;
+    builder->parts.push_back(part);
+}
+
+/* Uploads the contents of a mesh builder into a new batch */
+
+StaticBatch uploadStaticBatch(MeshBuilder *builder)
+{
+    StaticBatch batch;
     
-    if (position[id].z > FRUSTUM_DEPTH) {
-        position[id].z = -FRUSTUM_DEPTH;
-    }
+    glGenBuffers(1, &batch.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, batch.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, builder->vertices.size() * sizeof(BatchVertex), &builder->vertices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    glGenBuffers(1, &batch.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, builder->indices.size() * sizeof(GLuint), &builder->indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    
+    batch.indexCount = (GLsizei)builder->indices.size();
+    batch.parts = builder->parts;
+    
+    return batch;
 }
 
-void timedLoop(int val)
+/*
+ 
+ Points the vertex arrays at a batch. The fixed function renderer
+ uses its own arrays, and the shader renderer generic attributes.
+ Instanced draws leave the colors to their instances.
+ 
+ */
+
+void bindBatchVertices(StaticBatch *batch, bool withColors)
 {
-    //  Update each train's position
-    for (int i=0; i<traintrackCount; i++) {
-        updateTrain(i);
+    glBindBuffer(GL_ARRAY_BUFFER, batch->vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->indexBuffer);
+    
+    if (configuration.shaderRenderer) {
+        glEnableVertexAttribArray(POSITION_ATTRIBUTE);
+        glEnableVertexAttribArray(NORMAL_ATTRIBUTE);
+        
+        glVertexAttribPointer(POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, position));
+        glVertexAttribPointer(NORMAL_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, normal));
+        
+        if (withColors) {
+            glEnableVertexAttribArray(COLOR_ATTRIBUTE);
+            glVertexAttribPointer(COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, color));
+        }
+        
+        return;
     }
     
-    display();
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    
+    glVertexPointer(3, GL_FLOAT, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, position));
+    glNormalPointer(GL_FLOAT, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, normal));
+    
+    if (withColors) {
+        glEnableClientState(GL_COLOR_ARRAY);
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(BatchVertex), (const GLvoid *)offsetof(BatchVertex, color));
+    }
+}
+
+void unbindBatchVertices(bool withColors)
+{
+    if (configuration.shaderRenderer) {
+        if (withColors) {
+            glDisableVertexAttribArray(COLOR_ATTRIBUTE);
+        }
+        
+        glDisableVertexAttribArray(NORMAL_ATTRIBUTE);
+        glDisableVertexAttribArray(POSITION_ATTRIBUTE);
+    }
+    else {
+        if (withColors) {
+            glDisableClientState(GL_COLOR_ARRAY);
+            
+            //  Drawing from a color array leaves the current color undefined
+            forgetColor();
+        }
+        
+        glDisableClientState(GL_NORMAL_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+    }
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/*
+ 
+ Draws ranges of a batch's indices, with one call. A partCount
+ of -1 draws the whole batch.
+ 
+ */
+
+void drawStaticBatchRanges(StaticBatch *batch, const GLsizei *partIndexCounts, const GLvoid * const *partOffsets, GLsizei partCount)
+{
+    if (batch->indexCount == 0 || partCount == 0) {
+        return;
+    }
+    
+    if (configuration.shaderRenderer) {
+        prepareShaderDraw(false, SHADER_DRAW_MODELVIEW);
+    }
+    
+    bindBatchVertices(batch, true);
+    
+    //  Either the whole batch, or just the parts that were asked for
+    if (partCount < 0) {
+        glDrawElements(GL_TRIANGLES, batch->indexCount, GL_UNSIGNED_INT, 0);
+        frameStats.vertices += batch->indexCount;
+    }
+    else if (partCount > 0) {
+        glMultiDrawElements(GL_TRIANGLES, partIndexCounts, GL_UNSIGNED_INT, (const GLvoid **)partOffsets, partCount);
+        
+        for (GLsizei i = 0; i < partCount; i++) {
+            frameStats.vertices += partIndexCounts[i];
+        }
+    }
+    
+    frameStats.drawCalls++;
+    
+    unbindBatchVertices(true);
+}
+
+void drawStaticBatch(StaticBatch *batch)
+{
+    drawStaticBatchRanges(batch, NULL, NULL, -1);
+}
+
+void destroyStaticBatch(StaticBatch *batch)
+{
+    glDeleteBuffers(1, &batch->vertexBuffer);
+    glDeleteBuffers(1, &batch->indexBuffer);
+    
+    batch->vertexBuffer = 0;
+    batch->indexBuffer = 0;
+    batch->indexCount = 0;
+    batch->parts.clear();
+}
+
+#pragma mark - Prism Meshes
+
+/*
+ 
+ Every prism drawn one at a time comes from here. There are only
+ a handful of sizes, so each gets a mesh of its own the first time
+ it's asked for, with a normal for each face, and no colors, so it
+ takes on the current color. Looking one up is a short search.
+ 
+ */
+
+void queueDraw(StaticBatch *mesh, bool meshColors);
+
+typedef struct
+{
+    float width;
+    float height;
+    float length;
+    StaticBatch *mesh;          //  Queued draws point at it, so it mustn't move
+} PrismMesh;
+
+std::vector<PrismMesh> prismMeshes;
+
+/* Finds the mesh for a size of prism, building it if it's new */
+
+int prismMeshFor(float width, float height, float length)
+{
+    for (size_t i = 0; i < prismMeshes.size(); i++) {
+        if (prismMeshes[i].width == width && prismMeshes[i].height == height && prismMeshes[i].length == length) {
+            return (int)i;
+        }
+    }
+    
+    MeshBuilder builder;
+    appendPrism(&builder, 0, 0, 0, width, height, length, white);
+    
+    PrismMesh prism;
+    
+    prism.width = width;
+    prism.height = height;
+    prism.length = length;
+    prism.mesh = new StaticBatch(uploadStaticBatch(&builder));
+    
+    prismMeshes.push_back(prism);
+    
+    return (int)prismMeshes.size() - 1;
+}
+
+/* Queues the prism, in the current color, to be drawn with the others like it */
+
+void drawPrismMesh(int prism)
+{
+    queueDraw(prismMeshes[prism].mesh, false);
+}
+
+void destroyPrismMeshes()
+{
+    for (size_t i = 0; i < prismMeshes.size(); i++) {
+        destroyStaticBatch(prismMeshes[i].mesh);
+        delete prismMeshes[i].mesh;
+    }
+    
+    prismMeshes.clear();
+}
+
+
+#pragma mark - Shaders
+
+/* Compiles a shader, logging and returning 0 on failure */
+
+GLuint compileShader(GLenum type, const char *source)
+{
+    GLuint shader = glCreateShader(type);
+    
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    
+    GLint compiled = GL_FALSE;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    
+    if (!compiled) {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        std::cerr << "Shader failed to compile: " << log << std::endl;
+        
+        glDeleteShader(shader);
+        return 0;
+    }
+    
+    return shader;
+}
+
+/* Links a program, binding the named attributes to the given locations first */
+
+GLuint linkProgram(const char *vertexSource, const char *fragmentSource, const char **attributeNames, const GLuint *attributeLocations, int attributeCount)
+{
+    GLuint vertexShader = compileShader(GL_VERTEX_SHADER, vertexSource);
+    GLuint fragmentShader = compileShader(GL_FRAGMENT_SHADER, fragmentSource);
+    
+    if (!vertexShader || !fragmentShader) {
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        return 0;
+    }
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, fragmentShader);
+    
+    for (int i = 0; i < attributeCount; i++) {
+        glBindAttribLocation(program, attributeLocations[i], attributeNames[i]);
+    }
+    
+    glLinkProgram(program);
+    
+    //  The program keeps the shaders alive for as long as it needs them
+    glDeleteShader(vertexShader);
+    glDeleteShader(fragmentShader);
+    
+    GLint linked = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    
+    if (!linked) {
+        char log[1024];
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        std::cerr << "Program failed to link: " << log << std::endl;
+        
+        glDeleteProgram(program);
+        return 0;
+    }
+    
+    return program;
+}
+
+/* Checks for an extension in the current context */
+
+bool hasExtension(const char *name)
+{
+    //  A core profile lists them one at a time
+    if (configuration.shaderRenderer) {
+        
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        
+        for (GLint i = 0; i < count; i++) {
+            if (!strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name)) {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    return gluCheckExtension((const GLubyte *)name, glGetString(GL_EXTENSIONS)) == GL_TRUE;
+}
+
+
+#pragma mark - Instancing
+
+/*
+ 
+ Geometry that repeats, like floor tiles and wheels, is uploaded
+ once and drawn with a per-instance offset and color.
+ 
+ The fixed function pipeline can't offset instances on its own,
+ so the vertex shader does that, and mimics fixed function
+ lighting using the built-in light and material state.
+ 
+ */
+
+static const char *instanceVertexShader =
+    "#version 120\n"
+    "\n"
+    "attribute vec3 instanceOffset;\n"
+    "attribute vec4 instanceColor;\n"
+    "\n"
+    "uniform bool lightingEnabled;\n"
+    "uniform float lightEnabled[8];\n"
+    "\n"
+    "varying vec4 color;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 vertex = gl_Vertex + vec4(instanceOffset, 0.0);\n"
+    "    vec3 eyePosition = (gl_ModelViewMatrix * vertex).xyz;\n"
+    "    gl_Position = gl_ModelViewProjectionMatrix * vertex;\n"
+    "\n"
+    "    if (!lightingEnabled) {\n"
+    "        color = instanceColor;\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    vec3 normal = normalize(gl_NormalMatrix * gl_Normal);\n"
+    "    vec3 lit = gl_FrontMaterial.emission.rgb + gl_LightModel.ambient.rgb * instanceColor.rgb;\n"
+    "\n"
+    "    for (int i = 0; i < 8; i++) {\n"
+    "        if (lightEnabled[i] == 0.0) {\n"
+    "            continue;\n"
+    "        }\n"
+    "\n"
+    "        vec4 lightPosition = gl_LightSource[i].position;\n"
+    "        vec3 toLight = normalize(lightPosition.xyz);\n"
+    "        float attenuation = 1.0;\n"
+    "\n"
+    "        if (lightPosition.w != 0.0) {\n"
+    "            vec3 offset = lightPosition.xyz - eyePosition;\n"
+    "            float distance = length(offset);\n"
+    "            toLight = offset / distance;\n"
+    "            attenuation = 1.0 / (gl_LightSource[i].constantAttenuation\n"
+    "                               + gl_LightSource[i].linearAttenuation * distance\n"
+    "                               + gl_LightSource[i].quadraticAttenuation * distance * distance);\n"
+    "\n"
+    "            if (gl_LightSource[i].spotCutoff != 180.0) {\n"
+    "                vec3 spotDirection = gl_LightSource[i].spotDirection;\n"
+    "                float spotDot = length(spotDirection) > 0.0 ? dot(-toLight, normalize(spotDirection)) : 0.0;\n"
+    "                attenuation *= spotDot < gl_LightSource[i].spotCosCutoff ? 0.0 : pow(max(spotDot, 0.0), gl_LightSource[i].spotExponent);\n"
+    "            }\n"
+    "        }\n"
+    "\n"
+    "        float diffuse = max(dot(normal, toLight), 0.0);\n"
+    "        vec3 contribution = gl_LightSource[i].ambient.rgb * instanceColor.rgb\n"
+    "                          + gl_LightSource[i].diffuse.rgb * instanceColor.rgb * diffuse;\n"
+    "\n"
+    "        if (diffuse > 0.0) {\n"
+    "            vec3 halfVector = normalize(toLight + vec3(0.0, 0.0, 1.0));\n"
+    "            contribution += gl_FrontLightProduct[i].specular.rgb * pow(max(dot(normal, halfVector), 0.0), gl_FrontMaterial.shininess);\n"
+    "        }\n"
+    "\n"
+    "        lit += attenuation * contribution;\n"
+    "    }\n"
+    "\n"
+    "    color = vec4(lit, instanceColor.a);\n"
+    "}\n";
+
+static const char *instanceFragmentShader =
+    "#version 120\n"
+    "\n"
+    "varying vec4 color;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = color;\n"
+    "}\n";
+
+//  Generic attributes 6 and 7 don't alias any of the fixed function arrays
+#define INSTANCE_OFFSET_ATTRIBUTE 6
+#define INSTANCE_COLOR_ATTRIBUTE 7
+
+typedef struct
+{
+    GLfloat offset[3];
+    GLubyte color[4];
+} Instance;
+
+GLuint instanceProgram = 0;
+GLint instanceLightingEnabledUniform = -1;
+GLint instanceLightEnabledUniform = -1;
+
+void buildInstanceProgram()
+{
+    instancingSupported = false;
+    
+    if (!hasExtension("GL_ARB_instanced_arrays") || !hasExtension("GL_ARB_draw_instanced") || !hasExtension("GL_ARB_shading_language_100")) {
+        return;
+    }
+    
+    const char *attributeNames[2] = {"instanceOffset", "instanceColor"};
+    const GLuint attributeLocations[2] = {INSTANCE_OFFSET_ATTRIBUTE, INSTANCE_COLOR_ATTRIBUTE};
+    
+    instanceProgram = linkProgram(instanceVertexShader, instanceFragmentShader, attributeNames, attributeLocations, 2);
+    
+    if (!instanceProgram) {
+        return;
+    }
+    
+    instanceLightingEnabledUniform = glGetUniformLocation(instanceProgram, "lightingEnabled");
+    instanceLightEnabledUniform = glGetUniformLocation(instanceProgram, "lightEnabled");
+    
+    instancingSupported = true;
+}
+
+void destroyInstanceProgram()
+{
+    if (instanceProgram) {
+        glDeleteProgram(instanceProgram);
+        instanceProgram = 0;
+    }
+    
+    instancingSupported = false;
+}
+
+/* Draws count instances of a mesh, starting at the given instance in the buffer */
+
+void drawInstanced(StaticBatch *mesh, GLuint instanceBuffer, GLsizei firstInstance, GLsizei count)
+{
+    if (count == 0) {
+        return;
+    }
+    
+    if (configuration.shaderRenderer) {
+        prepareShaderDraw(true, SHADER_DRAW_MODELVIEW);
+    }
+    else {
+        glUseProgram(instanceProgram);
+        
+        /* Hand the shader the fixed function lighting switches */
+        
+        GLfloat lightEnabled[8];
+        
+        for (int i = 0; i < 8; i++) {
+            lightEnabled[i] = stateEnabled(GL_LIGHT0 + i) ? 1.0f : 0.0f;
+        }
+        
+        glUniform1i(instanceLightingEnabledUniform, stateEnabled(GL_LIGHTING));
+        glUniform1fv(instanceLightEnabledUniform, 8, lightEnabled);
+    }
+    
+    /* The shared mesh */
+    
+    bindBatchVertices(mesh, false);
+    
+    /* One offset and color per instance */
+    
+    glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+    
+    glEnableVertexAttribArray(INSTANCE_OFFSET_ATTRIBUTE);
+    glEnableVertexAttribArray(INSTANCE_COLOR_ATTRIBUTE);
+    
+    GLsizeiptr firstByte = firstInstance * sizeof(Instance);
+    
+    glVertexAttribPointer(INSTANCE_OFFSET_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (const GLvoid *)(firstByte + offsetof(Instance, offset)));
+    glVertexAttribPointer(INSTANCE_COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Instance), (const GLvoid *)(firstByte + offsetof(Instance, color)));
+    
+    glVertexAttribDivisorARB(INSTANCE_OFFSET_ATTRIBUTE, 1);
+    glVertexAttribDivisorARB(INSTANCE_COLOR_ATTRIBUTE, 1);
+    
+    glDrawElementsInstancedARB(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, 0, count);
+    
+    frameStats.drawCalls++;
+    frameStats.vertices += (long)mesh->indexCount * count;
+    
+    glVertexAttribDivisorARB(INSTANCE_OFFSET_ATTRIBUTE, 0);
+    glVertexAttribDivisorARB(INSTANCE_COLOR_ATTRIBUTE, 0);
+    
+    glDisableVertexAttribArray(INSTANCE_COLOR_ATTRIBUTE);
+    glDisableVertexAttribArray(INSTANCE_OFFSET_ATTRIBUTE);
+    
+    unbindBatchVertices(false);
+    
+    //  The shader renderer's program stays bound
+    if (!configuration.shaderRenderer) {
+        glUseProgram(0);
+    }
+}
+
+
+#pragma mark - Draw List
+
+/*
+ 
+ Meshes drawn one at a time aren't drawn straight away. They're
+ queued with the modelview and color they'd have had, and once
+ the scene's been walked, the queue is sorted by mesh, then by
+ color, and submitted. The shader renderer draws all the copies
+ of a mesh with one instanced call, which reads each copy's
+ modelview and color from an instance buffer. Fixed function
+ has no modelview per instance, so it still draws the copies one
+ by one, but binds each mesh once, and only changes color when
+ the color changes.
+ 
+ The track, and the tiles and wheels that are already instanced,
+ are drawn a call at a time, so they don't go through here.
+ 
+ */
+
+typedef struct
+{
+    GpuPass pass;               //  Which pass queued it, so it's timed with the rest of that pass
+    StaticBatch *mesh;
+    bool meshColors;            //  Does the mesh have colors of its own?
+    GLfloat color[4];           //  If not, what color is it?
+    GLfloat modelview[16];
+} QueuedDraw;
+
+/* What each copy of a mesh reads, when the shader renderer draws them together */
+
+typedef struct
+{
+    GLfloat modelview[16];
+    GLubyte color[4];
+} DrawInstance;
+
+//  Where the shader renderer's program reads each copy's modelview, a column per attribute
+#define INSTANCE_MODELVIEW_ATTRIBUTE 8
+
+//  Kept around between frames so that queueing doesn't allocate
+std::vector<QueuedDraw> drawList;
+std::vector<const QueuedDraw *> sortedDraws;
+std::vector<DrawInstance> drawInstances;
+
+GLuint drawInstanceBuffer = 0;
+
+void queueDraw(StaticBatch *mesh, bool meshColors)
+{
+    QueuedDraw draw;
+    
+    draw.pass = scenePass;
+    draw.mesh = mesh;
+    draw.meshColors = meshColors;
+    
+    memcpy(draw.color, currentColor(), sizeof(draw.color));
+    getModelviewMatrix(draw.modelview);
+    
+    drawList.push_back(draw);
+}
+
+/* Sorts by pass, then by mesh, then by color */
+
+bool queuedDrawBefore(const QueuedDraw *first, const QueuedDraw *second)
+{
+    if (first->pass != second->pass) {
+        return first->pass < second->pass;
+    }
+    
+    if (first->mesh != second->mesh) {
+        return std::less<StaticBatch *>()(first->mesh, second->mesh);
+    }
+    
+    return memcmp(first->color, second->color, sizeof(first->color)) < 0;
+}
+
+/* Draws every copy of each mesh with one call */
+
+void submitInstancedDraws()
+{
+    drawInstances.resize(sortedDraws.size());
+    
+    for (size_t i = 0; i < sortedDraws.size(); i++) {
+        memcpy(drawInstances[i].modelview, sortedDraws[i]->modelview, sizeof(drawInstances[i].modelview));
+        
+        for (int c = 0; c < 4; c++) {
+            drawInstances[i].color[c] = (GLubyte)(sortedDraws[i]->color[c] * 255.0f + 0.5f);
+        }
+    }
+    
+    if (!drawInstanceBuffer) {
+        glGenBuffers(1, &drawInstanceBuffer);
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, drawInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, drawInstances.size() * sizeof(DrawInstance), &drawInstances[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    for (size_t first = 0, last = 0; first < sortedDraws.size(); first = last) {
+        
+        StaticBatch *mesh = sortedDraws[first]->mesh;
+        bool meshColors = sortedDraws[first]->meshColors;
+        GpuPass pass = sortedDraws[first]->pass;
+        
+        while (last < sortedDraws.size() && sortedDraws[last]->mesh == mesh && sortedDraws[last]->pass == pass) {
+            last++;
+        }
+        
+        markGpuPass(pass);
+        
+        GLsizei count = (GLsizei)(last - first);
+        
+        prepareShaderDraw(!meshColors, SHADER_INSTANCE_MODELVIEWS);
+        bindBatchVertices(mesh, meshColors);
+        
+        /* One modelview and color per copy */
+        
+        glBindBuffer(GL_ARRAY_BUFFER, drawInstanceBuffer);
+        
+        GLsizeiptr firstByte = first * sizeof(DrawInstance);
+        
+        for (int column = 0; column < 4; column++) {
+            glEnableVertexAttribArray(INSTANCE_MODELVIEW_ATTRIBUTE + column);
+            glVertexAttribPointer(INSTANCE_MODELVIEW_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, sizeof(DrawInstance), (const GLvoid *)(firstByte + column * 4 * sizeof(GLfloat)));
+            glVertexAttribDivisorARB(INSTANCE_MODELVIEW_ATTRIBUTE + column, 1);
+        }
+        
+        glEnableVertexAttribArray(INSTANCE_COLOR_ATTRIBUTE);
+        glVertexAttribPointer(INSTANCE_COLOR_ATTRIBUTE, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(DrawInstance), (const GLvoid *)(firstByte + offsetof(DrawInstance, color)));
+        glVertexAttribDivisorARB(INSTANCE_COLOR_ATTRIBUTE, 1);
+        
+        glDrawElementsInstancedARB(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, 0, count);
+        
+        frameStats.drawCalls++;
+        frameStats.vertices += (long)mesh->indexCount * count;
+        
+        glVertexAttribDivisorARB(INSTANCE_COLOR_ATTRIBUTE, 0);
+        glDisableVertexAttribArray(INSTANCE_COLOR_ATTRIBUTE);
+        
+        for (int column = 0; column < 4; column++) {
+            glVertexAttribDivisorARB(INSTANCE_MODELVIEW_ATTRIBUTE + column, 0);
+            glDisableVertexAttribArray(INSTANCE_MODELVIEW_ATTRIBUTE + column);
+        }
+        
+        unbindBatchVertices(meshColors);
+    }
+}
+
+/* Draws each copy on its own, but binds each mesh only once */
+
+void submitFixedFunctionDraws()
+{
+    for (size_t first = 0, last = 0; first < sortedDraws.size(); first = last) {
+        
+        StaticBatch *mesh = sortedDraws[first]->mesh;
+        bool meshColors = sortedDraws[first]->meshColors;
+        GpuPass pass = sortedDraws[first]->pass;
+        
+        markGpuPass(pass);
+        bindBatchVertices(mesh, meshColors);
+        
+        for (last = first; last < sortedDraws.size() && sortedDraws[last]->mesh == mesh && sortedDraws[last]->pass == pass; last++) {
+            
+            if (!meshColors) {
+                setColor4fv(sortedDraws[last]->color);
+            }
+            
+            glLoadMatrixf(sortedDraws[last]->modelview);
+            glDrawElements(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, 0);
+            
+            frameStats.drawCalls++;
+            frameStats.vertices += mesh->indexCount;
+        }
+        
+        unbindBatchVertices(meshColors);
+    }
+    
+    //  Put back the modelview the draws were queued under
+    GLfloat modelview[16];
+    getModelviewMatrix(modelview);
+    glLoadMatrixf(modelview);
+}
+
+/* Sorts and draws everything that's been queued, then empties the queue */
+
+void flushDrawList()
+{
+    SectionTimer timer(STATS_SUBMIT);
+    
+    if (drawList.empty()) {
+        return;
+    }
+    
+    sortedDraws.clear();
+    
+    for (size_t i = 0; i < drawList.size(); i++) {
+        sortedDraws.push_back(&drawList[i]);
+    }
+    
+    std::sort(sortedDraws.begin(), sortedDraws.end(), queuedDrawBefore);
+    
+    if (configuration.shaderRenderer) {
+        submitInstancedDraws();
+    }
+    else {
+        submitFixedFunctionDraws();
+    }
+    
+    drawList.clear();
+}
+
+void destroyDrawList()
+{
+    glDeleteBuffers(1, &drawInstanceBuffer);
+    drawInstanceBuffer = 0;
+    
+    drawList.clear();
+}
+
+
+#pragma mark - Matrices
+
+/*
+ 
+ A core profile has no matrix stack, so the scene pushes, moves
+ and turns through these. The modelview is kept here, column
+ major like OpenGL's, so queued draws can take a copy without
+ asking OpenGL for it. The shader renderer keeps its projection
+ here too, and hands both to its program through uniform buffers.
+ With fixed function, they're passed on to OpenGL as well.
+ 
+ */
+
+typedef struct
+{
+    GLfloat m[16];
+} Matrix;
+
+std::vector<Matrix> modelviewStack(1);
+Matrix projectionMatrix;
+
+//  Has the projection changed since the shader renderer last uploaded it?
+bool projectionChanged = true;
+
+void identityMatrix(GLfloat *matrix)
+{
+    for (int i = 0; i < 16; i++) {
+        matrix[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    }
+}
+
+/* left times right, into result, which can't be either of them */
+
+void multiplyMatrices(const GLfloat *left, const GLfloat *right, GLfloat *result)
+{
+    for (int column = 0; column < 4; column++) {
+        for (int row = 0; row < 4; row++) {
+            result[column * 4 + row] = 0;
+            
+            for (int k = 0; k < 4; k++) {
+                result[column * 4 + row] += left[k * 4 + row] * right[column * 4 + k];
+            }
+        }
+    }
+}
+
+/* Multiplies the top of the modelview stack by another matrix, on the right, like glMultMatrix */
+
+void multiplyModelview(const GLfloat *other)
+{
+    GLfloat result[16];
+    
+    multiplyMatrices(modelviewStack.back().m, other, result);
+    memcpy(modelviewStack.back().m, result, sizeof(result));
+}
+
+/* Replaces the top of the modelview stack, like glLoadMatrix */
+
+void loadMatrix(const GLfloat *matrix)
+{
+    memcpy(modelviewStack.back().m, matrix, sizeof(GLfloat) * 16);
+    
+    if (!configuration.shaderRenderer) {
+        glLoadMatrixf(matrix);
+    }
+}
+
+/* Multiplies in another transform, like glMultMatrix */
+
+void multiplyMatrix(const GLfloat *matrix)
+{
+    if (!configuration.shaderRenderer) {
+        glMultMatrixf(matrix);
+    }
+    
+    multiplyModelview(matrix);
+}
+
+void pushMatrix()
+{
+    frameStats.matrixPushes++;
+    
+    modelviewStack.push_back(modelviewStack.back());
+    
+    if (!configuration.shaderRenderer) {
+        glPushMatrix();
+    }
+}
+
+void popMatrix()
+{
+    modelviewStack.pop_back();
+    
+    if (!configuration.shaderRenderer) {
+        glPopMatrix();
+    }
+}
+
+void translateMatrix(GLfloat x, GLfloat y, GLfloat z)
+{
+    if (!configuration.shaderRenderer) {
+        glTranslatef(x, y, z);
+    }
+    
+    GLfloat translation[16];
+    identityMatrix(translation);
+    
+    translation[12] = x;
+    translation[13] = y;
+    translation[14] = z;
+    
+    multiplyModelview(translation);
+}
+
+/* Turns angle degrees about an axis, the same way glRotate does */
+
+void rotateMatrix(GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
+{
+    if (!configuration.shaderRenderer) {
+        glRotatef(angle, x, y, z);
+    }
+    
+    float length = sqrtf(x * x + y * y + z * z);
+    
+    if (length == 0.0f) {
+        return;
+    }
+    
+    x /= length;
+    y /= length;
+    z /= length;
+    
+    float c = cosf(angle * DEG2RAD);
+    float s = sinf(angle * DEG2RAD);
+    float t = 1.0f - c;
+    
+    GLfloat rotation[16] =
+    {
+        x * x * t + c,      y * x * t + z * s,  x * z * t - y * s,  0,
+        x * y * t - z * s,  y * y * t + c,      y * z * t + x * s,  0,
+        x * z * t + y * s,  y * z * t - x * s,  z * z * t + c,      0,
+        0,                  0,                  0,                  1
+    };
+    
+    multiplyModelview(rotation);
+}
+
+/* Replaces the projection, the same way gluPerspective does */
+
+void perspectiveMatrix(GLfloat fovy, GLfloat aspect, GLfloat zNear, GLfloat zFar)
+{
+    double radians = fovy / 2 * DEG2RAD;
+    double cotangent = cos(radians) / sin(radians);
+    double depth = zFar - zNear;
+    
+    GLfloat *m = projectionMatrix.m;
+    memset(m, 0, sizeof(projectionMatrix.m));
+    
+    m[0] = cotangent / aspect;
+    m[5] = cotangent;
+    m[10] = -(zFar + zNear) / depth;
+    m[11] = -1;
+    m[14] = -2 * zNear * zFar / depth;
+    
+    projectionChanged = true;
+}
+
+/* Empties the modelview stack, leaving just the identity */
+
+void loadIdentityMatrix()
+{
+    modelviewStack.resize(1);
+    identityMatrix(modelviewStack.back().m);
+}
+
+void getModelviewMatrix(GLfloat *matrix)
+{
+    memcpy(matrix, modelviewStack.back().m, sizeof(GLfloat) * 16);
+}
+
+void getProjectionMatrix(GLfloat *matrix)
+{
+    if (configuration.shaderRenderer) {
+        memcpy(matrix, projectionMatrix.m, sizeof(GLfloat) * 16);
+    }
+    else {
+        glGetFloatv(GL_PROJECTION_MATRIX, matrix);
+    }
+}
+
+
+#pragma mark - Scene Graph
+
+/*
+ 
+ Everything that's placed in the scene one piece at a time has a
+ node here: the platforms and their strips and pillars, and the
+ trains and their cars. Each node keeps its transform relative to
+ its parent, and its world transform, which is only worked out
+ again when it or one of its parents moves. Parents always come
+ before their children, so one pass over the nodes does it.
+ 
+ Drawing a node then takes one multiply, by the camera's view.
+ The wheels are instanced relative to their train, and the ties
+ and rails are baked into the track, so neither needs nodes.
+ 
+ */
+
+//  The camera, which every node is drawn through
+GLfloat sceneView[16];
+
+int platformNode(int platformID)
+{
+    return 1 + platformID * PLATFORM_NODES;
+}
+
+int platformStripNode(int platformID, int strip)
+{
+    return platformNode(platformID) + 1 + strip;
+}
+
+int platformPillarNode(int platformID, int pillar)
+{
+    return platformNode(platformID) + 1 + PLATFORM_STRIP_NODES + pillar;
+}
+
+int trainNode(int trainID)
+{
+    return sceneGraph.firstTrainNode + trainID * (1 + sceneGraph.carsPerTrain);
+}
+
+int carNode(int trainID, int carID)
+{
+    return trainNode(trainID) + 1 + carID;
+}
+
+/* Adds a node, offset from its parent */
+
+void addSceneNode(int node, int parent, float x, float y, float z)
+{
+    GLfloat *local = &sceneGraph.local[node * 16];
+    
+    identityMatrix(local);
+    
+    local[12] = x;
+    local[13] = y;
+    local[14] = z;
+    
+    sceneGraph.parent[node] = parent;
+    sceneGraph.dirty[node] = true;
+}
+
+/*
+ 
+ Builds a node for everything in the scene, all of which need
+ their world transforms worked out on the next update. Call it
+ after placePlatforms().
+ 
+ */
+
+void createSceneGraph(Configuration *configuration)
+{
+    sceneGraph.carsPerTrain = configuration->carsPerTrain;
+    sceneGraph.firstTrainNode = 1 + platformCount * PLATFORM_NODES;
+    sceneGraph.count = sceneGraph.firstTrainNode + trains.count * (1 + configuration->carsPerTrain);
+    
+    sceneGraph.parent = new int[sceneGraph.count];
+    sceneGraph.local = new float[sceneGraph.count * 16];
+    sceneGraph.world = new float[sceneGraph.count * 16];
+    sceneGraph.dirty = new bool[sceneGraph.count];
+    sceneGraph.updated = new bool[sceneGraph.count];
+    
+    //  The root, which is the whole scene
+    addSceneNode(0, -1, 0, 0, 0);
+    
+    float stripX = platformWidth/2+stripWidth;
+    float stripY = platformHeight/2+stripHeight;
+    
+    float pillarX = platformWidth/2-tileSide;
+    float pillarY = platformHeight/2+(pillarHeight/2);
+    float pillarZ[3] = {platformLength/2 - tileSide, 0, -platformLength/2 + tileSide};
+    
+    for (int i = 0; i < platformCount; i++) {
+        
+        addSceneNode(platformNode(i), 0, 0.0f, PLATFORM_Y, platformOffsetZ[i]);
+        
+        addSceneNode(platformStripNode(i, 0), platformNode(i), -stripX, stripY, 0);
+        addSceneNode(platformStripNode(i, 1), platformNode(i), stripX, stripY, 0);
+        
+        //  Front, middle and back, on either side
+        for (int pillar = 0; pillar < PLATFORM_PILLAR_NODES; pillar++) {
+            float side = (pillar % 2 == 0) ? -1.0f : 1.0f;
+            addSceneNode(platformPillarNode(i, pillar), platformNode(i), side * pillarX, pillarY, pillarZ[pillar / 2]);
+        }
+    }
+    
+    for (int i = 0; i < trains.count; i++) {
+        
+        //  Moved into place before each frame's drawn, cars and all
+        addSceneNode(trainNode(i), 0, 0, 0, 0);
+        
+        for (int carID = 0; carID < configuration->carsPerTrain; carID++) {
+            addSceneNode(carNode(i, carID), trainNode(i), 0, 0, -CAR_LENGTH*1.2 * carID);
+        }
+    }
+}
+
+void destroySceneGraph()
+{
+    delete [] sceneGraph.parent;
+    delete [] sceneGraph.local;
+    delete [] sceneGraph.world;
+    delete [] sceneGraph.dirty;
+    delete [] sceneGraph.updated;
+    
+    sceneGraph.count = 0;
+}
+
+/*
+ 
+ Moves a node relative to its parent, and turns it about y so that
+ its z axis points along a unit direction, (directionX, directionZ).
+ Its subtree is only marked dirty if it actually moved.
+ 
+ */
+
+void placeSceneNode(int node, float x, float y, float z, float directionX, float directionZ)
+{
+    GLfloat *local = &sceneGraph.local[node * 16];
+    
+    if (local[12] == x && local[13] == y && local[14] == z && local[8] == directionX && local[10] == directionZ) {
+        return;
+    }
+    
+    //  The x axis turns to (directionZ, -directionX)
+    local[0] = directionZ;
+    local[2] = -directionX;
+    local[8] = directionX;
+    local[10] = directionZ;
+    
+    local[12] = x;
+    local[13] = y;
+    local[14] = z;
+    
+    sceneGraph.dirty[node] = true;
+}
+
+/*
+ 
+ Puts a train's node where it's drawn along its track, and each
+ of its cars further back along the track's path, relative to it,
+ so they follow the track around bends.
+ 
+ */
+
+void placeTrainNodes(int trainID)
+{
+    int trackID = trains.trackID[trainID];
+    double distance = drawnTrains.distance[trainID];
+    
+    PathPoint front, frontDirection;
+    trackPointAt(trackID, distance, &front, &frontDirection);
+    
+    placeSceneNode(trainNode(trainID), front.x, drawnTrains.positionY[trainID], front.z, frontDirection.x, frontDirection.z);
+    
+    for (int carID = 0; carID < sceneGraph.carsPerTrain; carID++) {
+        
+        PathPoint position, direction;
+        trackPointAt(trackID, distance - CAR_LENGTH*1.2 * carID, &position, &direction);
+        
+        //  Turned back into the train's own frame
+        float offsetX = position.x - front.x;
+        float offsetZ = position.z - front.z;
+        
+        float x = offsetX * frontDirection.z - offsetZ * frontDirection.x;
+        float z = offsetX * frontDirection.x + offsetZ * frontDirection.z;
+        
+        float directionX = direction.x * frontDirection.z - direction.z * frontDirection.x;
+        float directionZ = direction.x * frontDirection.x + direction.z * frontDirection.z;
+        
+        placeSceneNode(carNode(trainID, carID), x, 0, z, directionX, directionZ);
+    }
+}
+
+/* Works out the world transforms of every node that moved, and everything under them */
+
+void updateSceneGraph()
+{
+    //  Trains that the shader moves never have their nodes moved
+    int count = configuration.gpuTrainMotion ? sceneGraph.firstTrainNode : sceneGraph.count;
+    
+    for (int node = 0; node < count; node++) {
+        
+        int parent = sceneGraph.parent[node];
+        
+        sceneGraph.updated[node] = sceneGraph.dirty[node] || (parent >= 0 && sceneGraph.updated[parent]);
+        
+        if (!sceneGraph.updated[node]) {
+            continue;
+        }
+        
+        GLfloat *world = &sceneGraph.world[node * 16];
+        const GLfloat *local = &sceneGraph.local[node * 16];
+        
+        if (parent < 0) {
+            memcpy(world, local, sizeof(GLfloat) * 16);
+        }
+        else {
+            multiplyMatrices(&sceneGraph.world[parent * 16], local, world);
+        }
+        
+        sceneGraph.dirty[node] = false;
+        frameStats.transformUpdates++;
+    }
+}
+
+/* Takes the current modelview as the camera, for loadSceneNode() */
+
+void setSceneView()
+{
+    getModelviewMatrix(sceneView);
+}
+
+/* Replaces the modelview with a node's, as seen from the camera */
+
+void loadSceneNode(int node)
+{
+    GLfloat modelview[16];
+    
+    multiplyMatrices(sceneView, &sceneGraph.world[node * 16], modelview);
+    loadMatrix(modelview);
+}
+
+
+#pragma mark - Track Streaming
+
+/*
+ 
+ Only a window of the line around the camera has any track in it.
+ Each track keeps a ring of segment slots in one vertex buffer,
+ and as the camera moves along the line, the segments that fall
+ out of the window are retired, and the slots they leave are
+ filled with the segments that come into it. Every segment has
+ the same number of vertices, in the same order, so the indices
+ never change, and the ring costs the same however long the
+ line is.
+ 
+ The window is a stretch of z, and reaches well past the far
+ plane, since its corners are further away than its middle. A
+ track that bends has more of itself in the window, so each ring
+ is made big enough for the most segments any of the window's
+ positions takes in. The culling grid covers the same window, and
+ is built again whenever it moves.
+ 
+ */
+
+//  How far the window reaches each way from the camera
+#define TRACK_WINDOW_REACH (FRUSTUM_DEPTH * 2)
+
+//  The window moves in steps of this many segments, so it doesn't move every frame
+#define TRACK_WINDOW_STEP 16
+
+#define TRACK_WINDOW_STEP_LENGTH (TRACK_WINDOW_STEP * TRACK_SEGMENT_LENGTH)
+#define TRACK_WINDOW_LENGTH (2 * TRACK_WINDOW_REACH + TRACK_WINDOW_STEP_LENGTH)
+
+typedef struct
+{
+    int slotsPerTrack;          //  Enough for any track, wherever the window is
+    float windowStartZ;         //  Where the window is now
+    bool filled;                //  Has the window been filled yet?
+    GLsizei vertexCount;        //  Per segment
+    GLsizei indexCount;         //  Per segment
+    std::vector<int> segmentCount;  //  In each whole track
+    std::vector<int> firstSegment;  //  Each track's segments in the window, up to but not including the last
+    std::vector<int> lastSegment;
+    std::vector<int> slotSegment;   //  Which segment each slot holds, or -1
+} TrackRing;
+
+TrackRing trackRing;
+
+//  Where the window starts and ends along z, for the culling grid
+float trackWindowStartZ = 0;
+float trackWindowEndZ = 0;
+
+/* The segments of a track that a window starting at startZ takes in */
+
+void trackSegmentsInWindow(int trackID, float startZ, int *firstSegment, int *lastSegment)
+{
+    float first = trackDistanceAtZ(trackID, startZ) / TRACK_SEGMENT_LENGTH;
+    float last = trackDistanceAtZ(trackID, startZ + TRACK_WINDOW_LENGTH) / TRACK_SEGMENT_LENGTH;
+    
+    *firstSegment = std::max(0, (int)floorf(first));
+    *lastSegment = std::min(trackRing.segmentCount[trackID], (int)floorf(last) + 1);
+    *lastSegment = std::max(*firstSegment, *lastSegment);
+}
+
+/* Sets up an empty ring for every track. It's filled the first time streamTrack() is called. */
+
+void buildStaticTrackBatch()
+{
+    trackRing.filled = false;
+    trackRing.slotsPerTrack = 0;
+    trackRing.segmentCount.assign(tracks.count, 0);
+    trackRing.firstSegment.assign(tracks.count, 0);
+    trackRing.lastSegment.assign(tracks.count, 0);
+    
+    /* Find the most of any track that the window can take in, as it steps along the line */
+    
+    float lineStart = -configuration.trackLength;
+    
+    for (int i = 0; i < tracks.count; i++) {
+        
+        trackRing.segmentCount[i] = (int)ceilf(tracks.length[i] / TRACK_SEGMENT_LENGTH);
+        
+        int firstStep = (int)floorf(-TRACK_WINDOW_LENGTH / TRACK_WINDOW_STEP_LENGTH) - 1;
+        int lastStep = (int)ceilf(configuration.trackLength * 2 / TRACK_WINDOW_STEP_LENGTH) + 1;
+        
+        for (int step = firstStep; step <= lastStep; step++) {
+            
+            int first, last;
+            trackSegmentsInWindow(i, lineStart + step * TRACK_WINDOW_STEP_LENGTH, &first, &last);
+            
+            trackRing.slotsPerTrack = std::max(trackRing.slotsPerTrack, last - first);
+        }
+    }
+    
+    //  Every segment looks like the first one, moved along
+    MeshBuilder segment;
+    trackSegment(&segment, 0, 0);
+    
+    trackRing.vertexCount = (GLsizei)segment.vertices.size();
+    trackRing.indexCount = (GLsizei)segment.indices.size();
+    
+    int slotCount = tracks.count * trackRing.slotsPerTrack;
+    
+    trackRing.slotSegment.assign(slotCount, -1);
+    
+    std::vector<GLuint> indices;
+    indices.reserve((size_t)slotCount * trackRing.indexCount);
+    
+    trackBatch.parts.clear();
+    
+    for (int slot = 0; slot < slotCount; slot++) {
+        
+        MeshPart part;
+        
+        part.firstIndex = (GLuint)indices.size();
+        part.indexCount = trackRing.indexCount;
+        
+        //  Empty, until a segment's streamed into it
+        for (int i = 0; i < 3; i++) {
+            part.bounds.min[i] = 0;
+            part.bounds.max[i] = 0;
+        }
+        
+        for (GLsizei i = 0; i < trackRing.indexCount; i++) {
+            indices.push_back(segment.indices[i] + slot * trackRing.vertexCount);
+        }
+        
+        trackBatch.parts.push_back(part);
+    }
+    
+    glGenBuffers(1, &trackBatch.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, trackBatch.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)slotCount * trackRing.vertexCount * sizeof(BatchVertex), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    glGenBuffers(1, &trackBatch.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, trackBatch.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.empty() ? NULL : &indices[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    
+    trackBatch.indexCount = (GLsizei)indices.size();
+}
+
+/* Which slot of its track's ring a segment goes in */
+
+int trackSlot(int trackID, int segment)
+{
+    return trackID * trackRing.slotsPerTrack + segment % trackRing.slotsPerTrack;
+}
+
+/* Emits a segment of a track into its slot, and uploads it */
+
+void streamTrackSegment(MeshBuilder *builder, int trackID, int segment)
+{
+    int slot = trackSlot(trackID, segment);
+    
+    builder->vertices.clear();
+    builder->indices.clear();
+    builder->parts.clear();
+    
+    beginMeshPart(builder);
+    trackSegment(builder, trackID, segment);
+    endMeshPart(builder);
+    
+    glBufferSubData(GL_ARRAY_BUFFER, (GLintptr)slot * trackRing.vertexCount * sizeof(BatchVertex), trackRing.vertexCount * sizeof(BatchVertex), &builder->vertices[0]);
+    
+    trackBatch.parts[slot].bounds = builder->parts[0].bounds;
+    trackRing.slotSegment[slot] = segment;
+    
+    frameStats.streamedSegments++;
+}
+
+/*
+ 
+ Moves the window so that it's around the camera, at cameraZ
+ along the line, retiring the segments it leaves behind, and
+ streaming in the ones it reaches.
+ 
+ */
+
+void streamTrack(float cameraZ)
+{
+    if (trackRing.slotsPerTrack == 0) {
+        return;
+    }
+    
+    //  Rounded down to a whole step along the line
+    float lineStart = -configuration.trackLength;
+    float windowStartZ = lineStart + TRACK_WINDOW_STEP_LENGTH * floorf((cameraZ - TRACK_WINDOW_REACH - lineStart) / TRACK_WINDOW_STEP_LENGTH);
+    
+    if (trackRing.filled && windowStartZ == trackRing.windowStartZ) {
+        return;
+    }
+    
+    MeshBuilder builder;
+    
+    glBindBuffer(GL_ARRAY_BUFFER, trackBatch.vertexBuffer);
+    
+    for (int i = 0; i < tracks.count; i++) {
+        
+        int oldFirst = trackRing.firstSegment[i];
+        int oldLast = trackRing.filled ? trackRing.lastSegment[i] : oldFirst;
+        
+        int first, last;
+        trackSegmentsInWindow(i, windowStartZ, &first, &last);
+        
+        /* Retire what's no longer in the window */
+        
+        for (int segment = oldFirst; segment < oldLast; segment++) {
+            if (segment < first || segment >= last) {
+                trackRing.slotSegment[trackSlot(i, segment)] = -1;
+            }
+        }
+        
+        /* Then fill the slots with what's come into it */
+        
+        for (int segment = first; segment < last; segment++) {
+            if (segment < oldFirst || segment >= oldLast) {
+                streamTrackSegment(&builder, i, segment);
+            }
+        }
+        
+        trackRing.firstSegment[i] = first;
+        trackRing.lastSegment[i] = last;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    trackRing.windowStartZ = windowStartZ;
+    trackRing.filled = true;
+    
+    trackWindowStartZ = windowStartZ;
+    trackWindowEndZ = windowStartZ + TRACK_WINDOW_LENGTH;
+    
+    buildSceneGrid();
+}
+
+/* Streams the track around wherever the camera is, from the view set by setSceneView() */
+
+void streamTrackAroundCamera()
+{
+    //  The camera's at the origin of the view, so undo the view's rotation of its translation
+    float cameraZ = -(sceneView[8] * sceneView[12] + sceneView[9] * sceneView[13] + sceneView[10] * sceneView[14]);
+    
+    streamTrack(cameraZ);
+}
+
+/* Only the segments that survived culling, merged into runs */
+
+std::vector<GLsizei> visibleTrackCounts;
+std::vector<const GLvoid *> visibleTrackOffsets;
+
+void drawStaticTrackBatch()
+{
+    SectionTimer timer(STATS_TRACK);
+    
+    drawStaticBatchRanges(&trackBatch, visibleTrackCounts.empty() ? NULL : &visibleTrackCounts[0], visibleTrackOffsets.empty() ? NULL : &visibleTrackOffsets[0], (GLsizei)visibleTrackCounts.size());
+}
+
+void destroyStaticTrackBatch()
+{
+    destroyStaticBatch(&trackBatch);
+    
+    trackRing.slotSegment.clear();
+    trackRing.slotsPerTrack = 0;
+    trackRing.filled = false;
+}
+
+
+#pragma mark - Shader Renderer
+
+/*
+ 
+ With a core profile there's no fixed function pipeline left, so
+ one GLSL shader draws everything. The projection and the lights
+ live in a Frame uniform buffer, which is only uploaded when they
+ change. Each draw's modelview goes into the next slot of a Draw
+ uniform buffer, which is bound by range. Geometry comes from the
+ same static batches and instance buffers as fixed function uses,
+ and colors come from vertices or instances, like they did with
+ GL_COLOR_MATERIAL.
+ 
+ The lighting follows fixed function's, less the specular term,
+ since nothing here has a specular material. Like the programs a
+ driver generates for fixed function, there's a program for each
+ number of lights, so the shader never loops over lights that
+ can't add anything. The station lights come on top of that, in
+ programs of their own, and so do draws that take a modelview
+ per instance, and the trains, when the shader moves them.
+ 
+ */
+
+/* The uniform blocks, shared by both stages */
+
+static const char *shaderUniformSource =
+    "struct Light\n"
+    "{\n"
+    "    vec4 position;\n"
+    "    vec4 ambient;\n"
+    "    vec4 diffuse;\n"
+    "    vec4 spotDirection;\n"
+    "    vec4 spot;\n"
+    "    vec4 attenuation;\n"
+    "};\n"
+    "\n"
+    "layout(std140) uniform Frame\n"
+    "{\n"
+    "    mat4 projection;\n"
+    "    vec4 sceneAmbient;\n"
+    "    ivec4 frameOptions;\n"
+    "    vec4 clusterScale;\n"
+    "    ivec4 clusterCounts;\n"
+    "    Light lights[8];\n"
+    "};\n"
+    "\n"
+    "layout(std140) uniform Draw\n"
+    "{\n"
+    "    mat4 modelview;\n"
+    "    ivec4 drawOptions;\n"
+    "};\n"
+    "\n";
+
+static const char *shaderVertexSource =
+    "in vec3 position;\n"
+    "in vec3 normal;\n"
+    "in vec4 color;\n"
+    "in vec3 instanceOffset;\n"
+    "in vec4 instanceColor;\n"
+    "\n"
+    "#if INSTANCE_TRANSFORMS == 1\n"
+    "in mat4 instanceModelview;\n"
+    "#endif\n"
+    "\n"
+    "out vec4 litColor;\n"
+    "\n"
+    "#if STATION_LIGHTS\n"
+    "out vec3 surfacePosition;\n"
+    "out vec3 surfaceNormal;\n"
+    "out vec4 surfaceColor;\n"
+    "#endif\n"
+    "\n"
+    "vec3 shadeLight(Light light, vec3 eyePosition, vec3 eyeNormal)\n"
+    "{\n"
+    "    vec3 toLight = normalize(light.position.xyz);\n"
+    "    float attenuation = 1.0;\n"
+    "\n"
+    "    if (light.position.w != 0.0) {\n"
+    "        vec3 offset = light.position.xyz - eyePosition;\n"
+    "        float distance = length(offset);\n"
+    "        toLight = offset / distance;\n"
+    "        attenuation = 1.0 / dot(light.attenuation.xyz, vec3(1.0, distance, distance * distance));\n"
+    "\n"
+    "        if (light.spot.z != 180.0) {\n"
+    "            vec3 spotDirection = light.spotDirection.xyz;\n"
+    "            float spotDot = length(spotDirection) > 0.0 ? dot(-toLight, normalize(spotDirection)) : 0.0;\n"
+    "            attenuation *= spotDot < light.spot.x ? 0.0 : pow(max(spotDot, 0.0), light.spot.y);\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    float diffuse = max(dot(eyeNormal, toLight), 0.0);\n"
+    "    return attenuation * (light.ambient.rgb + light.diffuse.rgb * diffuse);\n"
+    "}\n"
+    "\n"
+    "#if INSTANCE_TRANSFORMS == 2\n"
+    "uniform samplerBuffer trackSamples;\n"
+    "uniform samplerBuffer trackPieces;\n"
+    "uniform samplerBuffer trainMotion;\n"
+    "uniform isamplerBuffer trainClocks;\n"
+    "uniform int motionTick;\n"
+    "uniform float motionFraction;\n"
+    "uniform int carsPerTrain;\n"
+    "\n"
+    "//  Where a track is, and which way it runs, a distance along it, like trackPointAt()\n"
+    "vec4 trackPointAt(int first, int pieceCount, float distance)\n"
+    "{\n"
+    "    int last = first + pieceCount - 1;\n"
+    "\n"
+    "    while (first < last) {\n"
+    "        int middle = (first + last + 1) / 2;\n"
+    "\n"
+    "        if (texelFetch(trackPieces, middle).x <= distance) {\n"
+    "            first = middle;\n"
+    "        }\n"
+    "        else {\n"
+    "            last = middle - 1;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    vec2 piece = texelFetch(trackPieces, first).xy;\n"
+    "    float along = (distance - piece.x) / piece.y * float(PATH_SAMPLES_PER_PIECE);\n"
+    "\n"
+    "    int sample = clamp(int(floor(along)), 0, PATH_SAMPLES_PER_PIECE - 1);\n"
+    "    float blend = along - float(sample);\n"
+    "\n"
+    "    vec4 start = texelFetch(trackSamples, first * (PATH_SAMPLES_PER_PIECE + 1) + sample);\n"
+    "    vec4 end = texelFetch(trackSamples, first * (PATH_SAMPLES_PER_PIECE + 1) + sample + 1);\n"
+    "    vec2 tangent = mix(start.zw, end.zw, clamp(blend, 0.0, 1.0));\n"
+    "\n"
+    "    //  Off the ends, carry straight on\n"
+    "    if (blend < 0.0) {\n"
+    "        return vec4(start.xy + start.zw * blend * piece.y / float(PATH_SAMPLES_PER_PIECE), tangent);\n"
+    "    }\n"
+    "\n"
+    "    if (blend > 1.0) {\n"
+    "        return vec4(end.xy + end.zw * (blend - 1.0) * piece.y / float(PATH_SAMPLES_PER_PIECE), tangent);\n"
+    "    }\n"
+    "\n"
+    "    return vec4(mix(start.xy, end.xy, blend), tangent);\n"
+    "}\n"
+    "\n"
+    "//  How far along its track a train is, some ticks after its base tick, like trainDistanceAtTick()\n"
+    "float trainDistanceAt(vec4 motion, ivec4 clock, int ticks)\n"
+    "{\n"
+    "    if (ticks < clock.y) {\n"
+    "        return motion.x + motion.y * float(ticks);\n"
+    "    }\n"
+    "\n"
+    "    //  Laps are counted in whole ticks, so a long run never loses a tick\n"
+    "    float along = float((ticks - clock.y) % clock.z) * abs(motion.y);\n"
+    "\n"
+    "    return motion.y > 0.0 ? along : motion.z - along;\n"
+    "}\n"
+    "\n"
+    "//  Where a car is, between the last two ticks, turned to follow its track\n"
+    "mat4 carTransform(int instance)\n"
+    "{\n"
+    "    int trainID = instance / carsPerTrain;\n"
+    "    int carID = instance - trainID * carsPerTrain;\n"
+    "\n"
+    "    vec4 motion = texelFetch(trainMotion, trainID * 2);\n"
+    "    vec4 placement = texelFetch(trainMotion, trainID * 2 + 1);\n"
+    "\n"
+    "    ivec4 clock = texelFetch(trainClocks, trainID);\n"
+    "    int ticks = motionTick - clock.x;\n"
+    "    float from = trainDistanceAt(motion, clock, ticks);\n"
+    "    float to = trainDistanceAt(motion, clock, ticks + 1);\n"
+    "\n"
+    "    //  Don't sweep a train along the whole line when it wraps around\n"
+    "    float distance = abs(to - from) > motion.z / 2.0 ? to : mix(from, to, motionFraction);\n"
+    "\n"
+    "    vec4 point = trackPointAt(int(placement.x), int(placement.y), distance - CAR_SPACING * float(carID));\n"
+    "\n"
+    "    //  A train on a track that hides its trains shrinks to nothing\n"
+    "    float shown = placement.z;\n"
+    "\n"
+    "    return mat4(vec4(point.w, 0.0, -point.z, 0.0) * shown, vec4(0.0, shown, 0.0, 0.0), vec4(point.z, 0.0, point.w, 0.0) * shown, vec4(point.x, motion.w, point.y, 1.0));\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "#if INSTANCE_TRANSFORMS == 1\n"
+    "    mat4 transform = instanceModelview;\n"
+    "#elif INSTANCE_TRANSFORMS == 2\n"
+    "    mat4 transform = modelview * carTransform(gl_InstanceID);\n"
+    "#else\n"
+    "    mat4 transform = modelview;\n"
+    "#endif\n"
+    "\n"
+    "    vec4 eyePosition = transform * vec4(position + instanceOffset, 1.0);\n"
+    "    gl_Position = projection * eyePosition;\n"
+    "\n"
+    "    vec4 baseColor = drawOptions.x != 0 ? instanceColor : color;\n"
+    "\n"
+    "#if STATION_LIGHTS\n"
+    "    surfacePosition = eyePosition.xyz;\n"
+    "    surfaceNormal = mat3(transform) * normal;\n"
+    "    surfaceColor = baseColor;\n"
+    "#endif\n"
+    "\n"
+    "    if (frameOptions.x == 0) {\n"
+    "        litColor = baseColor;\n"
+    "        return;\n"
+    "    }\n"
+    "\n"
+    "    vec3 lit = sceneAmbient.rgb * baseColor.rgb;\n"
+    "\n"
+    "#if LIGHT_COUNT > 0\n"
+    "    vec3 eyeNormal = normalize(mat3(transform) * normal);\n"
+    "\n"
+    "    for (int i = 0; i < LIGHT_COUNT; i++) {\n"
+    "        lit += shadeLight(lights[i], eyePosition.xyz, eyeNormal) * baseColor.rgb;\n"
+    "    }\n"
+    "#endif\n"
+    "\n"
+    "    litColor = vec4(lit, baseColor.a);\n"
+    "}\n";
+
+/*
+ 
+ Station lights are shaded per fragment, but only the ones that
+ were binned into the fragment's cluster. Each light is three
+ texels: its eye space position and radius, its color, then its
+ direction and the cosine of its cone.
+ 
+ */
+
+static const char *shaderFragmentSource =
+    "in vec4 litColor;\n"
+    "\n"
+    "#if STATION_LIGHTS\n"
+    "in vec3 surfacePosition;\n"
+    "in vec3 surfaceNormal;\n"
+    "in vec4 surfaceColor;\n"
+    "\n"
+    "uniform samplerBuffer stationLights;\n"
+    "uniform usamplerBuffer clusterRanges;\n"
+    "uniform usamplerBuffer clusterLights;\n"
+    "\n"
+    "vec3 shadeStationLight(int light, vec3 normal)\n"
+    "{\n"
+    "    vec4 positionRadius = texelFetch(stationLights, light * 3);\n"
+    "    vec4 color = texelFetch(stationLights, light * 3 + 1);\n"
+    "    vec4 spot = texelFetch(stationLights, light * 3 + 2);\n"
+    "\n"
+    "    vec3 offset = positionRadius.xyz - surfacePosition;\n"
+    "    float distance = length(offset);\n"
+    "\n"
+    "    if (distance >= positionRadius.w) {\n"
+    "        return vec3(0.0);\n"
+    "    }\n"
+    "\n"
+    "    vec3 toLight = offset / distance;\n"
+    "\n"
+    "    float falloff = 1.0 - (distance * distance) / (positionRadius.w * positionRadius.w);\n"
+    "    float cone = smoothstep(spot.w, mix(spot.w, 1.0, 0.2), dot(-toLight, spot.xyz));\n"
+    "\n"
+    "    return color.rgb * falloff * falloff * cone * max(dot(normal, toLight), 0.0);\n"
+    "}\n"
+    "#endif\n"
+    "\n"
+    "out vec4 fragmentColor;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    fragmentColor = litColor;\n"
+    "\n"
+    "#if STATION_LIGHTS\n"
+    "    ivec3 cluster = ivec3(gl_FragCoord.xy * clusterScale.xy, log(-surfacePosition.z / clusterScale.w) * clusterScale.z);\n"
+    "    cluster = clamp(cluster, ivec3(0), clusterCounts.xyz - 1);\n"
+    "\n"
+    "    uvec2 range = texelFetch(clusterRanges, (cluster.z * clusterCounts.y + cluster.y) * clusterCounts.x + cluster.x).xy;\n"
+    "    vec3 normal = normalize(surfaceNormal);\n"
+    "    vec3 lit = vec3(0.0);\n"
+    "\n"
+    "    for (uint i = 0u; i < range.y; i++) {\n"
+    "        lit += shadeStationLight(int(texelFetch(clusterLights, int(range.x + i)).r), normal);\n"
+    "    }\n"
+    "\n"
+    "    fragmentColor.rgb += lit * surfaceColor.rgb;\n"
+    "#endif\n"
+    "}\n";
+
+#define MAX_SHADER_LIGHTS 8
+
+#define FRAME_UNIFORM_BINDING 0
+#define DRAW_UNIFORM_BINDING 1
+
+//  How many draws fit in the Draw buffer before it's orphaned and refilled
+#define DRAW_UNIFORM_SLOTS 1024
+
+/* These match the std140 layout of the blocks in the shader */
+
+typedef struct
+{
+    GLfloat position[4];        //  In eye space
+    GLfloat ambient[4];
+    GLfloat diffuse[4];
+    GLfloat spotDirection[4];   //  In eye space
+    GLfloat spot[4];            //  cos(cutoff), exponent, cutoff, enabled
+    GLfloat attenuation[4];     //  Constant, linear, quadratic
+} ShaderLight;
+
+typedef struct
+{
+    GLfloat projection[16];
+    GLfloat sceneAmbient[4];
+    GLint options[4];           //  Is lighting on?
+    GLfloat clusterScale[4];    //  Tiles per pixel across and up, slices per log of depth, near plane
+    GLint clusterCounts[4];     //  Tiles across and up, and slices deep
+    ShaderLight lights[MAX_SHADER_LIGHTS];
+} FrameUniforms;
+
+typedef struct
+{
+    GLfloat modelview[16];
+    GLint options[4];           //  Do the colors come from instances?
+} DrawUniforms;
+
+//  One program per number of lights, with and without station lights,
+//  and for each place the modelview comes from, built as needed
+GLuint shaderPrograms[MAX_SHADER_LIGHTS + 1][2][3];
+
+//  Programs that wouldn't build, so they're only tried, and warned about, once
+bool shaderProgramFailed[MAX_SHADER_LIGHTS + 1][2][3];
+
+/* Where the SHADER_TRAIN_MOTION programs take their clock, looked up as they're linked */
+
+typedef struct
+{
+    GLint motionTick;
+    GLint motionFraction;
+    GLint carsPerTrain;
+} TrainMotionUniforms;
+
+TrainMotionUniforms trainMotionUniforms[MAX_SHADER_LIGHTS + 1][2];
+GLuint shaderProgram = 0;
+GLuint shaderVertexArray = 0;
+
+//  How many lights the frame uniforms hold, and how many station lights binStationLights() found
+int shaderLightCount = 0;
+int stationLightsBinned = 0;
+
+//  Where the station light buffers are bound
+#define STATION_LIGHT_UNIT 0
+#define CLUSTER_RANGE_UNIT 1
+#define CLUSTER_LIGHT_UNIT 2
+
+//  Where the track paths and the trains' motion are bound, for SHADER_TRAIN_MOTION
+#define TRACK_SAMPLE_UNIT 3
+#define TRACK_PIECE_UNIT 4
+#define TRAIN_MOTION_UNIT 5
+#define TRAIN_CLOCK_UNIT 6
+
+GLuint frameUniformBuffer = 0;
+FrameUniforms frameUniforms;            //  Every light, by ID, with either renderer
+FrameUniforms frameUniformsUpload;      //  Only the lights that do something
+bool frameUniformsChanged = true;
+
+//  The shader has no use for specular colors, but fixed function does
+GLfloat lightSpecular[MAX_SHADER_LIGHTS][4];
+
+GLuint drawUniformBuffer = 0;
+GLsizeiptr drawUniformStride = 0;
+int drawUniformSlot = 0;
+
+/* Everything the fixed function renderer draws in immediate mode */
+
+StaticBatch platformMesh;
+StaticBatch carMesh;
+
+/* OpenGL's initial light state, with GL_LIGHTING on for the shader renderer */
+
+void resetLightState()
+{
+    memset(&frameUniforms, 0, sizeof(frameUniforms));
+    
+    for (int i = 0; i < 4; i++) {
+        frameUniforms.sceneAmbient[i] = (i < 3) ? 0.2f : 1.0f;
+    }
+    
+    frameUniforms.options[0] = 1;
+    
+    for (int light = 0; light < MAX_SHADER_LIGHTS; light++) {
+        
+        ShaderLight *shaderLight = &frameUniforms.lights[light];
+        
+        shaderLight->position[2] = 1;
+        shaderLight->ambient[3] = 1;
+        shaderLight->spotDirection[2] = -1;
+        shaderLight->spot[0] = -1;
+        shaderLight->spot[2] = 180;
+        shaderLight->attenuation[0] = 1;
+        
+        //  Only the first light starts out white
+        for (int i = 0; i < 4; i++) {
+            shaderLight->diffuse[i] = (light == 0 || i == 3) ? 1.0f : 0.0f;
+            lightSpecular[light][i] = shaderLight->diffuse[i];
+        }
+    }
+    
+    frameUniformsChanged = true;
+}
+
+/*
+ 
+ Can a light add anything to the scene? Lights that are off, or
+ have no color, can't. Neither can a spotlight that's pointed
+ nowhere, since its spot factor is zero everywhere.
+ 
+ */
+
+bool lightContributes(const ShaderLight *light)
+{
+    if (light->spot[3] == 0.0f) {
+        return false;
+    }
+    
+    bool colorless = true;
+    bool aimless = true;
+    
+    for (int i = 0; i < 3; i++) {
+        colorless = colorless && light->ambient[i] == 0.0f && light->diffuse[i] == 0.0f;
+        aimless = aimless && light->spotDirection[i] == 0.0f;
+    }
+    
+    bool spotlight = light->position[3] != 0.0f && light->spot[2] != 180.0f;
+    
+    return !colorless && !(spotlight && aimless && (light->spot[0] > 0.0f || light->spot[1] > 0.0f));
+}
+
+/* Builds the meshes that stand in for immediate mode, in the same places and colors */
+
+void buildShaderMeshes()
+{
+    MeshBuilder platformBuilder;
+    
+    //  The base, then its safety strips
+    appendPrism(&platformBuilder, 0, 0, 0, platformWidth, platformHeight, platformLength, darkGray);
+    appendPrism(&platformBuilder, -platformWidth/2-stripWidth, platformHeight/2+stripHeight, 0, stripWidth, stripHeight, platformLength, yellow);
+    appendPrism(&platformBuilder, platformWidth/2+stripWidth, platformHeight/2+stripHeight, 0, stripWidth, stripHeight, platformLength, yellow);
+    
+    //  Pillars down each side, at the front, middle and back
+    float pillarX = platformWidth/2-tileSide;
+    float pillarY = platformHeight/2+(pillarHeight/2);
+    float pillarZ[3] = {platformLength/2 - tileSide, 0, -platformLength/2 + tileSide};
+    
+    for (int i = 0; i < 3; i++) {
+        appendPrism(&platformBuilder, -pillarX, pillarY, pillarZ[i], tileSide, pillarHeight, tileSide, blue);
+        appendPrism(&platformBuilder, pillarX, pillarY, pillarZ[i], tileSide, pillarHeight, tileSide, blue);
+    }
+    
+    platformMesh = uploadStaticBatch(&platformBuilder);
+    
+    MeshBuilder carBuilder;
+    
+    float carColor[4] = {0.7f, 0.7f, 0.71f, 1.0f};
+    appendPrism(&carBuilder, 0, 0.04, 0, 1.0, CAR_HEIGHT, CAR_LENGTH, carColor);
+    
+    carMesh = uploadStaticBatch(&carBuilder);
+}
+
+/* Finds the program for a number of lights, building it the first time it's asked for, or 0 if it won't build */
+
+GLuint shaderProgramFor(int lightCount, bool stationLit, int transforms)
+{
+    GLuint *program = &shaderPrograms[lightCount][stationLit][transforms];
+    
+    if (*program || shaderProgramFailed[lightCount][stationLit][transforms]) {
+        return *program;
+    }
+    
+    const char *attributeNames[6] = {"position", "normal", "color", "instanceOffset", "instanceColor", "instanceModelview"};
+    const GLuint attributeLocations[6] = {POSITION_ATTRIBUTE, NORMAL_ATTRIBUTE, COLOR_ATTRIBUTE, INSTANCE_OFFSET_ATTRIBUTE, INSTANCE_COLOR_ATTRIBUTE, INSTANCE_MODELVIEW_ATTRIBUTE};
+    
+    char header[256];
+    snprintf(header, sizeof(header), "#version 150\n#define LIGHT_COUNT %d\n#define STATION_LIGHTS %d\n#define INSTANCE_TRANSFORMS %d\n#define PATH_SAMPLES_PER_PIECE %d\n#define CAR_SPACING %f\n", lightCount, stationLit, transforms, PATH_SAMPLES_PER_PIECE, CAR_LENGTH*1.2);
+    
+    std::string vertexSource = std::string(header) + shaderUniformSource + shaderVertexSource;
+    std::string fragmentSource = std::string(header) + shaderUniformSource + shaderFragmentSource;
+    
+    *program = linkProgram(vertexSource.c_str(), fragmentSource.c_str(), attributeNames, attributeLocations, 6);
+    
+    if (!*program) {
+        const char *transformNames[3] = {"the draw's modelview", "instanced modelviews", "train motion"};
+        
+        std::cerr << "Couldn't build the shader for " << lightCount << " lights" << (stationLit ? " and station lights" : "") << ", with " << transformNames[transforms] << ", and won't try again" << std::endl;
+        shaderProgramFailed[lightCount][stationLit][transforms] = true;
+        return 0;
+    }
+    
+    glUniformBlockBinding(*program, glGetUniformBlockIndex(*program, "Frame"), FRAME_UNIFORM_BINDING);
+    glUniformBlockBinding(*program, glGetUniformBlockIndex(*program, "Draw"), DRAW_UNIFORM_BINDING);
+    
+    if (stationLit) {
+        glUseProgram(*program);
+        glUniform1i(glGetUniformLocation(*program, "stationLights"), STATION_LIGHT_UNIT);
+        glUniform1i(glGetUniformLocation(*program, "clusterRanges"), CLUSTER_RANGE_UNIT);
+        glUniform1i(glGetUniformLocation(*program, "clusterLights"), CLUSTER_LIGHT_UNIT);
+        glUseProgram(shaderProgram);
+    }
+    
+    if (transforms == SHADER_TRAIN_MOTION) {
+        glUseProgram(*program);
+        glUniform1i(glGetUniformLocation(*program, "trackSamples"), TRACK_SAMPLE_UNIT);
+        glUniform1i(glGetUniformLocation(*program, "trackPieces"), TRACK_PIECE_UNIT);
+        glUniform1i(glGetUniformLocation(*program, "trainMotion"), TRAIN_MOTION_UNIT);
+        glUniform1i(glGetUniformLocation(*program, "trainClocks"), TRAIN_CLOCK_UNIT);
+        glUseProgram(shaderProgram);
+        
+        TrainMotionUniforms *uniforms = &trainMotionUniforms[lightCount][stationLit];
+        
+        uniforms->motionTick = glGetUniformLocation(*program, "motionTick");
+        uniforms->motionFraction = glGetUniformLocation(*program, "motionFraction");
+        uniforms->carsPerTrain = glGetUniformLocation(*program, "carsPerTrain");
+    }
+    
+    return *program;
+}
+
+bool buildShaderRenderer()
+{
+    //  The simplest program, to find out early if there's a problem
+    if (!shaderProgramFor(0, false, SHADER_DRAW_MODELVIEW)) {
+        return false;
+    }
+    
+    //  A core profile won't draw without a vertex array object
+    glGenVertexArrays(1, &shaderVertexArray);
+    glBindVertexArray(shaderVertexArray);
+    
+    /* The frame's uniforms, bound once */
+    
+    glGenBuffers(1, &frameUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORM_BINDING, frameUniformBuffer);
+    
+    /* A slot per draw, each starting on an offset the driver can bind */
+    
+    GLint alignment = 1;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    alignment = std::max(alignment, 1);
+    
+    drawUniformStride = (sizeof(DrawUniforms) + alignment - 1) / alignment * alignment;
+    drawUniformSlot = 0;
+    
+    glGenBuffers(1, &drawUniformBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, drawUniformBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, drawUniformStride * DRAW_UNIFORM_SLOTS, NULL, GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    
+    projectionChanged = true;
+    
+    buildShaderMeshes();
+    buildLightClusters();
+    
+    //  Nothing else ever draws, so a program always stays bound
+    shaderLightCount = 0;
+    stationLightsBinned = 0;
+    shaderProgram = shaderPrograms[0][0][0];
+    glUseProgram(shaderProgram);
+    
+    //  Instancing is core, so the tiles and wheels can count on it
+    instancingSupported = true;
+    
+    return true;
+}
+
+void destroyShaderRenderer()
+{
+    destroyStaticBatch(&platformMesh);
+    destroyStaticBatch(&carMesh);
+    destroyLightClusters();
+    
+    glUseProgram(0);
+    glBindVertexArray(0);
+    
+    glDeleteBuffers(1, &drawUniformBuffer);
+    glDeleteBuffers(1, &frameUniformBuffer);
+    glDeleteVertexArrays(1, &shaderVertexArray);
+    
+    for (int i = 0; i <= MAX_SHADER_LIGHTS; i++) {
+        for (int stationLit = 0; stationLit < 2; stationLit++) {
+            for (int transforms = 0; transforms < 3; transforms++) {
+                glDeleteProgram(shaderPrograms[i][stationLit][transforms]);
+                shaderPrograms[i][stationLit][transforms] = 0;
+                shaderProgramFailed[i][stationLit][transforms] = false;
+            }
+        }
+    }
+    
+    drawUniformBuffer = 0;
+    frameUniformBuffer = 0;
+    shaderVertexArray = 0;
+    shaderProgram = 0;
+    
+    instancingSupported = false;
+}
+
+/*
+ 
+ Brings the frame's uniforms up to date, then fills the next draw
+ slot with the current modelview and binds it. Every draw goes
+ through here first.
+ 
+ */
+
+void prepareShaderDraw(bool instanceColors, int transforms)
+{
+    if (projectionChanged) {
+        memcpy(frameUniforms.projection, projectionMatrix.m, sizeof(frameUniforms.projection));
+        projectionChanged = false;
+        frameUniformsChanged = true;
+    }
+    
+    //  Only the lights that do something are uploaded, and shaded
+    if (frameUniformsChanged) {
+        
+        frameUniformsUpload = frameUniforms;
+        
+        shaderLightCount = 0;
+        
+        for (int i = 0; i < MAX_SHADER_LIGHTS; i++) {
+            if (lightContributes(&frameUniforms.lights[i])) {
+                frameUniformsUpload.lights[shaderLightCount++] = frameUniforms.lights[i];
+            }
+        }
+        
+        glBindBuffer(GL_UNIFORM_BUFFER, frameUniformBuffer);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frameUniformsUpload);
+        frameUniformsChanged = false;
+    }
+    
+    //  Keep the last program that built, if this one won't
+    GLuint program = shaderProgramFor(shaderLightCount, stationLightsBinned > 0, transforms);
+    
+    if (program && program != shaderProgram) {
+        shaderProgram = program;
+        glUseProgram(shaderProgram);
+    }
+    
+    glBindBuffer(GL_UNIFORM_BUFFER, drawUniformBuffer);
+    
+    //  Once every slot's been used, orphan the buffer rather than wait on draws still reading it
+    if (drawUniformSlot == DRAW_UNIFORM_SLOTS) {
+        glBufferData(GL_UNIFORM_BUFFER, drawUniformStride * DRAW_UNIFORM_SLOTS, NULL, GL_STREAM_DRAW);
+        drawUniformSlot = 0;
+    }
+    
+    DrawUniforms uniforms;
+    
+    getModelviewMatrix(uniforms.modelview);
+    uniforms.options[0] = instanceColors;
+    uniforms.options[1] = uniforms.options[2] = uniforms.options[3] = 0;
+    
+    GLintptr offset = drawUniformSlot * drawUniformStride;
+    
+    //  No earlier draw reads this slot, so there's nothing to wait for
+    void *slot = glMapBufferRange(GL_UNIFORM_BUFFER, offset, sizeof(DrawUniforms), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+    memcpy(slot, &uniforms, sizeof(DrawUniforms));
+    glUnmapBuffer(GL_UNIFORM_BUFFER);
+    
+    glBindBufferRange(GL_UNIFORM_BUFFER, DRAW_UNIFORM_BINDING, drawUniformBuffer, offset, sizeof(DrawUniforms));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    
+    drawUniformSlot++;
+}
+
+void drawPlatformMesh()
+{
+    queueDraw(&platformMesh, true);
+}
+
+void drawCarMesh()
+{
+    queueDraw(&carMesh, true);
+}
+
+/*
+ 
+ Light state goes through these, which keep it for both renderers.
+ Like glLight, positions and spot directions are taken into eye
+ space by the current modelview. The platform lights are set
+ every frame, but rarely change, so anything that matches what's
+ already there is dropped, and counted. Fixed function passes
+ the rest on to OpenGL, and the shader renderer uploads it with
+ the frame's uniforms.
+ 
+ */
+
+/* Hands a light change on, unless it didn't change anything */
+
+bool commitLightChange(const ShaderLight *previous, const ShaderLight *light)
+{
+    if (!memcmp(previous, light, sizeof(ShaderLight))) {
+        frameStats.filteredChanges++;
+        return false;
+    }
+    
+    frameStats.lightChanges++;
+    frameUniformsChanged |= configuration.shaderRenderer;
+    
+    return !configuration.shaderRenderer;
+}
+
+void lightfv(GLenum light, GLenum name, const GLfloat *values)
+{
+    //  OpenGL ignores lights that don't exist, and so do we
+    int index = (int)light - GL_LIGHT0;
+    
+    if (index < 0 || index >= MAX_SHADER_LIGHTS) {
+        frameStats.filteredChanges++;
+        return;
+    }
+    
+    ShaderLight *shaderLight = &frameUniforms.lights[index];
+    ShaderLight previous = *shaderLight;
+    
+    GLfloat modelview[16];
+    
+    switch (name) {
+        case GL_POSITION:
+            getModelviewMatrix(modelview);
+            
+            for (int row = 0; row < 4; row++) {
+                shaderLight->position[row] = 0;
+                
+                for (int k = 0; k < 4; k++) {
+                    shaderLight->position[row] += modelview[k * 4 + row] * values[k];
+                }
+            }
+            break;
+        case GL_SPOT_DIRECTION:
+            getModelviewMatrix(modelview);
+            
+            for (int row = 0; row < 3; row++) {
+                shaderLight->spotDirection[row] = 0;
+                
+                for (int k = 0; k < 3; k++) {
+                    shaderLight->spotDirection[row] += modelview[k * 4 + row] * values[k];
+                }
+            }
+            break;
+        case GL_AMBIENT:
+            memcpy(shaderLight->ambient, values, sizeof(shaderLight->ambient));
+            break;
+        case GL_DIFFUSE:
+            memcpy(shaderLight->diffuse, values, sizeof(shaderLight->diffuse));
+            break;
+        case GL_SPECULAR:
+            if (!memcmp(lightSpecular[index], values, sizeof(lightSpecular[index]))) {
+                frameStats.filteredChanges++;
+                return;
+            }
+            
+            memcpy(lightSpecular[index], values, sizeof(lightSpecular[index]));
+            frameStats.lightChanges++;
+            
+            if (!configuration.shaderRenderer) {
+                glLightfv(light, name, values);
+            }
+            return;
+        default:
+            if (!configuration.shaderRenderer) {
+                glLightfv(light, name, values);
+            }
+            return;
+    }
+    
+    if (commitLightChange(&previous, shaderLight)) {
+        glLightfv(light, name, values);
+    }
+}
+
+void lightf(GLenum light, GLenum name, GLfloat value)
+{
+    int index = (int)light - GL_LIGHT0;
+    
+    if (index < 0 || index >= MAX_SHADER_LIGHTS) {
+        frameStats.filteredChanges++;
+        return;
+    }
+    
+    ShaderLight *shaderLight = &frameUniforms.lights[index];
+    ShaderLight previous = *shaderLight;
+    
+    switch (name) {
+        case GL_SPOT_CUTOFF:
+            shaderLight->spot[0] = (value == 180.0f) ? -1.0f : cosf(value * DEG2RAD);
+            shaderLight->spot[2] = value;
+            break;
+        case GL_SPOT_EXPONENT:
+            shaderLight->spot[1] = value;
+            break;
+        case GL_CONSTANT_ATTENUATION:
+            shaderLight->attenuation[0] = value;
+            break;
+        case GL_LINEAR_ATTENUATION:
+            shaderLight->attenuation[1] = value;
+            break;
+        case GL_QUADRATIC_ATTENUATION:
+            shaderLight->attenuation[2] = value;
+            break;
+        default:
+            if (!configuration.shaderRenderer) {
+                glLightf(light, name, value);
+            }
+            return;
+    }
+    
+    if (commitLightChange(&previous, shaderLight)) {
+        glLightf(light, name, value);
+    }
+}
+
+void enableLight(GLenum light)
+{
+    int index = (int)light - GL_LIGHT0;
+    
+    if (index < 0 || index >= MAX_SHADER_LIGHTS) {
+        frameStats.filteredChanges++;
+        return;
+    }
+    
+    enableState(light);
+}
+
+/* The shader renderer's take on glEnable/glDisable(GL_LIGHTING) */
+
+void toggleShaderLighting()
+{
+    frameUniforms.options[0] = !frameUniforms.options[0];
+    frameUniformsChanged = true;
+}
+#pragma mark - State Cache
+
+/*
+ 
+ Every glEnable, glDisable and glColor goes through here, and is
+ dropped if OpenGL is already in that state. Most of what a frame
+ sets is what the frame before it set, and each call costs a trip
+ into the driver, which may revalidate its state at the next draw.
+ Lights are cached with the rest of the light state, above.
+ 
+ Anything that changes this state behind the cache's back has to
+ put it back, the way the stats overlay does with glPushAttrib, or
+ tell the cache to forget it.
+ 
+ */
+
+#define MAX_CACHED_STATES 16
+
+typedef struct
+{
+    GLenum capability;
+    bool enabled;
+} CachedState;
+
+CachedState cachedStates[MAX_CACHED_STATES];
+int cachedStateCount = 0;
+
+GLfloat cachedColor[4];
+bool cachedColorKnown = false;
+
+/* Forgets everything, for a new context */
+
+void resetStateCache()
+{
+    cachedStateCount = 0;
+    cachedColorKnown = false;
+    
+    resetLightState();
+}
+
+/* Finds a capability, asking OpenGL about it the first time */
+
+CachedState *cachedState(GLenum capability)
+{
+    for (int i = 0; i < cachedStateCount; i++) {
+        if (cachedStates[i].capability == capability) {
+            return &cachedStates[i];
+        }
+    }
+    
+    //  Too many to keep track of, so this one's never cached
+    if (cachedStateCount == MAX_CACHED_STATES) {
+        return NULL;
+    }
+    
+    CachedState *state = &cachedStates[cachedStateCount++];
+    
+    state->capability = capability;
+    state->enabled = glIsEnabled(capability);
+    
+    return state;
+}
+
+void setState(GLenum capability, bool enabled)
+{
+    CachedState *state = NULL;
+    
+    //  Lights are kept with the rest of their state
+    if (capability >= GL_LIGHT0 && capability < GL_LIGHT0 + MAX_SHADER_LIGHTS) {
+        
+        ShaderLight *light = &frameUniforms.lights[capability - GL_LIGHT0];
+        ShaderLight previous = *light;
+        
+        light->spot[3] = enabled ? 1.0f : 0.0f;
+        
+        if (!commitLightChange(&previous, light)) {
+            return;
+        }
+    }
+    else if ((state = cachedState(capability))) {
+        
+        if (state->enabled == enabled) {
+            frameStats.filteredChanges++;
+            return;
+        }
+        
+        state->enabled = enabled;
+    }
+    
+    if (enabled) {
+        glEnable(capability);
+    }
+    else {
+        glDisable(capability);
+    }
+}
+
+void enableState(GLenum capability)
+{
+    setState(capability, true);
+}
+
+void disableState(GLenum capability)
+{
+    setState(capability, false);
+}
+
+bool stateEnabled(GLenum capability)
+{
+    if (capability >= GL_LIGHT0 && capability < GL_LIGHT0 + MAX_SHADER_LIGHTS) {
+        return frameUniforms.lights[capability - GL_LIGHT0].spot[3] != 0.0f;
+    }
+    
+    CachedState *state = cachedState(capability);
+    
+    return state ? state->enabled : glIsEnabled(capability);
+}
+
+void setColor4fv(const GLfloat *color)
+{
+    if (cachedColorKnown && !memcmp(cachedColor, color, sizeof(cachedColor))) {
+        frameStats.filteredChanges++;
+        return;
+    }
+    
+    memcpy(cachedColor, color, sizeof(cachedColor));
+    cachedColorKnown = true;
+    
+    //  The core profile has no glColor, but meshes without colors
+    //  read them from the attribute's current value instead
+    if (configuration.shaderRenderer) {
+        glVertexAttrib4fv(COLOR_ATTRIBUTE, color);
+    }
+    else {
+        glColor4fv(color);
+    }
+}
+
+void setColor3f(GLfloat red, GLfloat green, GLfloat blue)
+{
+    GLfloat color[4] = {red, green, blue, 1.0f};
+    
+    setColor4fv(color);
+}
+
+/* The color prisms are queued in. White, if nothing's set one. */
+
+const GLfloat *currentColor()
+{
+    return cachedColorKnown ? cachedColor : white;
+}
+
+/* For after something else has set the current color */
+
+void forgetColor()
+{
+    cachedColorKnown = false;
+}
+
+
+#pragma mark - Clustered Lighting
+
+/*
+ 
+ The station fixtures are too many to hand the shader one by one,
+ so the view is cut into clusters: tiles across the screen, and
+ slices into it, which get thinner near the camera. Every frame,
+ each fixture that can be seen goes into the clusters its sphere
+ of light touches, and fragments only shade the fixtures in their
+ own cluster. The clusters are small enough to bin on the CPU, and
+ go up in texture buffers, which every core profile has.
+ 
+ */
+
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 8
+#define CLUSTER_SLICES 24
+
+#define CLUSTER_COUNT (CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+
+//  Position and radius, color, and direction and cone, for each light
+#define STATION_LIGHT_FLOATS 12
+
+GLuint stationLightBuffer = 0;
+GLuint clusterRangeBuffer = 0;
+GLuint clusterLightBuffer = 0;
+
+GLuint stationLightTexture = 0;
+GLuint clusterRangeTexture = 0;
+GLuint clusterLightTexture = 0;
+
+//  The most light indices the clusters can hold between them
+GLint maxClusterReferences = 0;
+
+/* Kept from frame to frame, so binning doesn't allocate */
+
+std::vector<GLfloat> binnedLightData;
+std::vector<int> binnedLightBounds;     //  First and last tile across, up, and slice, for each light
+std::vector<GLuint> clusterRanges;      //  Offset and count, for each cluster
+std::vector<GLuint> clusterLightIndices;
+
+/* Makes a buffer, and a buffer texture on the given unit that reads it */
+
+void buildTextureBuffer(GLuint *buffer, GLuint *texture, GLenum format, GLenum unit)
+{
+    glGenBuffers(1, buffer);
+    glBindBuffer(GL_TEXTURE_BUFFER, *buffer);
+    
+    //  Something has to be there before the texture can point at it
+    glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+    
+    glGenTextures(1, texture);
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glBindTexture(GL_TEXTURE_BUFFER, *texture);
+    glTexBuffer(GL_TEXTURE_BUFFER, format, *buffer);
+}
+
+void buildLightClusters()
+{
+    buildTextureBuffer(&stationLightBuffer, &stationLightTexture, GL_RGBA32F, STATION_LIGHT_UNIT);
+    buildTextureBuffer(&clusterRangeBuffer, &clusterRangeTexture, GL_RG32UI, CLUSTER_RANGE_UNIT);
+    buildTextureBuffer(&clusterLightBuffer, &clusterLightTexture, GL_R32UI, CLUSTER_LIGHT_UNIT);
+    
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxClusterReferences);
+    
+    clusterRanges.resize(CLUSTER_COUNT * 2);
+    
+    frameUniforms.clusterCounts[0] = CLUSTER_TILES_X;
+    frameUniforms.clusterCounts[1] = CLUSTER_TILES_Y;
+    frameUniforms.clusterCounts[2] = CLUSTER_SLICES;
+    frameUniforms.clusterCounts[3] = 0;
+}
+
+void destroyLightClusters()
+{
+    GLuint buffers[3] = {stationLightBuffer, clusterRangeBuffer, clusterLightBuffer};
+    GLuint textures[3] = {stationLightTexture, clusterRangeTexture, clusterLightTexture};
+    
+    glDeleteBuffers(3, buffers);
+    glDeleteTextures(3, textures);
+    
+    stationLightBuffer = clusterRangeBuffer = clusterLightBuffer = 0;
+    stationLightTexture = clusterRangeTexture = clusterLightTexture = 0;
+    stationLightsBinned = 0;
+}
+
+/*
+ 
+ Fits the clusters to the window and the projection. Call it
+ after the projection's set up. The near and far planes come
+ back out of the projection matrix.
+ 
+ */
+
+void resizeLightClusters(int width, int height)
+{
+    const GLfloat *m = projectionMatrix.m;
+    
+    float near = m[14] / (m[10] - 1.0f);
+    float far = m[14] / (m[10] + 1.0f);
+    
+    frameUniforms.clusterScale[0] = (float)CLUSTER_TILES_X / std::max(1, width);
+    frameUniforms.clusterScale[1] = (float)CLUSTER_TILES_Y / std::max(1, height);
+    frameUniforms.clusterScale[2] = CLUSTER_SLICES / logf(far / near);
+    frameUniforms.clusterScale[3] = near;
+    
+    frameUniformsChanged = true;
+}
+
+/* Which slice a depth in front of the camera falls in */
+
+int clusterSlice(float depth)
+{
+    int slice = (int)floorf(logf(depth / frameUniforms.clusterScale[3]) * frameUniforms.clusterScale[2]);
+    
+    return std::max(0, std::min(CLUSTER_SLICES - 1, slice));
+}
+
+/*
+ 
+ Works out which clusters each station light reaches, and sends
+ the lights and the clusters up for this frame. Call it with the
+ camera's modelview in place.
+ 
+ */
+
+void binStationLights()
+{
+    SectionTimer timer(STATS_LIGHTS);
+    
+    stationLightsBinned = 0;
+    
+    //  Nothing to bin, or nothing to light
+    if (stationLights.count == 0 || !frameUniforms.options[0]) {
+        return;
+    }
+    
+    GLfloat modelview[16];
+    getModelviewMatrix(modelview);
+    
+    const GLfloat *projection = projectionMatrix.m;
+    
+    float near = frameUniforms.clusterScale[3];
+    float far = near * expf(CLUSTER_SLICES / frameUniforms.clusterScale[2]);
+    
+    binnedLightData.clear();
+    binnedLightBounds.clear();
+    
+    long references = 0;
+    
+    for (int i = 0; i < stationLights.count; i++) {
+        
+        const float *position = &stationLights.position[i * 3];
+        const float *direction = &stationLights.direction[i * 3];
+        float radius = stationLights.radius[i];
+        
+        float eye[3];
+        float eyeDirection[3];
+        
+        for (int row = 0; row < 3; row++) {
+            eye[row] = modelview[row] * position[0] + modelview[4 + row] * position[1] + modelview[8 + row] * position[2] + modelview[12 + row];
+            eyeDirection[row] = modelview[row] * direction[0] + modelview[4 + row] * direction[1] + modelview[8 + row] * direction[2];
+        }
+        
+        //  Behind the camera, or past the far plane
+        float nearestDepth = std::max(near, -eye[2] - radius);
+        float farthestDepth = std::min(far, -eye[2] + radius);
+        
+        if (nearestDepth > farthestDepth) {
+            continue;
+        }
+        
+        /* Project the corners of the light's box, to find the tiles it covers */
+        
+        float minX = 1.0f, minY = 1.0f, maxX = -1.0f, maxY = -1.0f;
+        
+        for (int corner = 0; corner < 8; corner++) {
+            
+            float x = eye[0] + ((corner & 1) ? radius : -radius);
+            float y = eye[1] + ((corner & 2) ? radius : -radius);
+            
+            //  Corners behind the near plane are pulled up to it
+            float z = std::min(eye[2] + ((corner & 4) ? radius : -radius), -near);
+            
+            float clipX = projection[0] * x + projection[4] * y + projection[8] * z + projection[12];
+            float clipY = projection[1] * x + projection[5] * y + projection[9] * z + projection[13];
+            float clipW = projection[3] * x + projection[7] * y + projection[11] * z + projection[15];
+            
+            minX = std::min(minX, clipX / clipW);
+            maxX = std::max(maxX, clipX / clipW);
+            minY = std::min(minY, clipY / clipW);
+            maxY = std::max(maxY, clipY / clipW);
+        }
+        
+        //  Off the side of the screen
+        if (maxX < -1.0f || minX > 1.0f || maxY < -1.0f || minY > 1.0f) {
+            continue;
+        }
+        
+        int bounds[6];
+        
+        bounds[0] = std::max(0, (int)((minX * 0.5f + 0.5f) * CLUSTER_TILES_X));
+        bounds[1] = std::min(CLUSTER_TILES_X - 1, (int)((maxX * 0.5f + 0.5f) * CLUSTER_TILES_X));
+        bounds[2] = std::max(0, (int)((minY * 0.5f + 0.5f) * CLUSTER_TILES_Y));
+        bounds[3] = std::min(CLUSTER_TILES_Y - 1, (int)((maxY * 0.5f + 0.5f) * CLUSTER_TILES_Y));
+        bounds[4] = clusterSlice(nearestDepth);
+        bounds[5] = clusterSlice(farthestDepth);
+        
+        //  Leave out whatever won't fit in the clusters
+        long covered = (long)(bounds[1] - bounds[0] + 1) * (bounds[3] - bounds[2] + 1) * (bounds[5] - bounds[4] + 1);
+        
+        if (references + covered > maxClusterReferences) {
+            continue;
+        }
+        
+        references += covered;
+        
+        binnedLightBounds.insert(binnedLightBounds.end(), bounds, bounds + 6);
+        
+        float length = sqrtf(eyeDirection[0] * eyeDirection[0] + eyeDirection[1] * eyeDirection[1] + eyeDirection[2] * eyeDirection[2]);
+        
+        GLfloat data[STATION_LIGHT_FLOATS] = {
+            eye[0], eye[1], eye[2], radius,
+            stationLights.color[i * 3], stationLights.color[i * 3 + 1], stationLights.color[i * 3 + 2], 0.0f,
+            eyeDirection[0] / length, eyeDirection[1] / length, eyeDirection[2] / length, stationLights.cosCutoff[i]
+        };
+        
+        binnedLightData.insert(binnedLightData.end(), data, data + STATION_LIGHT_FLOATS);
+    }
+    
+    int binned = (int)(binnedLightBounds.size() / 6);
+    
+    frameStats.stationLights = binned;
+    
+    if (binned == 0) {
+        return;
+    }
+    
+    /* Count the lights in each cluster, then hand out the space for them */
+    
+    std::fill(clusterRanges.begin(), clusterRanges.end(), 0);
+    
+    for (int light = 0; light < binned; light++) {
+        const int *bounds = &binnedLightBounds[light * 6];
+        
+        for (int z = bounds[4]; z <= bounds[5]; z++) {
+            for (int y = bounds[2]; y <= bounds[3]; y++) {
+                for (int x = bounds[0]; x <= bounds[1]; x++) {
+                    clusterRanges[((z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x) * 2 + 1]++;
+                }
+            }
+        }
+    }
+    
+    GLuint offset = 0;
+    
+    for (int cluster = 0; cluster < CLUSTER_COUNT; cluster++) {
+        clusterRanges[cluster * 2] = offset;
+        offset += clusterRanges[cluster * 2 + 1];
+        
+        //  Counted back up as the lights go in
+        clusterRanges[cluster * 2 + 1] = 0;
+    }
+    
+    clusterLightIndices.resize(offset);
+    
+    for (int light = 0; light < binned; light++) {
+        const int *bounds = &binnedLightBounds[light * 6];
+        
+        for (int z = bounds[4]; z <= bounds[5]; z++) {
+            for (int y = bounds[2]; y <= bounds[3]; y++) {
+                for (int x = bounds[0]; x <= bounds[1]; x++) {
+                    GLuint *range = &clusterRanges[((z * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x) * 2];
+                    clusterLightIndices[range[0] + range[1]++] = light;
+                }
+            }
+        }
+    }
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, stationLightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, binnedLightData.size() * sizeof(GLfloat), &binnedLightData[0], GL_STREAM_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterRangeBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, clusterRanges.size() * sizeof(GLuint), &clusterRanges[0], GL_STREAM_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, clusterLightBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, clusterLightIndices.size() * sizeof(GLuint), &clusterLightIndices[0], GL_STREAM_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    
+    stationLightsBinned = binned;
+}
+
+
+#pragma mark - Instanced Tiles
+
+/*
+ 
+ Every floor tile is the same prism, so there's one instance
+ for every tile on every platform, drawn with a single call.
+ 
+ */
+
+StaticBatch tileBatch;
+GLuint tileInstanceBuffer = 0;
+GLsizei tileInstanceCount = 0;
+
+void buildInstancedTiles()
+{
+    if (!instancingSupported) {
+        return;
+    }
+    
+    /* One tile, centered on its origin */
+    
+    MeshBuilder builder;
+    appendPrism(&builder, 0, 0, 0, tileSide, stripHeight, tileSide, white);
+    tileBatch = uploadStaticBatch(&builder);
+    
+    /* Every tile of every platform, in the same order and colors as platform() */
+    
+    std::vector<Instance> instances;
+    
+    for (int platformID = 0; platformID < platformCount; platformID++) {
+        
+        for (int i = 0; i < tileRows; i++) {
+            
+            alternateColor(lightGray, darkGray);
+            
+            for (int j = 0; j < tileColumns; j++) {
+                
+                alternateColor(lightGray, darkGray);
+                
+                Instance instance;
+                
+                instance.offset[0] = (-platformWidth/2)+tileSide/2+tileSide*i;
+                instance.offset[1] = PLATFORM_Y + platformHeight/2 + stripHeight;
+                instance.offset[2] = platformOffsetZ[platformID] + (-platformLength/2)+tileSide*j;
+                
+                for (int c = 0; c < 4; c++) {
+                    instance.color[c] = (GLubyte)(alternatingColor[c] * 255.0f + 0.5f);
+                }
+                
+                instances.push_back(instance);
+            }
+        }
+    }
+    
+    glGenBuffers(1, &tileInstanceBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, tileInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(Instance), instances.empty() ? NULL : &instances[0], GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    tileInstanceCount = (GLsizei)instances.size();
+}
+
+/* Draws the tiles of the visible platforms, one call per run of neighbors */
+
+void drawInstancedTiles()
+{
+    SectionTimer timer(STATS_PLATFORM);
+    
+    GLsizei tilesPerPlatform = tileInstanceCount / platformCount;
+    
+    int platformID = 0;
+    
+    while (platformID < platformCount) {
+        
+        if (!platformVisible[platformID]) {
+            platformID++;
+            continue;
+        }
+        
+        int firstPlatform = platformID;
+        
+        while (platformID < platformCount && platformVisible[platformID]) {
+            platformID++;
+        }
+        
+        drawInstanced(&tileBatch, tileInstanceBuffer, firstPlatform * tilesPerPlatform, (platformID - firstPlatform) * tilesPerPlatform);
+    }
+}
+
+void destroyInstancedTiles()
+{
+    glDeleteBuffers(1, &tileInstanceBuffer);
+    tileInstanceBuffer = 0;
+    tileInstanceCount = 0;
+    
+    destroyStaticBatch(&tileBatch);
+}
+
+
+#pragma mark - Wheels
+
+/*
+ 
+ Every wheel is the same tapered cylinder, so it's tessellated
+ once per level of detail, up front. Nearby cars get the finest
+ mesh, and distant ones get coarser meshes. With instancing, the
+ wheels of a whole train are drawn with one call per level.
+ 
+ */
+
+#define WHEEL_LOD_COUNT 3
+
+static const int wheelSlices[WHEEL_LOD_COUNT] = {32, 12, 6};
+
+//  Cars closer than these (in eye space) use the matching level
+static const float wheelLODDistance[WHEEL_LOD_COUNT-1] = {15.0f, 60.0f};
+
+StaticBatch wheelMeshes[WHEEL_LOD_COUNT];
+GLuint wheelInstanceBuffer = 0;
+
+//  Kept around between frames so that drawing doesn't allocate
+std::vector<Instance> wheelInstances[WHEEL_LOD_COUNT];
+std::vector<Instance> wheelUpload;
+
+/* Where the wheels sit, relative to the center of a car */
+
+static const float xFromCarCenter = 0.5;
+static const float yFromCarCenter = 0.5;
+
+static const float wheelOffsets[4][3] =
+{
+    {-xFromCarCenter, -yFromCarCenter, CAR_LENGTH/2.0},
+    { xFromCarCenter, -yFromCarCenter, CAR_LENGTH/2.0},
+    {-xFromCarCenter, -yFromCarCenter, -CAR_LENGTH/2.0},
+    { xFromCarCenter, -yFromCarCenter, -CAR_LENGTH/2.0}
+};
+
+/*
+ 
+ Emits the same open cylinder that gluCylinder() would, turned
+ 90 degrees about the y axis, so it lines up with the track.
+ 
+ */
+
+void appendWheel(MeshBuilder *builder, float baseRadius, float topRadius, float height, int slices, const float *color)
+{
+    GLuint firstVertex = (GLuint)builder->vertices.size();
+    
+    //  The slope of the side, same as GLU's normals
+    float normalZ = (baseRadius - topRadius) / height;
+    float normalScale = 1.0f / sqrtf(1.0f + normalZ * normalZ);
+    
+    for (int slice = 0; slice <= slices; slice++) {
+        
+        float angle = 2.0f * M_PI * (slice % slices) / slices;
+        float x = sinf(angle);
+        float y = cosf(angle);
+        
+        for (int end = 0; end < 2; end++) {
+            
+            float radius = end ? topRadius : baseRadius;
+            float z = end ? height : 0.0f;
+            
+            BatchVertex vertex;
+            
+            //  (x, y, z) turns into (z, y, -x)
+            vertex.position[0] = z;
+            vertex.position[1] = y * radius;
+            vertex.position[2] = -x * radius;
+            
+            vertex.normal[0] = normalZ * normalScale;
+            vertex.normal[1] = y * normalScale;
+            vertex.normal[2] = -x * normalScale;
+            
+            for (int i = 0; i < 4; i++) {
+                vertex.color[i] = (GLubyte)(color[i] * 255.0f + 0.5f);
+            }
+            
+            builder->vertices.push_back(vertex);
+        }
+    }
+    
+    for (int slice = 0; slice < slices; slice++) {
+        
+        GLuint base = firstVertex + slice * 2;
+        GLuint quad[6] = {base, base + 2, base + 3, base, base + 3, base + 1};
+        
+        for (int i = 0; i < 6; i++) {
+            builder->indices.push_back(quad[i]);
+        }
+    }
+}
+
+void buildWheelMeshes()
+{
+    for (int lod = 0; lod < WHEEL_LOD_COUNT; lod++) {
+        MeshBuilder builder;
+        appendWheel(&builder, 0.08, 0.06, 0.05, wheelSlices[lod], darkGray);
+        wheelMeshes[lod] = uploadStaticBatch(&builder);
+    }
+    
+    if (instancingSupported) {
+        glGenBuffers(1, &wheelInstanceBuffer);
+    }
+}
+
+void destroyWheelMeshes()
+{
+    for (int lod = 0; lod < WHEEL_LOD_COUNT; lod++) {
+        destroyStaticBatch(&wheelMeshes[lod]);
+    }
+    
+    glDeleteBuffers(1, &wheelInstanceBuffer);
+    wheelInstanceBuffer = 0;
+}
+
+/* Picks a level of detail for a point in the current modelview space */
+
+int wheelLODForPoint(const GLfloat *modelview, float x, float y, float z)
+{
+    float eyeX = modelview[0] * x + modelview[4] * y + modelview[8] * z + modelview[12];
+    float eyeY = modelview[1] * x + modelview[5] * y + modelview[9] * z + modelview[13];
+    float eyeZ = modelview[2] * x + modelview[6] * y + modelview[10] * z + modelview[14];
+    
+    float distance = sqrtf(eyeX * eyeX + eyeY * eyeY + eyeZ * eyeZ);
+    
+    int lod = 0;
+    
+    while (lod < WHEEL_LOD_COUNT - 1 && distance > wheelLODDistance[lod]) {
+        lod++;
+    }
+    
+    return lod;
+}
+
+/* Draws a single wheel, with its origin at the current position */
+
+void wheel(int lod)
+{
+    queueDraw(&wheelMeshes[lod], true);
+}
+
+/*
+ 
+ Draws the wheels for carCount cars of a train, relative to the
+ current position, given each car's transform relative to it, one
+ matrix after another.
+ 
+ */
+
+void wheels(const GLfloat *carTransforms, int carCount)
+{
+    GLfloat modelview[16];
+    getModelviewMatrix(modelview);
+    
+    for (int lod = 0; lod < WHEEL_LOD_COUNT; lod++) {
+        wheelInstances[lod].clear();
+    }
+    
+    for (int carID = 0; carID < carCount; carID++) {
+        
+        const GLfloat *car = &carTransforms[carID * 16];
+        int lod = wheelLODForPoint(modelview, car[12], car[13], car[14]);
+        
+        for (int i = 0; i < 4; i++) {
+            
+            /* Without instancing, draw each wheel from its cached mesh */
+            
+            if (!instancingSupported) {
+                pushMatrix();
+                {
+                    multiplyMatrix(car);
+                    translateMatrix(wheelOffsets[i][0], wheelOffsets[i][1], wheelOffsets[i][2]);
+                    wheel(lod);
+                }
+                popMatrix();
+                
+                continue;
+            }
+            
+            //  Instances only move, so on a bend the wheels follow their car without turning with it
+            const float *offset = wheelOffsets[i];
+            
+            Instance instance;
+            
+            instance.offset[0] = (car[0] * offset[0] + car[8] * offset[2]) + car[12];
+            instance.offset[1] = offset[1] + car[13];
+            instance.offset[2] = (car[2] * offset[0] + car[10] * offset[2]) + car[14];
+            
+            for (int c = 0; c < 4; c++) {
+                instance.color[c] = (GLubyte)(darkGray[c] * 255.0f + 0.5f);
+            }
+            
+            wheelInstances[lod].push_back(instance);
+        }
+    }
+    
+    if (!instancingSupported) {
+        return;
+    }
+    
+    /* Upload the instances, grouped by level, then draw each group */
+    
+    wheelUpload.clear();
+    
+    for (int lod = 0; lod < WHEEL_LOD_COUNT; lod++) {
+        wheelUpload.insert(wheelUpload.end(), wheelInstances[lod].begin(), wheelInstances[lod].end());
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, wheelInstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, wheelUpload.size() * sizeof(Instance), wheelUpload.empty() ? NULL : &wheelUpload[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    GLsizei firstInstance = 0;
+    
+    for (int lod = 0; lod < WHEEL_LOD_COUNT; lod++) {
+        GLsizei count = (GLsizei)wheelInstances[lod].size();
+        drawInstanced(&wheelMeshes[lod], wheelInstanceBuffer, firstInstance, count);
+        firstInstance += count;
+    }
+}
+
+
+#pragma mark - Impostors
+
+/*
+ 
+ Far down the line, a car is only a few pixels tall, but it still
+ costs a prism and four wheels. Instead, a car is drawn from a few
+ headings and heights into an atlas, once, and trains past the
+ impostor distance are drawn as a quad per car, turned to face the
+ camera, showing whichever picture was taken from closest to where
+ the camera is.
+ 
+ The pictures are lit the way the trains are, so they're taken
+ again whenever the lighting changes. The scene's lights only
+ reach the trains with their colors, not where they are, so that's
+ all that's compared.
+ 
+ */
+
+#define IMPOSTOR_HEADINGS 16        //  All the way around the car
+#define IMPOSTOR_ELEVATIONS 3       //  From level, up
+#define IMPOSTOR_ELEVATION_STEP 30.0f
+#define IMPOSTOR_TILE_SIZE 64
+#define IMPOSTOR_RADIUS 1.4f        //  Half the width of a picture, enough for a car from any side
+
+#define IMPOSTOR_ATLAS_WIDTH (IMPOSTOR_HEADINGS * IMPOSTOR_TILE_SIZE)
+#define IMPOSTOR_ATLAS_HEIGHT (IMPOSTOR_ELEVATIONS * IMPOSTOR_TILE_SIZE)
+
+//  Where the impostor program reads each corner
+#define IMPOSTOR_POSITION_ATTRIBUTE 0
+#define IMPOSTOR_COORDINATE_ATTRIBUTE 1
+
+/* What the pictures were lit with */
+
+typedef struct
+{
+    bool lit;
+    GLfloat sceneAmbient[4];
+    GLfloat ambient[MAX_SHADER_LIGHTS][4];
+    GLfloat diffuse[MAX_SHADER_LIGHTS][4];
+    GLfloat specular[MAX_SHADER_LIGHTS][4];
+    bool enabled[MAX_SHADER_LIGHTS];
+} ImpostorLighting;
+
+/* A corner of a quad, in eye space */
+
+typedef struct
+{
+    GLfloat position[3];
+    GLfloat coordinate[2];
+} ImpostorVertex;
+
+typedef struct
+{
+    GLuint atlas;
+    GLuint framebuffer;
+    GLuint depthBuffer;
+    StaticBatch carMesh;        //  A whole car, wheels and all, to take pictures of
+    
+    GLuint program;
+    GLint projectionUniform;
+    GLuint vertexBuffer;
+    
+    bool captured;
+    ImpostorLighting lighting;
+    
+    //  Kept around between frames so that drawing doesn't allocate
+    std::vector<ImpostorVertex> vertices;
+    std::vector<GLfloat> carModelviews;
+} ImpostorStage;
+
+ImpostorStage impostors;
+
+static const char *impostorCoreVertexShader =
+    "#version 150\n"
+    "\n"
+    "uniform mat4 projection;\n"
+    "in vec3 position;\n"
+    "in vec2 atlasCoordinate;\n"
+    "out vec2 coordinate;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    coordinate = atlasCoordinate;\n"
+    "    gl_Position = projection * vec4(position, 1.0);\n"
+    "}\n";
+
+static const char *impostorLegacyVertexShader =
+    "#version 120\n"
+    "\n"
+    "uniform mat4 projection;\n"
+    "attribute vec3 position;\n"
+    "attribute vec2 atlasCoordinate;\n"
+    "varying vec2 coordinate;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    coordinate = atlasCoordinate;\n"
+    "    gl_Position = projection * vec4(position, 1.0);\n"
+    "}\n";
+
+static const char *impostorFragmentSource =
+    "uniform sampler2D atlas;\n"
+    "VARYING vec2 coordinate;\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec4 color = SAMPLE(atlas, coordinate);\n"
+    "\n"
+    "    //  Around the car, there's nothing\n"
+    "    if (color.a < 0.3) {\n"
+    "        discard;\n"
+    "    }\n"
+    "\n"
+    "    //  The car's edges were averaged with nothing, as the atlas shrank\n"
+    "    OUTPUT = vec4(color.rgb / color.a, 1.0);\n"
+    "}\n";
+
+/* Emits a wheel, like appendWheel() does, but somewhere other than the origin */
+
+void appendWheelAt(MeshBuilder *builder, const float *offset, int slices)
+{
+    size_t firstVertex = builder->vertices.size();
+    
+    appendWheel(builder, 0.08, 0.06, 0.05, slices, darkGray);
+    
+    for (size_t i = firstVertex; i < builder->vertices.size(); i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            builder->vertices[i].position[axis] += offset[axis];
+        }
+    }
+}
+
+/* A whole car, wheels and all, where car() and wheels() would draw one */
+
+void appendWholeCar(MeshBuilder *builder)
+{
+    float carColor[4] = {0.7f, 0.7f, 0.71f, 1.0f};
+    appendPrism(builder, 0, 0.04, 0, 1.0, CAR_HEIGHT, CAR_LENGTH, carColor);
+    
+    for (int i = 0; i < 4; i++) {
+        appendWheelAt(builder, wheelOffsets[i], wheelSlices[0]);
+    }
+}
+
+void buildImpostors()
+{
+    impostors.captured = false;
+    
+    if (configuration.impostorDistance <= 0) {
+        return;
+    }
+    
+    /* The program that draws the quads */
+    
+    std::string fragmentSource;
+    
+    if (configuration.shaderRenderer) {
+        fragmentSource = "#version 150\n#define SAMPLE texture\n#define OUTPUT fragmentColor\n#define VARYING in\nout vec4 fragmentColor;\n";
+    }
+    else {
+        fragmentSource = "#version 120\n#define SAMPLE texture2D\n#define OUTPUT gl_FragColor\n#define VARYING varying\n";
+    }
+    
+    fragmentSource += impostorFragmentSource;
+    
+    const char *vertexSource = configuration.shaderRenderer ? impostorCoreVertexShader : impostorLegacyVertexShader;
+    const char *attributeNames[] = {"position", "atlasCoordinate"};
+    const GLuint attributeLocations[] = {IMPOSTOR_POSITION_ATTRIBUTE, IMPOSTOR_COORDINATE_ATTRIBUTE};
+    
+    impostors.program = linkProgram(vertexSource, fragmentSource.c_str(), attributeNames, attributeLocations, 2);
+    
+    if (!impostors.program) {
+        std::cerr << "Couldn't build the impostor program, so distant trains are drawn in full." << std::endl;
+        return;
+    }
+    
+    glUseProgram(impostors.program);
+    glUniform1i(glGetUniformLocation(impostors.program, "atlas"), 0);
+    impostors.projectionUniform = glGetUniformLocation(impostors.program, "projection");
+    glUseProgram(configuration.shaderRenderer ? shaderProgram : 0);
+    
+    glGenBuffers(1, &impostors.vertexBuffer);
+    
+    /* The atlas, and somewhere to draw into it */
+    
+    glGenTextures(1, &impostors.atlas);
+    glBindTexture(GL_TEXTURE_2D, impostors.atlas);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, IMPOSTOR_ATLAS_WIDTH, IMPOSTOR_ATLAS_HEIGHT, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    //  Any smaller, and the pictures would bleed into each other
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 3);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    GLint presentFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &presentFramebuffer);
+    
+    glGenFramebuffers(1, &impostors.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, impostors.framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, impostors.atlas, 0);
+    
+    glGenRenderbuffers(1, &impostors.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, impostors.depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, IMPOSTOR_ATLAS_WIDTH, IMPOSTOR_ATLAS_HEIGHT);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, impostors.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, presentFramebuffer);
+    
+    if (!complete) {
+        std::cerr << "Couldn't create a framebuffer for the impostor atlas, so distant trains are drawn in full." << std::endl;
+        destroyImpostors();
+        return;
+    }
+    
+    /* A car, to take pictures of */
+    
+    MeshBuilder builder;
+    appendWholeCar(&builder);
+    
+    impostors.carMesh = uploadStaticBatch(&builder);
+}
+
+void destroyImpostors()
+{
+    destroyStaticBatch(&impostors.carMesh);
+    
+    glDeleteProgram(impostors.program);
+    glDeleteBuffers(1, &impostors.vertexBuffer);
+    glDeleteTextures(1, &impostors.atlas);
+    glDeleteFramebuffers(1, &impostors.framebuffer);
+    glDeleteRenderbuffers(1, &impostors.depthBuffer);
+    
+    impostors.program = 0;
+    impostors.vertexBuffer = 0;
+    impostors.atlas = 0;
+    impostors.framebuffer = 0;
+    impostors.depthBuffer = 0;
+    impostors.captured = false;
+}
+
+/* The part of the light state that shows on a train */
+
+void currentImpostorLighting(ImpostorLighting *lighting)
+{
+    memset(lighting, 0, sizeof(ImpostorLighting));
+    
+    lighting->lit = configuration.shaderRenderer ? frameUniforms.options[0] != 0 : stateEnabled(GL_LIGHTING);
+    memcpy(lighting->sceneAmbient, frameUniforms.sceneAmbient, sizeof(lighting->sceneAmbient));
+    
+    for (int i = 0; i < MAX_SHADER_LIGHTS; i++) {
+        memcpy(lighting->ambient[i], frameUniforms.lights[i].ambient, sizeof(lighting->ambient[i]));
+        memcpy(lighting->diffuse[i], frameUniforms.lights[i].diffuse, sizeof(lighting->diffuse[i]));
+        memcpy(lighting->specular[i], lightSpecular[i], sizeof(lighting->specular[i]));
+        lighting->enabled[i] = stateEnabled(GL_LIGHT0 + i);
+    }
+}
+
+/* Replaces the projection, for whichever renderer's drawing */
+
+void loadProjection(const GLfloat *matrix)
+{
+    memcpy(projectionMatrix.m, matrix, sizeof(projectionMatrix.m));
+    projectionChanged = true;
+    
+    if (!configuration.shaderRenderer) {
+        glMatrixMode(GL_PROJECTION);
+        glLoadMatrixf(matrix);
+        glMatrixMode(GL_MODELVIEW);
+    }
+}
+
+/*
+ 
+ Takes a picture of a car from every heading and height, looking
+ straight at it, into its own tile of the atlas, under whatever
+ lights are on now.
+ 
+ */
+
+void captureImpostors()
+{
+    GLint presentFramebuffer = 0;
+    GLint viewport[4];
+    GLfloat clearColor[4];
+    GLfloat projection[16];
+    
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &presentFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetFloatv(GL_COLOR_CLEAR_VALUE, clearColor);
+    getProjectionMatrix(projection);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, impostors.framebuffer);
+    glClearColor(0, 0, 0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    //  Looking straight at the car, from far enough that perspective hardly matters
+    GLfloat orthographic[16];
+    identityMatrix(orthographic);
+    
+    orthographic[0] = 1.0f / IMPOSTOR_RADIUS;
+    orthographic[5] = 1.0f / IMPOSTOR_RADIUS;
+    orthographic[10] = -1.0f / IMPOSTOR_RADIUS;
+    
+    loadProjection(orthographic);
+    
+    //  The station fixtures are binned for the view, not for the atlas
+    int binned = stationLightsBinned;
+    stationLightsBinned = 0;
+    
+    for (int elevation = 0; elevation < IMPOSTOR_ELEVATIONS; elevation++) {
+        for (int heading = 0; heading < IMPOSTOR_HEADINGS; heading++) {
+            
+            glViewport(heading * IMPOSTOR_TILE_SIZE, elevation * IMPOSTOR_TILE_SIZE, IMPOSTOR_TILE_SIZE, IMPOSTOR_TILE_SIZE);
+            
+            pushMatrix();
+            {
+                GLfloat identity[16];
+                identityMatrix(identity);
+                loadMatrix(identity);
+                
+                //  Turn the car until the camera's looking at it from here
+                rotateMatrix(elevation * IMPOSTOR_ELEVATION_STEP, 1, 0, 0);
+                rotateMatrix(-heading * 360.0f / IMPOSTOR_HEADINGS, 0, 1, 0);
+                
+                drawStaticBatch(&impostors.carMesh);
+            }
+            popMatrix();
+        }
+    }
+    
+    stationLightsBinned = binned;
+    
+    glBindTexture(GL_TEXTURE_2D, impostors.atlas);
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    /* Put back the view */
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, presentFramebuffer);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glClearColor(clearColor[0], clearColor[1], clearColor[2], clearColor[3]);
+    loadProjection(projection);
+    
+    impostors.captured = true;
+}
+
+/* Takes the pictures again, if the lighting's changed since they were taken, and starts the frame's quads */
+
+void beginImpostors()
+{
+    impostors.vertices.clear();
+    
+    if (!impostors.program) {
+        return;
+    }
+    
+    ImpostorLighting lighting;
+    currentImpostorLighting(&lighting);
+    
+    if (!impostors.captured || memcmp(&lighting, &impostors.lighting, sizeof(lighting))) {
+        impostors.lighting = lighting;
+        captureImpostors();
+    }
+}
+
+/*
+ 
+ Queues a quad for each car of a train, if every car is past the
+ impostor distance. Otherwise, the train has to be drawn in full.
+ 
+ */
+
+bool queueTrainImpostors(int trainID)
+{
+    if (!impostors.program) {
+        return false;
+    }
+    
+    //  Cars' transforms into eye space
+    impostors.carModelviews.resize(16 * sceneGraph.carsPerTrain);
+    GLfloat *carModelviews = &impostors.carModelviews[0];
+    
+    for (int carID = 0; carID < sceneGraph.carsPerTrain; carID++) {
+        
+        GLfloat *modelview = &carModelviews[carID * 16];
+        multiplyMatrices(sceneView, &sceneGraph.world[carNode(trainID, carID) * 16], modelview);
+        
+        float distance = sqrtf(modelview[12] * modelview[12] + modelview[13] * modelview[13] + modelview[14] * modelview[14]);
+        
+        if (distance < configuration.impostorDistance) {
+            return false;
+        }
+    }
+    
+    for (int carID = 0; carID < sceneGraph.carsPerTrain; carID++) {
+        
+        const GLfloat *modelview = &carModelviews[carID * 16];
+        const GLfloat *center = &modelview[12];
+        
+        /* Where the camera is, seen from the car */
+        
+        float distance = sqrtf(center[0] * center[0] + center[1] * center[1] + center[2] * center[2]);
+        float toCamera[3] = {-center[0] / distance, -center[1] / distance, -center[2] / distance};
+        
+        float local[3];
+        
+        for (int axis = 0; axis < 3; axis++) {
+            local[axis] = modelview[axis * 4] * toCamera[0] + modelview[axis * 4 + 1] * toCamera[1] + modelview[axis * 4 + 2] * toCamera[2];
+        }
+        
+        float heading = atan2f(local[0], local[2]) / DEG2RAD;
+        float elevation = atan2f(local[1], sqrtf(local[0] * local[0] + local[2] * local[2])) / DEG2RAD;
+        
+        int column = (int)floorf(heading / (360.0f / IMPOSTOR_HEADINGS) + 0.5f);
+        column = ((column % IMPOSTOR_HEADINGS) + IMPOSTOR_HEADINGS) % IMPOSTOR_HEADINGS;
+        
+        int row = (int)floorf(elevation / IMPOSTOR_ELEVATION_STEP + 0.5f);
+        row = std::max(0, std::min(IMPOSTOR_ELEVATIONS - 1, row));
+        
+        /* Face the camera, with the car's up as up, like the picture */
+        
+        float up[3] = {modelview[4], modelview[5], modelview[6]};
+        float along = up[0] * toCamera[0] + up[1] * toCamera[1] + up[2] * toCamera[2];
+        
+        for (int axis = 0; axis < 3; axis++) {
+            up[axis] -= along * toCamera[axis];
+        }
+        
+        float upLength = sqrtf(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+        
+        //  Looking straight down, any way up will do
+        if (upLength < 1e-3f) {
+            up[0] = 0;
+            up[1] = 1;
+            up[2] = 0;
+            upLength = 1;
+        }
+        
+        for (int axis = 0; axis < 3; axis++) {
+            up[axis] *= IMPOSTOR_RADIUS / upLength;
+        }
+        
+        //  up x toCamera, as long as up is
+        float right[3] = {
+            up[1] * toCamera[2] - up[2] * toCamera[1],
+            up[2] * toCamera[0] - up[0] * toCamera[2],
+            up[0] * toCamera[1] - up[1] * toCamera[0]
+        };
+        
+        /* Two triangles, in eye space */
+        
+        static const float corners[6][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, -1}, {1, 1}, {-1, 1}};
+        
+        for (int i = 0; i < 6; i++) {
+            
+            ImpostorVertex vertex;
+            
+            for (int axis = 0; axis < 3; axis++) {
+                vertex.position[axis] = center[axis] + corners[i][0] * right[axis] + corners[i][1] * up[axis];
+            }
+            
+            vertex.coordinate[0] = (column + (corners[i][0] + 1) / 2) / IMPOSTOR_HEADINGS;
+            vertex.coordinate[1] = (row + (corners[i][1] + 1) / 2) / IMPOSTOR_ELEVATIONS;
+            
+            impostors.vertices.push_back(vertex);
+        }
+    }
+    
+    frameStats.impostors += sceneGraph.carsPerTrain;
+    
+    return true;
+}
+
+/* Draws every quad that was queued this frame, with one call */
+
+void drawImpostors()
+{
+    if (impostors.vertices.empty()) {
+        return;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, impostors.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, impostors.vertices.size() * sizeof(ImpostorVertex), &impostors.vertices[0], GL_STREAM_DRAW);
+    
+    glEnableVertexAttribArray(IMPOSTOR_POSITION_ATTRIBUTE);
+    glVertexAttribPointer(IMPOSTOR_POSITION_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, sizeof(ImpostorVertex), (const GLvoid *)offsetof(ImpostorVertex, position));
+    glEnableVertexAttribArray(IMPOSTOR_COORDINATE_ATTRIBUTE);
+    glVertexAttribPointer(IMPOSTOR_COORDINATE_ATTRIBUTE, 2, GL_FLOAT, GL_FALSE, sizeof(ImpostorVertex), (const GLvoid *)offsetof(ImpostorVertex, coordinate));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    GLfloat projection[16];
+    getProjectionMatrix(projection);
+    
+    glUseProgram(impostors.program);
+    glUniformMatrix4fv(impostors.projectionUniform, 1, GL_FALSE, projection);
+    
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, impostors.atlas);
+    
+    glDrawArrays(GL_TRIANGLES, 0, (GLsizei)impostors.vertices.size());
+    
+    frameStats.drawCalls++;
+    frameStats.vertices += (long)impostors.vertices.size();
+    
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(configuration.shaderRenderer ? shaderProgram : 0);
+    
+    glDisableVertexAttribArray(IMPOSTOR_POSITION_ATTRIBUTE);
+    glDisableVertexAttribArray(IMPOSTOR_COORDINATE_ATTRIBUTE);
+}
+
+
+#pragma mark - Culling
+
+/*
+ 
+ The line runs along the z axis, so the scene is indexed by a
+ uniform grid of cells along z. Each cell knows which track
+ segments, platforms and trains overlap it. Every frame, cells
+ outside the view frustum are skipped wholesale, and only the
+ contents of the remaining cells are tested one by one.
+ 
+ */
+
+#define GRID_CELL_LENGTH 50.0f
+
+typedef struct
+{
+    std::vector<int> segments;
+    std::vector<int> platforms;
+    std::vector<int> trains;
+} GridCell;
+
+std::vector<GridCell> sceneGrid;
+float sceneGridStartZ = 0;
+
+//  The x and y extent of every cell
+Bounds sceneGridExtent;
+
+//  Planes of the view frustum, in scene space, as ax + by + cz + d >= 0
+float frustumPlanes[6][4];
+
+//  Scene space to clip space, from the last call to updateFrustum()
+float frustumClip[16];
+
+//  Keeps items that span several cells from being tested twice
+std::vector<unsigned int> segmentCullStamp;
+unsigned int cullStamp = 0;
+
+std::vector<int> visibleTrackSegments;
+
+/* The bounding box of a platform, in scene space */
+
+void platformBounds(int platformID, Bounds *bounds)
+{
+    float halfWidth = platformWidth/2 + stripWidth*1.5f;
+    
+    bounds->min[0] = -halfWidth;
+    bounds->max[0] = halfWidth;
+    bounds->min[1] = PLATFORM_Y - platformHeight/2;
+    bounds->max[1] = PLATFORM_Y + platformHeight/2 + pillarHeight;
+    bounds->min[2] = platformOffsetZ[platformID] - platformLength/2;
+    bounds->max[2] = platformOffsetZ[platformID] + platformLength/2;
+}
+
+/* The bounding box of a train, wheels and all, in scene space, from its cars' nodes */
+
+void trainBounds(int trainID, Bounds *bounds)
+{
+    float y = drawnTrains.positionY[trainID];
+    
+    //  How far a car reaches from its center, whichever way it's turned on a bend
+    const float halfLength = CAR_LENGTH/2 + 0.08f;
+    const float reach = sqrtf(0.55f * 0.55f + halfLength * halfLength);
+    
+    //  The cars' world transforms, which were worked out before culling
+    for (int carID = 0; carID < sceneGraph.carsPerTrain; carID++) {
+        
+        const float *world = &sceneGraph.world[carNode(trainID, carID) * 16];
+        
+        if (carID == 0) {
+            bounds->min[0] = bounds->max[0] = world[12];
+            bounds->min[2] = bounds->max[2] = world[14];
+            continue;
+        }
+        
+        bounds->min[0] = fminf(bounds->min[0], world[12]);
+        bounds->max[0] = fmaxf(bounds->max[0], world[12]);
+        bounds->min[2] = fminf(bounds->min[2], world[14]);
+        bounds->max[2] = fmaxf(bounds->max[2], world[14]);
+    }
+    
+    bounds->min[0] -= reach;
+    bounds->max[0] += reach;
+    bounds->min[1] = y - 0.58f;
+    bounds->max[1] = y + 0.04f + CAR_HEIGHT/2;
+    bounds->min[2] -= reach;
+    bounds->max[2] += reach;
+}
+
+void growBounds(Bounds *bounds, const Bounds *other)
+{
+    for (int i = 0; i < 3; i++) {
+        bounds->min[i] = fminf(bounds->min[i], other->min[i]);
+        bounds->max[i] = fmaxf(bounds->max[i], other->max[i]);
+    }
+}
+
+/* The range of cells that a stretch of z overlaps, clamped to the grid */
+
+void gridCellsForRange(float minZ, float maxZ, int *firstCell, int *lastCell)
+{
+    int cellCount = (int)sceneGrid.size();
+    
+    *firstCell = (int)floorf((minZ - sceneGridStartZ) / GRID_CELL_LENGTH);
+    *lastCell = (int)floorf((maxZ - sceneGridStartZ) / GRID_CELL_LENGTH);
+    
+    *firstCell = std::max(0, std::min(cellCount - 1, *firstCell));
+    *lastCell = std::max(0, std::min(cellCount - 1, *lastCell));
+}
+
+void buildSceneGrid()
+{
+    /* Cover the track's window, which reaches past anything the camera can see */
+    
+    float minZ = trackWindowStartZ;
+    float maxZ = trackWindowEndZ;
+    
+    sceneGridStartZ = minZ;
+    sceneGrid.clear();
+    sceneGrid.resize((size_t)ceilf((maxZ - minZ) / GRID_CELL_LENGTH) + 1);
+    
+    /* Make room for the trains, wherever they end up on their tracks */
+    
+    for (int i = 0; i < 3; i++) {
+        sceneGridExtent.min[i] = 0;
+        sceneGridExtent.max[i] = 0;
+    }
+    
+    for (int i = 0; i < tracks.count; i++) {
+        sceneGridExtent.min[0] = fminf(sceneGridExtent.min[0], tracks.offsetX[i] - 1.0f);
+        sceneGridExtent.max[0] = fmaxf(sceneGridExtent.max[0], tracks.offsetX[i] + 1.0f);
+    }
+    
+    sceneGridExtent.max[1] = CAR_HEIGHT;
+    
+    /* Track segments */
+    
+    for (size_t i = 0; i < trackBatch.parts.size(); i++) {
+        
+        //  Slots outside the line have nothing in them
+        if (trackRing.slotSegment[i] < 0) {
+            continue;
+        }
+        
+        const Bounds *bounds = &trackBatch.parts[i].bounds;
+        growBounds(&sceneGridExtent, bounds);
+        
+        int firstCell, lastCell;
+        gridCellsForRange(bounds->min[2], bounds->max[2], &firstCell, &lastCell);
+        
+        for (int cell = firstCell; cell <= lastCell; cell++) {
+            sceneGrid[cell].segments.push_back((int)i);
+        }
+    }
+    
+    segmentCullStamp.assign(trackBatch.parts.size(), 0);
+    
+    /* Platforms */
+    
+    for (int i = 0; i < platformCount; i++) {
+        
+        Bounds bounds;
+        platformBounds(i, &bounds);
+        growBounds(&sceneGridExtent, &bounds);
+        
+        int firstCell, lastCell;
+        gridCellsForRange(bounds.min[2], bounds.max[2], &firstCell, &lastCell);
+        
+        for (int cell = firstCell; cell <= lastCell; cell++) {
+            sceneGrid[cell].platforms.push_back(i);
+        }
+    }
+}
+
+/* Pulls the frustum planes out of the current projection and modelview matrices */
+
+void updateFrustum()
+{
+    GLfloat projection[16];
+    GLfloat modelview[16];
+    GLfloat clip[16];
+    
+    getProjectionMatrix(projection);
+    getModelviewMatrix(modelview);
+    
+    //  clip = projection * modelview, column major
+    for (int column = 0; column < 4; column++) {
+        for (int row = 0; row < 4; row++) {
+            clip[column * 4 + row] = 0;
+            
+            for (int k = 0; k < 4; k++) {
+                clip[column * 4 + row] += projection[k * 4 + row] * modelview[column * 4 + k];
+            }
+        }
+    }
+    
+    memcpy(frustumClip, clip, sizeof(frustumClip));
+    
+    //  Each plane is the last row of the matrix, plus or minus one of the others
+    for (int i = 0; i < 6; i++) {
+        
+        int row = i / 2;
+        float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+        
+        for (int column = 0; column < 4; column++) {
+            frustumPlanes[i][column] = clip[column * 4 + 3] + sign * clip[column * 4 + row];
+        }
+    }
+}
+
+/* Is any part of the box on the inside of every plane? */
+
+bool boundsInFrustum(const Bounds *bounds)
+{
+    for (int i = 0; i < 6; i++) {
+        
+        const float *plane = frustumPlanes[i];
+        
+        //  The corner furthest along the plane's normal
+        float x = plane[0] > 0 ? bounds->max[0] : bounds->min[0];
+        float y = plane[1] > 0 ? bounds->max[1] : bounds->min[1];
+        float z = plane[2] > 0 ? bounds->max[2] : bounds->min[2];
+        
+        if (plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+/*
+ 
+ Decides which segments, platforms and trains are visible,
+ using the frustum from the last call to updateFrustum().
+ 
+ */
+
+void cullScene()
+{
+    cullStamp++;
+    
+    for (int i = 0; i < platformCount; i++) {
+        platformVisible[i] = false;
+    }
+    
+    /* Trains move, so they're filed into the grid again every frame, unless the shader moves them */
+    
+    for (size_t cell = 0; cell < sceneGrid.size(); cell++) {
+        sceneGrid[cell].trains.clear();
+    }
+    
+    int trainCount = configuration.gpuTrainMotion ? 0 : trains.count;
+    
+    for (int i = 0; i < trainCount; i++) {
+        
+        trains.visible[i] = false;
+        
+        Bounds bounds;
+        trainBounds(i, &bounds);
+        
+        int firstCell, lastCell;
+        gridCellsForRange(bounds.min[2], bounds.max[2], &firstCell, &lastCell);
+        
+        for (int cell = firstCell; cell <= lastCell; cell++) {
+            sceneGrid[cell].trains.push_back(i);
+        }
+    }
+    
+    /* Walk the cells, and test the contents of the ones in view */
+    
+    visibleTrackSegments.clear();
+    
+    for (size_t cell = 0; cell < sceneGrid.size(); cell++) {
+        
+        Bounds cellBounds = sceneGridExtent;
+        cellBounds.min[2] = sceneGridStartZ + cell * GRID_CELL_LENGTH;
+        cellBounds.max[2] = cellBounds.min[2] + GRID_CELL_LENGTH;
+        
+        if (!boundsInFrustum(&cellBounds)) {
+            continue;
+        }
+        
+        GridCell *gridCell = &sceneGrid[cell];
+        
+        for (size_t i = 0; i < gridCell->segments.size(); i++) {
+            
+            int segment = gridCell->segments[i];
+            
+            if (segmentCullStamp[segment] == cullStamp) {
+                continue;
+            }
+            
+            segmentCullStamp[segment] = cullStamp;
+            
+            if (boundsInFrustum(&trackBatch.parts[segment].bounds)) {
+                visibleTrackSegments.push_back(segment);
+            }
+        }
+        
+        for (size_t i = 0; i < gridCell->platforms.size(); i++) {
+            
+            int platformID = gridCell->platforms[i];
+            
+            if (!platformVisible[platformID]) {
+                Bounds bounds;
+                platformBounds(platformID, &bounds);
+                platformVisible[platformID] = boundsInFrustum(&bounds);
+            }
+        }
+        
+        for (size_t i = 0; i < gridCell->trains.size(); i++) {
+            
+            int trainID = gridCell->trains[i];
+            
+            if (!trains.visible[trainID]) {
+                Bounds bounds;
+                trainBounds(trainID, &bounds);
+                trains.visible[trainID] = boundsInFrustum(&bounds);
+            }
+        }
+    }
+    
+    /* Drop whatever's in view but hidden */
+    
+    cullOccluded();
+    
+    /* Merge neighboring segments, so that they're drawn as one range */
+    
+    std::sort(visibleTrackSegments.begin(), visibleTrackSegments.end());
+    
+    visibleTrackCounts.clear();
+    visibleTrackOffsets.clear();
+    
+    GLuint runEnd = 0;
+    
+    for (size_t i = 0; i < visibleTrackSegments.size(); i++) {
+        
+        const MeshPart *part = &trackBatch.parts[visibleTrackSegments[i]];
+        
+        if (!visibleTrackCounts.empty() && part->firstIndex == runEnd) {
+            visibleTrackCounts.back() += part->indexCount;
+        }
+        else {
+            visibleTrackCounts.push_back(part->indexCount);
+            visibleTrackOffsets.push_back((const GLvoid *)(part->firstIndex * sizeof(GLuint)));
+        }
+        
+        runEnd = part->firstIndex + part->indexCount;
+    }
+}
+
+
+#pragma mark - Occlusion Culling
+
+/*
+ 
+ In the stations, the platforms and the trains nearest the camera
+ hide a lot of what's behind them. Once the frustum's had its say,
+ the platform bases and train cars still in view are drawn, in
+ software, into a small depth buffer, and every segment, platform
+ and train still in view is tested against it. Anything whose
+ nearest corner is behind the depth buffer, everywhere it covers,
+ is hidden.
+ 
+ An occluder only fills the texels it covers completely, with the
+ furthest depth it reaches in each, so nothing that could show
+ round its edges is ever thrown away, and the picture's the same
+ with or without it.
+ 
+ The depth buffer is kept as a pyramid, each level holding the
+ furthest depth of the four texels under it, so a box is tested
+ against a handful of texels, however much of the screen it covers.
+ 
+ This runs on the CPU, against the frame being drawn, rather than
+ asking the GPU with occlusion queries. The answer doesn't arrive
+ frames late, nothing pops in as the camera turns, and it works
+ the same for both renderers.
+ 
+ */
+
+#define OCCLUSION_WIDTH 96          //  The window's shape, a fifth of its size
+#define OCCLUSION_HEIGHT 64
+#define OCCLUSION_LEVELS 6          //  Down to 3 x 2
+#define OCCLUSION_TEST_TEXELS 4     //  Test a box on the first level where it spans no more than this each way
+#define OCCLUSION_NEAR 1.0f         //  The near plane, in front of which nothing lands in the buffer
+
+//  Depth from -1 to 1, in texels across, then up
+float occlusionDepth[OCCLUSION_LEVELS][OCCLUSION_WIDTH * OCCLUSION_HEIGHT];
+
+//  The corners of a box that make up each of its faces, in order round it
+static const int boxFaces[6][4] = {
+    {0, 2, 6, 4}, {1, 3, 7, 5},     //  x
+    {0, 1, 5, 4}, {2, 3, 7, 6},     //  y
+    {0, 1, 3, 2}, {4, 5, 7, 6}      //  z
+};
+
+/* Projects a point into the depth buffer, unless it's in front of the near plane */
+
+bool projectToOcclusionBuffer(const float *matrix, const float *point, float *projected)
+{
+    float clip[4];
+    
+    for (int row = 0; row < 4; row++) {
+        clip[row] = matrix[row] * point[0] + matrix[4 + row] * point[1] + matrix[8 + row] * point[2] + matrix[12 + row];
+    }
+    
+    if (clip[3] < OCCLUSION_NEAR) {
+        return false;
+    }
+    
+    projected[0] = (clip[0] / clip[3] * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+    projected[1] = (clip[1] / clip[3] * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+    projected[2] = clip[2] / clip[3];
+    
+    return true;
+}
+
+/* Fills the texels a projected face covers completely, where it's nearer than what's there */
+
+void rasterizeOccluderFace(const float *a, const float *b, const float *c, const float *d)
+{
+    const float *corners[4] = {a, b, c, d};
+    
+    //  Which way round the face is, on screen
+    float area = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        const float *from = corners[i];
+        const float *to = corners[(i + 1) % 4];
+        area += from[0] * to[1] - to[0] * from[1];
+    }
+    
+    //  Edge on, it covers nothing
+    if (fabsf(area) < 1e-4f) {
+        return;
+    }
+    
+    float winding = area > 0 ? 1.0f : -1.0f;
+    
+    /* Depth is a plane across the screen, through the first three corners */
+    
+    float ux = b[0] - a[0], uy = b[1] - a[1], uz = b[2] - a[2];
+    float vx = c[0] - a[0], vy = c[1] - a[1], vz = c[2] - a[2];
+    float determinant = ux * vy - uy * vx;
+    
+    if (fabsf(determinant) < 1e-4f) {
+        return;
+    }
+    
+    float depthPerX = (uz * vy - uy * vz) / determinant;
+    float depthPerY = (ux * vz - uz * vx) / determinant;
+    
+    //  Only texels wholly between the face's outermost corners can be covered
+    float minX = fminf(fminf(a[0], b[0]), fminf(c[0], d[0]));
+    float maxX = fmaxf(fmaxf(a[0], b[0]), fmaxf(c[0], d[0]));
+    float minY = fminf(fminf(a[1], b[1]), fminf(c[1], d[1]));
+    float maxY = fmaxf(fmaxf(a[1], b[1]), fmaxf(c[1], d[1]));
+    
+    int firstX = std::max(0, (int)ceilf(minX));
+    int lastX = std::min(OCCLUSION_WIDTH, (int)floorf(maxX)) - 1;
+    int firstY = std::max(0, (int)ceilf(minY));
+    int lastY = std::min(OCCLUSION_HEIGHT, (int)floorf(maxY)) - 1;
+    
+    float *depth = occlusionDepth[0];
+    
+    for (int y = firstY; y <= lastY; y++) {
+        for (int x = firstX; x <= lastX; x++) {
+            
+            /* Edges are straight, so a texel's inside if its worst corner is */
+            
+            bool covered = true;
+            
+            for (int i = 0; i < 4 && covered; i++) {
+                const float *from = corners[i];
+                const float *to = corners[(i + 1) % 4];
+                
+                float edgeX = winding * (to[0] - from[0]);
+                float edgeY = winding * (to[1] - from[1]);
+                float inside = edgeX * (y - from[1]) - edgeY * (x - from[0]);
+                
+                covered = inside + fminf(0, edgeX) + fminf(0, -edgeY) >= 0;
+            }
+            
+            if (!covered) {
+                continue;
+            }
+            
+            //  The furthest the face gets, anywhere in the texel
+            float furthest = a[2] + depthPerX * (x - a[0]) + depthPerY * (y - a[1]) + fmaxf(0, depthPerX) + fmaxf(0, depthPerY);
+            
+            float *texel = &depth[y * OCCLUSION_WIDTH + x];
+            *texel = fminf(*texel, furthest);
+        }
+    }
+}
+
+/* Draws a box, centered on a point in a node's space, into the depth buffer */
+
+void rasterizeOccluder(const float *world, float centerX, float centerY, float centerZ, float width, float height, float length)
+{
+    float matrix[16];
+    multiplyMatrices(frustumClip, world, matrix);
+    
+    float projected[8][3];
+    
+    for (int corner = 0; corner < 8; corner++) {
+        
+        float point[3] = {
+            centerX + ((corner & 1) ? width/2 : -width/2),
+            centerY + ((corner & 2) ? height/2 : -height/2),
+            centerZ + ((corner & 4) ? length/2 : -length/2)
+        };
+        
+        //  Clipping it isn't worth it, for what's so close anyway
+        if (!projectToOcclusionBuffer(matrix, point, projected[corner])) {
+            return;
+        }
+    }
+    
+    //  Back faces too, which can fill the seams between front faces
+    for (int face = 0; face < 6; face++) {
+        const int *corners = boxFaces[face];
+        rasterizeOccluderFace(projected[corners[0]], projected[corners[1]], projected[corners[2]], projected[corners[3]]);
+    }
+}
+
+/* Each level keeps the furthest depth of the four texels under it */
+
+void buildOcclusionPyramid()
+{
+    for (int level = 1; level < OCCLUSION_LEVELS; level++) {
+        
+        int width = OCCLUSION_WIDTH >> level;
+        int height = OCCLUSION_HEIGHT >> level;
+        
+        const float *below = occlusionDepth[level - 1];
+        float *depth = occlusionDepth[level];
+        
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                
+                const float *texels = &below[(y * 2) * (width * 2) + x * 2];
+                depth[y * width + x] = fmaxf(fmaxf(texels[0], texels[1]), fmaxf(texels[width * 2], texels[width * 2 + 1]));
+            }
+        }
+    }
+}
+
+/* Is the box behind the depth buffer, everywhere it covers? */
+
+bool boundsOccluded(const Bounds *bounds)
+{
+    float minX = INFINITY, maxX = -INFINITY;
+    float minY = INFINITY, maxY = -INFINITY;
+    float nearest = INFINITY;
+    
+    for (int corner = 0; corner < 8; corner++) {
+        
+        float point[3] = {
+            (corner & 1) ? bounds->max[0] : bounds->min[0],
+            (corner & 2) ? bounds->max[1] : bounds->min[1],
+            (corner & 4) ? bounds->max[2] : bounds->min[2]
+        };
+        
+        float projected[3];
+        
+        //  Anything reaching the near plane is right in front of the camera
+        if (!projectToOcclusionBuffer(frustumClip, point, projected)) {
+            return false;
+        }
+        
+        minX = fminf(minX, projected[0]);
+        maxX = fmaxf(maxX, projected[0]);
+        minY = fminf(minY, projected[1]);
+        maxY = fmaxf(maxY, projected[1]);
+        nearest = fminf(nearest, projected[2]);
+    }
+    
+    if (maxX < 0 || maxY < 0 || minX >= OCCLUSION_WIDTH || minY >= OCCLUSION_HEIGHT) {
+        return false;
+    }
+    
+    int firstX = std::max(0, (int)floorf(minX));
+    int lastX = std::min(OCCLUSION_WIDTH - 1, (int)floorf(maxX));
+    int firstY = std::max(0, (int)floorf(minY));
+    int lastY = std::min(OCCLUSION_HEIGHT - 1, (int)floorf(maxY));
+    
+    /* Go up the pyramid until the box only covers a few texels */
+    
+    int level = 0;
+    
+    while (level < OCCLUSION_LEVELS - 1 && ((lastX >> level) - (firstX >> level) >= OCCLUSION_TEST_TEXELS || (lastY >> level) - (firstY >> level) >= OCCLUSION_TEST_TEXELS)) {
+        level++;
+    }
+    
+    int width = OCCLUSION_WIDTH >> level;
+    const float *depth = occlusionDepth[level];
+    
+    for (int y = firstY >> level; y <= lastY >> level; y++) {
+        for (int x = firstX >> level; x <= lastX >> level; x++) {
+            if (depth[y * width + x] >= nearest) {
+                return false;
+            }
+        }
+    }
+    
+    return true;
+}
+
+/*
+ 
+ Takes whatever's hidden out of what cullScene() found in the
+ frustum, using the frustum from the last call to updateFrustum().
+ 
+ */
+
+void cullOccluded()
+{
+    if (!configuration.occlusionCulling) {
+        return;
+    }
+    
+    std::fill(occlusionDepth[0], occlusionDepth[0] + OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.0f);
+    
+    //  Trains the shader moves are nowhere, as far as the CPU knows
+    int trainCount = configuration.gpuTrainMotion ? 0 : trains.count;
+    
+    /* The platforms' bases, and the bodies of the cars, are solid */
+    
+    for (int i = 0; i < platformCount; i++) {
+        if (platformVisible[i]) {
+            rasterizeOccluder(&sceneGraph.world[platformNode(i) * 16], 0, 0, 0, platformWidth, platformHeight, platformLength);
+        }
+    }
+    
+    for (int i = 0; i < trainCount; i++) {
+        
+        if (!trains.visible[i] || !tracks.showTrains[trains.trackID[i]]) {
+            continue;
+        }
+        
+        for (int carID = 0; carID < sceneGraph.carsPerTrain; carID++) {
+            rasterizeOccluder(&sceneGraph.world[carNode(i, carID) * 16], 0, 0.04f, 0, 1.0f, CAR_HEIGHT, CAR_LENGTH);
+        }
+    }
+    
+    buildOcclusionPyramid();
+    
+    /* Then test everything that's in view against them */
+    
+    size_t kept = 0;
+    
+    for (size_t i = 0; i < visibleTrackSegments.size(); i++) {
+        
+        int segment = visibleTrackSegments[i];
+        
+        if (boundsOccluded(&trackBatch.parts[segment].bounds)) {
+            frameStats.occluded++;
+            continue;
+        }
+        
+        visibleTrackSegments[kept++] = segment;
+    }
+    
+    visibleTrackSegments.resize(kept);
+    
+    for (int i = 0; i < platformCount; i++) {
+        
+        if (!platformVisible[i]) {
+            continue;
+        }
+        
+        Bounds bounds;
+        platformBounds(i, &bounds);
+        
+        if (boundsOccluded(&bounds)) {
+            platformVisible[i] = false;
+            frameStats.occluded++;
+        }
+    }
+    
+    for (int i = 0; i < trainCount; i++) {
+        
+        if (!trains.visible[i]) {
+            continue;
+        }
+        
+        Bounds bounds;
+        trainBounds(i, &bounds);
+        
+        if (boundsOccluded(&bounds)) {
+            trains.visible[i] = false;
+            frameStats.occluded++;
+        }
+    }
+}
+
+
+#pragma mark - Network
+
+/*
+ 
+ A network can be described in a text file, instead of laid out
+ from the command line. The description is compiled, offline, into
+ a flat binary, which is mapped into memory at startup and read
+ in place. It's a header followed by arrays of fixed size records,
+ which the header finds by their offsets from the start of the
+ file, so there's nothing in it to parse, and no pointers to fix up.
+ 
+ The binary is in the byte order of the machine that compiled it.
+ 
+ A description is made up of lines like these, in any order, and
+ anything after a # is a comment:
+ 
+ line LENGTH                How far the line runs each way from the middle
+ cars-per-train N           How many cars make up each train
+ platform-length LENGTH     How long every platform is
+ fixtures N                 How many ceiling lights hang over each platform
+ track X DIRECTION          A track at X across the line, running uptown (+z) or downtown
+ bend TRACK Z X             The TRACKth track passes through X across the line, at Z along it
+ station NAME Z             A station, with its platform centered at Z along the line
+ train TRACK Z [SPEED]      A train on the TRACKth track, its front car at Z
+ 
+ A track runs from one end of the line to the other, through its
+ bends, in order of z, and is straight past the first and last
+ of them. It starts and ends at its X.
+
+ Every number has to be finite. A platform is at least a tile
+ long, bends are strictly inside the line, and no train goes
+ further than the whole line in a tick. The loader checks all
+ of that again, since a binary may not have come from here.
+ 
+ */
+
+#define NETWORK_FILE_MAGIC "IBNETWRK"
+#define NETWORK_FILE_VERSION 2
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    float trackLength;
+    float platformLength;
+    uint32_t carsPerTrain;
+    uint32_t fixturesPerPlatform;
+    uint32_t trackCount;
+    uint32_t trackOffset;           //  In bytes, from the start of the file
+    uint32_t platformCount;
+    uint32_t platformOffset;
+    uint32_t trainCount;
+    uint32_t trainOffset;
+    uint32_t bendCount;
+    uint32_t bendOffset;
+} NetworkHeader;
+
+typedef struct
+{
+    float offsetX;
+    uint32_t direction;             //  0 for uptown, 1 for downtown
+    uint32_t firstBend;             //  Its bends, in order of z
+    uint32_t bendCount;
+} NetworkTrack;
+
+typedef struct
+{
+    float z;
+    float x;
+} NetworkBend;
+
+typedef struct
+{
+    float offsetZ;
+} NetworkPlatform;
+
+typedef struct
+{
+    uint32_t trackID;
+    float positionZ;
+    float speed;
+} NetworkTrain;
+
+//  The mapped network, if there is one
+const NetworkHeader *network = NULL;
+size_t networkSize = 0;
+
+const NetworkTrack *networkTracks()
+{
+    return (const NetworkTrack *)((const char *)network + network->trackOffset);
+}
+
+const NetworkPlatform *networkPlatforms()
+{
+    return (const NetworkPlatform *)((const char *)network + network->platformOffset);
+}
+
+const NetworkTrain *networkTrains()
+{
+    return (const NetworkTrain *)((const char *)network + network->trainOffset);
+}
+
+const NetworkBend *networkBends()
+{
+    return (const NetworkBend *)((const char *)network + network->bendOffset);
+}
+
+bool compareBends(const NetworkBend &a, const NetworkBend &b)
+{
+    return a.z < b.z;
+}
+
+/* Reads a train's speed, if its line gives one, and says whether the trains can run at it */
+
+bool readTrainSpeed(const char *line, float *speed)
+{
+    *speed = TRAIN_SPEED;
+    sscanf(line, "%*s %*d %*f %f", speed);
+    
+    return isfinite(*speed) && *speed >= 0;
+}
+
+/* Compiles a network description into a binary, or says what's wrong with it */
+
+bool compileNetwork(const char *sourcePath, const char *binaryPath)
+{
+    FILE *source = fopen(sourcePath, "r");
+    
+    if (!source) {
+        std::cerr << "Couldn't open " << sourcePath << std::endl;
+        return false;
+    }
+    
+    NetworkHeader header;
+    memset(&header, 0, sizeof(header));
+    
+    memcpy(header.magic, NETWORK_FILE_MAGIC, sizeof(header.magic));
+    header.version = NETWORK_FILE_VERSION;
+    header.trackLength = DEFAULT_TRACK_LENGTH;
+    header.platformLength = PLATFORM_LENGTH;
+    header.carsPerTrain = DEFAULT_CARS_PER_TRAIN;
+    header.fixturesPerPlatform = DEFAULT_FIXTURES_PER_PLATFORM;
+    
+    std::vector<NetworkTrack> compiledTracks;
+    std::vector<NetworkPlatform> compiledPlatforms;
+    std::vector<NetworkTrain> compiledTrains;
+    std::vector< std::vector<NetworkBend> > trackBends;
+    
+    char line[256];
+    int lineNumber = 0;
+    bool valid = true;
+    
+    while (valid && fgets(line, sizeof(line), source)) {
+        
+        lineNumber++;
+        
+        //  Everything after a # is a comment
+        char *comment = strchr(line, '#');
+        
+        if (comment) {
+            *comment = '\0';
+        }
+        
+        char keyword[32];
+        char word[64];
+        float value;
+        float speed;
+        int count;
+        NetworkBend bend;
+        
+        if (sscanf(line, "%31s", keyword) != 1) {
+            continue;
+        }
+        
+        //  sscanf() reads nan and inf as well as numbers, and nothing in the scene can be either
+        if (!strcmp(keyword, "line") && sscanf(line, "%*s %f", &value) == 1 && isfinite(value) && value >= TRACK_SEGMENT_LENGTH) {
+            header.trackLength = value;
+        }
+        else if (!strcmp(keyword, "cars-per-train") && sscanf(line, "%*s %d", &count) == 1 && count >= 1) {
+            header.carsPerTrain = count;
+        }
+        else if (!strcmp(keyword, "platform-length") && sscanf(line, "%*s %f", &value) == 1 && isfinite(value) && value >= tileSide) {
+            header.platformLength = value;
+        }
+        else if (!strcmp(keyword, "fixtures") && sscanf(line, "%*s %d", &count) == 1 && count >= 0 && count <= MAX_FIXTURES_PER_PLATFORM) {
+            header.fixturesPerPlatform = count;
+        }
+        else if (!strcmp(keyword, "track") && sscanf(line, "%*s %f %63s", &value, word) == 2 && isfinite(value) && (!strcmp(word, "uptown") || !strcmp(word, "downtown"))) {
+            NetworkTrack track = {value, (uint32_t)(strcmp(word, "uptown") ? 1 : 0), 0, 0};
+            compiledTracks.push_back(track);
+            trackBends.push_back(std::vector<NetworkBend>());
+        }
+        else if (!strcmp(keyword, "bend") && sscanf(line, "%*s %d %f %f", &count, &value, &bend.x) == 3 && count >= 0 && count < (int)compiledTracks.size() && isfinite(value) && isfinite(bend.x)) {
+            bend.z = value;
+            trackBends[count].push_back(bend);
+        }
+        else if (!strcmp(keyword, "station") && sscanf(line, "%*s %63s %f", word, &value) == 2 && isfinite(value) && compiledPlatforms.size() < MAX_PLATFORM_COUNT) {
+            NetworkPlatform platform = {value};
+            compiledPlatforms.push_back(platform);
+        }
+        else if (!strcmp(keyword, "train") && sscanf(line, "%*s %d %f", &count, &value) == 2 && count >= 0 && count < (int)compiledTracks.size() && isfinite(value) && readTrainSpeed(line, &speed)) {
+            NetworkTrain train = {(uint32_t)count, value, speed};
+            compiledTrains.push_back(train);
+        }
+        else {
+            std::cerr << sourcePath << ":" << lineNumber << ": can't make sense of \"" << keyword << "\" here" << std::endl;
+            valid = false;
+        }
+    }
+    
+    fclose(source);
+    
+    if (valid && (compiledTracks.empty() || compiledPlatforms.empty())) {
+        std::cerr << sourcePath << ": a network needs at least one track, and one station" << std::endl;
+        valid = false;
+    }
+    
+    /* Each track's bends, in order along it, strictly inside the line */
+    
+    std::vector<NetworkBend> compiledBends;
+    
+    for (size_t i = 0; valid && i < compiledTracks.size(); i++) {
+        
+        std::vector<NetworkBend> &bends = trackBends[i];
+        std::stable_sort(bends.begin(), bends.end(), compareBends);
+        
+        for (size_t j = 0; j < bends.size(); j++) {
+            
+            bool inside = bends[j].z > -header.trackLength && bends[j].z < header.trackLength;
+            bool apart = j == 0 || bends[j].z > bends[j - 1].z;
+            
+            if (!inside || !apart) {
+                std::cerr << sourcePath << ": track " << i << " bends twice at " << bends[j].z << ", or off the end of the line" << std::endl;
+                valid = false;
+                break;
+            }
+        }
+        
+        compiledTracks[i].firstBend = (uint32_t)compiledBends.size();
+        compiledTracks[i].bendCount = (uint32_t)bends.size();
+        compiledBends.insert(compiledBends.end(), bends.begin(), bends.end());
+    }
+    
+    /* No train can go further in a tick than the whole line */
+    
+    for (size_t i = 0; valid && i < compiledTrains.size(); i++) {
+        
+        if (compiledTrains[i].speed > 2 * header.trackLength) {
+            std::cerr << sourcePath << ": train " << i << " runs the whole line in less than a tick" << std::endl;
+            valid = false;
+        }
+    }
+    
+    if (!valid) {
+        return false;
+    }
+    
+    /* The header, then each array, one after the other */
+    
+    header.trackCount = (uint32_t)compiledTracks.size();
+    header.trackOffset = sizeof(NetworkHeader);
+    header.platformCount = (uint32_t)compiledPlatforms.size();
+    header.platformOffset = header.trackOffset + header.trackCount * sizeof(NetworkTrack);
+    header.trainCount = (uint32_t)compiledTrains.size();
+    header.trainOffset = header.platformOffset + header.platformCount * sizeof(NetworkPlatform);
+    header.bendCount = (uint32_t)compiledBends.size();
+    header.bendOffset = header.trainOffset + header.trainCount * sizeof(NetworkTrain);
+    
+    FILE *binary = fopen(binaryPath, "wb");
+    
+    if (!binary) {
+        std::cerr << "Couldn't create " << binaryPath << std::endl;
+        return false;
+    }
+    
+    bool written = fwrite(&header, sizeof(header), 1, binary) == 1;
+    written = written && fwrite(&compiledTracks[0], sizeof(NetworkTrack), compiledTracks.size(), binary) == compiledTracks.size();
+    written = written && fwrite(&compiledPlatforms[0], sizeof(NetworkPlatform), compiledPlatforms.size(), binary) == compiledPlatforms.size();
+    
+    if (!compiledTrains.empty()) {
+        written = written && fwrite(&compiledTrains[0], sizeof(NetworkTrain), compiledTrains.size(), binary) == compiledTrains.size();
+    }
+    
+    if (!compiledBends.empty()) {
+        written = written && fwrite(&compiledBends[0], sizeof(NetworkBend), compiledBends.size(), binary) == compiledBends.size();
+    }
+    
+    written = (fclose(binary) == 0) && written;
+    
+    if (!written) {
+        std::cerr << "Couldn't write " << binaryPath << std::endl;
+        return false;
+    }
+    
+    std::cout << "Compiled " << header.trackCount << " tracks, " << header.bendCount << " bends, " << header.platformCount << " stations and " << header.trainCount << " trains into " << binaryPath << std::endl;
+    
+    return true;
+}
+
+/*
+ 
+ Maps a compiled network into memory, and sizes the scene from it.
+ The records are checked to fit in the file, and to hold what
+ compileNetwork() would have let through, and are then read where
+ they are, by createRegistries() and placePlatforms().
+ 
+ */
+
+bool mapNetwork(const char *path)
+{
+    int file = open(path, O_RDONLY);
+    
+    if (file < 0) {
+        std::cerr << "Couldn't open " << path << std::endl;
+        return false;
+    }
+    
+    struct stat status;
+    
+    if (fstat(file, &status) != 0 || (size_t)status.st_size < sizeof(NetworkHeader)) {
+        std::cerr << path << " is too short to be a network" << std::endl;
+        close(file);
+        return false;
+    }
+    
+    void *mapping = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Couldn't map " << path << std::endl;
+        return false;
+    }
+    
+    network = (const NetworkHeader *)mapping;
+    networkSize = (size_t)status.st_size;
+    
+    bool valid = !memcmp(network->magic, NETWORK_FILE_MAGIC, sizeof(network->magic)) && network->version == NETWORK_FILE_VERSION;
+    
+    valid = valid && network->trackCount >= 1 && network->platformCount >= 1 && network->platformCount <= MAX_PLATFORM_COUNT;
+    valid = valid && network->trackOffset + (size_t)network->trackCount * sizeof(NetworkTrack) <= networkSize;
+    valid = valid && network->platformOffset + (size_t)network->platformCount * sizeof(NetworkPlatform) <= networkSize;
+    valid = valid && network->trainOffset + (size_t)network->trainCount * sizeof(NetworkTrain) <= networkSize;
+    valid = valid && network->bendOffset + (size_t)network->bendCount * sizeof(NetworkBend) <= networkSize;
+    
+    //  The records are read where they lie, as floats and 32 bit integers
+    valid = valid && network->trackOffset % 4 == 0 && network->platformOffset % 4 == 0;
+    valid = valid && network->trainOffset % 4 == 0 && network->bendOffset % 4 == 0;
+    
+    float trackLength = network->trackLength;
+    
+    valid = valid && isfinite(trackLength) && trackLength >= TRACK_SEGMENT_LENGTH;
+    valid = valid && isfinite(network->platformLength) && network->platformLength >= tileSide;
+    
+    for (uint32_t i = 0; valid && i < network->trackCount; i++) {
+        const NetworkTrack *track = &networkTracks()[i];
+        valid = isfinite(track->offsetX) && track->direction <= 1 && (size_t)track->firstBend + track->bendCount <= network->bendCount;
+        
+        //  Tracks are built through their bends in order, strictly inside the line, so they have to run along it
+        for (uint32_t j = 0; valid && j < track->bendCount; j++) {
+            const NetworkBend *bend = &networkBends()[track->firstBend + j];
+            valid = isfinite(bend->x) && bend->z > -trackLength && bend->z < trackLength;
+            valid = valid && (j == 0 || bend->z > networkBends()[track->firstBend + j - 1].z);
+        }
+    }
+    
+    for (uint32_t i = 0; valid && i < network->platformCount; i++) {
+        valid = isfinite(networkPlatforms()[i].offsetZ);
+    }
+    
+    for (uint32_t i = 0; valid && i < network->trainCount; i++) {
+        const NetworkTrain *train = &networkTrains()[i];
+        valid = train->trackID < network->trackCount && isfinite(train->positionZ);
+        valid = valid && isfinite(train->speed) && train->speed >= 0 && train->speed <= 2 * trackLength;
+    }
+    
+    if (!valid) {
+        std::cerr << path << " isn't a network this version can read" << std::endl;
+        unmapNetwork();
+        return false;
+    }
+    
+    configuration.trackCount = network->trackCount;
+    configuration.trainsPerTrack = network->trainCount / network->trackCount;
+    configuration.carsPerTrain = std::max(1, (int)network->carsPerTrain);
+    configuration.trackLength = trackLength;
+    configuration.platformCount = network->platformCount;
+    configuration.fixturesPerPlatform = std::min(MAX_FIXTURES_PER_PLATFORM, (int)network->fixturesPerPlatform);
+    
+    platformLength = network->platformLength;
+    tileColumns = platformLength/tileSide;
+    
+    return true;
+}
+
+void unmapNetwork()
+{
+    if (network) {
+        munmap((void *)network, networkSize);
+    }
+    
+    network = NULL;
+    networkSize = 0;
+}
+
+
+#pragma mark - Track Paths
+
+/*
+ 
+ Each track runs along a Catmull-Rom spline, through points laid
+ along the line in order of z. Every piece of the spline, between
+ two points, is resampled once, up front, at evenly spaced
+ distances along its length. Finding the spot a given distance
+ along a track is then a binary search for the piece, and a
+ lookup into its samples, with no trig. A straight track is one
+ piece, whatever its length.
+ 
+ */
+
+//  How finely each piece is measured, before it's resampled
+#define PATH_MEASURES_PER_SAMPLE 8
+
+/* Where a piece of a spline is, and which way it's going, at t from 0 to 1 */
+
+void evaluatePathPiece(const PathPoint *points, int pieceID, int pointCount, float t, PathPoint *position, PathPoint *tangent)
+{
+    const PathPoint *p1 = &points[pieceID];
+    const PathPoint *p2 = &points[pieceID + 1];
+    
+    //  The ends carry straight on, so a track with no bends stays straight
+    const PathPoint *p0 = pieceID > 0 ? &points[pieceID - 1] : p1;
+    const PathPoint *p3 = pieceID + 2 < pointCount ? &points[pieceID + 2] : p2;
+    
+    float scale0 = pieceID > 0 ? 0.5f : 1.0f;
+    float scale3 = pieceID + 2 < pointCount ? 0.5f : 1.0f;
+    
+    float m1x = (p2->x - p0->x) * scale0, m1z = (p2->z - p0->z) * scale0;
+    float m2x = (p3->x - p1->x) * scale3, m2z = (p3->z - p1->z) * scale3;
+    
+    float dx = p2->x - p1->x;
+    float dz = p2->z - p1->z;
+    
+    //  p1 + t m1 + t^2 c2 + t^3 c3, which stays exact along a straight piece
+    float c2x = 3 * dx - 2 * m1x - m2x, c2z = 3 * dz - 2 * m1z - m2z;
+    float c3x = m1x + m2x - 2 * dx, c3z = m1z + m2z - 2 * dz;
+    
+    position->x = p1->x + t * (m1x + t * (c2x + t * c3x));
+    position->z = p1->z + t * (m1z + t * (c2z + t * c3z));
+    
+    tangent->x = m1x + t * (2 * c2x + t * 3 * c3x);
+    tangent->z = m1z + t * (2 * c2z + t * 3 * c3z);
+}
+
+/*
+ 
+ Builds a track's path, through its points, which have to be in
+ order of z, and appends it to the track paths. Returns how long
+ the whole track is.
+ 
+ */
+
+float buildTrackPath(int trackID, const PathPoint *points, int pointCount)
+{
+    int firstPiece = trackPaths.pieceCount;
+    int pieceCount = pointCount - 1;
+    
+    tracks.firstPiece[trackID] = firstPiece;
+    tracks.pieceCount[trackID] = pieceCount;
+    
+    float trackLength = 0;
+    
+    const int measures = PATH_SAMPLES_PER_PIECE * PATH_MEASURES_PER_SAMPLE;
+    std::vector<float> measuredLength(measures + 1);
+    
+    for (int piece = 0; piece < pieceCount; piece++) {
+        
+        /* Measure the piece, in short straight steps */
+        
+        PathPoint previous, position, tangent;
+        evaluatePathPiece(points, piece, pointCount, 0, &previous, &tangent);
+        
+        measuredLength[0] = 0;
+        
+        for (int i = 1; i <= measures; i++) {
+            evaluatePathPiece(points, piece, pointCount, (float)i / measures, &position, &tangent);
+            
+            float stepX = position.x - previous.x;
+            float stepZ = position.z - previous.z;
+            
+            measuredLength[i] = measuredLength[i - 1] + sqrtf(stepX * stepX + stepZ * stepZ);
+            previous = position;
+        }
+        
+        /* Then sample it at even distances along that length */
+        
+        int pieceID = firstPiece + piece;
+        float length = measuredLength[measures];
+        
+        trackPaths.start[pieceID] = trackLength;
+        trackPaths.length[pieceID] = length;
+        
+        int measure = 0;
+        
+        for (int sample = 0; sample <= PATH_SAMPLES_PER_PIECE; sample++) {
+            
+            float distance = length * sample / PATH_SAMPLES_PER_PIECE;
+            
+            while (measure < measures - 1 && measuredLength[measure + 1] < distance) {
+                measure++;
+            }
+            
+            float span = measuredLength[measure + 1] - measuredLength[measure];
+            float blend = span > 0 ? (distance - measuredLength[measure]) / span : 0;
+            float t = (measure + std::max(0.0f, std::min(1.0f, blend))) / measures;
+            
+            evaluatePathPiece(points, piece, pointCount, t, &position, &tangent);
+            
+            float tangentLength = sqrtf(tangent.x * tangent.x + tangent.z * tangent.z);
+            
+            int index = pieceID * (PATH_SAMPLES_PER_PIECE + 1) + sample;
+            
+            trackPaths.x[index] = position.x;
+            trackPaths.z[index] = position.z;
+            trackPaths.tangentX[index] = tangentLength > 0 ? tangent.x / tangentLength : 0;
+            trackPaths.tangentZ[index] = tangentLength > 0 ? tangent.z / tangentLength : 1;
+        }
+        
+        trackLength += length;
+    }
+    
+    trackPaths.pieceCount += pieceCount;
+    tracks.length[trackID] = trackLength;
+    
+    return trackLength;
+}
+
+/* Allocates room for every track's path, with pieceCount pieces between them */
+
+void allocateTrackPaths(int pieceCount)
+{
+    int sampleCount = pieceCount * (PATH_SAMPLES_PER_PIECE + 1);
+    
+    trackPaths.pieceCount = 0;
+    trackPaths.start = new float[pieceCount];
+    trackPaths.length = new float[pieceCount];
+    trackPaths.x = new float[sampleCount];
+    trackPaths.z = new float[sampleCount];
+    trackPaths.tangentX = new float[sampleCount];
+    trackPaths.tangentZ = new float[sampleCount];
+}
+
+void destroyTrackPaths()
+{
+    delete [] trackPaths.start;
+    delete [] trackPaths.length;
+    delete [] trackPaths.x;
+    delete [] trackPaths.z;
+    delete [] trackPaths.tangentX;
+    delete [] trackPaths.tangentZ;
+    
+    trackPaths.pieceCount = 0;
+}
+
+/* Which of a track's pieces a distance along it falls in, clamped to the ends */
+
+int trackPieceAt(int trackID, double distance)
+{
+    int first = tracks.firstPiece[trackID];
+    int last = first + tracks.pieceCount[trackID] - 1;
+    
+    while (first < last) {
+        
+        int middle = (first + last + 1) / 2;
+        
+        if (trackPaths.start[middle] <= distance) {
+            first = middle;
+        }
+        else {
+            last = middle - 1;
+        }
+    }
+    
+    return first;
+}
+
+/*
+ 
+ Where a track is, a distance along it, and which way it runs
+ there. Past either end, it carries straight on.
+ 
+ */
+
+void trackPointAt(int trackID, double distance, PathPoint *position, PathPoint *tangent)
+{
+    int pieceID = trackPieceAt(trackID, distance);
+    
+    //  In doubles until it's a blend between two samples, so a long piece loses nothing
+    float length = trackPaths.length[pieceID];
+    double along = (distance - trackPaths.start[pieceID]) / length * PATH_SAMPLES_PER_PIECE;
+    
+    int sample = std::max(0, std::min(PATH_SAMPLES_PER_PIECE - 1, (int)floor(along)));
+    double blend = along - sample;
+    
+    int index = pieceID * (PATH_SAMPLES_PER_PIECE + 1) + sample;
+    
+    tangent->x = trackPaths.tangentX[index] + (trackPaths.tangentX[index + 1] - trackPaths.tangentX[index]) * std::max(0.0, std::min(1.0, blend));
+    tangent->z = trackPaths.tangentZ[index] + (trackPaths.tangentZ[index + 1] - trackPaths.tangentZ[index]) * std::max(0.0, std::min(1.0, blend));
+    
+    //  Off the ends, the blend runs outside the samples, along the tangent
+    if (blend < 0 || blend > 1) {
+        int end = blend < 0 ? index : index + 1;
+        double beyond = (blend < 0 ? blend : blend - 1) * length / PATH_SAMPLES_PER_PIECE;
+        
+        position->x = trackPaths.x[end] + trackPaths.tangentX[end] * beyond;
+        position->z = trackPaths.z[end] + trackPaths.tangentZ[end] * beyond;
+        return;
+    }
+    
+    position->x = trackPaths.x[index] + (trackPaths.x[index + 1] - trackPaths.x[index]) * blend;
+    position->z = trackPaths.z[index] + (trackPaths.z[index + 1] - trackPaths.z[index]) * blend;
+}
+
+/* How far along a track it gets to z, for the streaming window and placing trains */
+
+double trackDistanceAtZ(int trackID, float z)
+{
+    int first = tracks.firstPiece[trackID];
+    int last = first + tracks.pieceCount[trackID] - 1;
+    
+    int samplesPerPiece = PATH_SAMPLES_PER_PIECE + 1;
+    
+    /* Before the start, or past the end, the track carries straight on */
+    
+    int firstSample = first * samplesPerPiece;
+    int lastSample = last * samplesPerPiece + PATH_SAMPLES_PER_PIECE;
+    
+    if (z <= trackPaths.z[firstSample]) {
+        return (z - trackPaths.z[firstSample]) / std::max(0.01f, trackPaths.tangentZ[firstSample]);
+    }
+    
+    if (z >= trackPaths.z[lastSample]) {
+        return tracks.length[trackID] + (z - trackPaths.z[lastSample]) / std::max(0.01f, trackPaths.tangentZ[lastSample]);
+    }
+    
+    /* Otherwise, search the pieces, then the samples, which run in order of z */
+    
+    while (first < last) {
+        
+        int middle = (first + last + 1) / 2;
+        
+        if (trackPaths.z[middle * samplesPerPiece] <= z) {
+            first = middle;
+        }
+        else {
+            last = middle - 1;
+        }
+    }
+    
+    int low = first * samplesPerPiece;
+    int high = low + PATH_SAMPLES_PER_PIECE;
+    
+    while (high - low > 1) {
+        
+        int middle = (low + high) / 2;
+        
+        if (trackPaths.z[middle] <= z) {
+            low = middle;
+        }
+        else {
+            high = middle;
+        }
+    }
+    
+    float span = trackPaths.z[high] - trackPaths.z[low];
+    float blend = span > 0 ? (z - trackPaths.z[low]) / span : 0;
+    
+    return trackPaths.start[first] + (double)trackPaths.length[first] * ((low - first * samplesPerPiece) + blend) / PATH_SAMPLES_PER_PIECE;
+}
+
+#pragma mark - Tracks and Trains
+
+/*
+ 
+ Handles the command line options that size the scene:
+ 
+ --tracks N             How many tracks run through the stations
+ --trains-per-track N   How many trains run on each track
+ --cars-per-train N     How many cars make up each train
+ --track-length N       How far the track runs each way from the middle
+ --platforms N          How many platforms there are, up to 64
+ --fixtures N           How many ceiling lights hang over each platform, up to 64
+ --headless             Render offscreen, time some frames, and exit
+ --frames N             How many frames to time, when headless
+ --benchmark            Time every camera path over a range of scene sizes
+ --sweep NAME=A,B,...   Sweep just these values of one scene size
+ --paths A,B,...        Only fly these camera paths
+ --screenshot PATH      Save the last headless frame, as a PPM
+ --stats-csv PATH       Write each frame's statistics to a CSV file
+ --stats-json PATH      Write each frame's statistics to a JSON file
+ --record PATH          Record keyboard input, to replay later
+ --replay PATH          Replay recorded input, and the scene it was recorded in
+ --antialias MODE       Smooth edges with msaa2, msaa4, msaa8 or fxaa, or none
+ --occlusion on|off     Skip what's hidden behind the platforms and trains
+ --impostor-distance N  Draw trains further away than this as impostors, or 0 never to
+ --train-motion cpu|gpu Move the trains on the CPU, or in the vertex shader
+ --simulation-threads N Threads that move the trains each tick
+ --renderer NAME        Draw with "shader" (core profile) or "fixed" function
+ --network PATH         Lay the scene out from a compiled network
+ --compile-network TEXT PATH
+                        Compile a network description into PATH, and exit
+ 
+ */
+
+void parseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++) {
+        
+        bool hasValue = i + 1 < argc;
+        
+        if (!strcmp(argv[i], "--tracks") && hasValue) {
+            configuration.trackCount = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--trains-per-track") && hasValue) {
+            configuration.trainsPerTrack = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--cars-per-train") && hasValue) {
+            configuration.carsPerTrain = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--track-length") && hasValue) {
+            configuration.trackLength = std::max((float)TRACK_SEGMENT_LENGTH, (float)atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--platforms") && hasValue) {
+            configuration.platformCount = std::max(1, std::min(MAX_PLATFORM_COUNT, atoi(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--fixtures") && hasValue) {
+            configuration.fixturesPerPlatform = std::max(0, std::min(MAX_FIXTURES_PER_PLATFORM, atoi(argv[++i])));
+        }
+        else if (!strcmp(argv[i], "--headless")) {
+            configuration.headless = true;
+        }
+        else if (!strcmp(argv[i], "--benchmark")) {
+            configuration.headless = true;
+            configuration.benchmark = true;
+        }
+        else if (!strcmp(argv[i], "--sweep") && hasValue) {
+            if (!addBenchmarkSweep(argv[++i])) {
+                std::cerr << "Ignoring unknown sweep " << argv[i] << std::endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--paths") && hasValue) {
+            if (!selectBenchmarkPaths(argv[++i])) {
+                std::cerr << "Ignoring unknown camera paths in " << argv[i] << std::endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--frames") && hasValue) {
+            configuration.headlessFrames = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--screenshot") && hasValue) {
+            configuration.screenshotPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--stats-csv") && hasValue) {
+            configuration.statsCSVPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--stats-json") && hasValue) {
+            configuration.statsJSONPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--record") && hasValue) {
+            configuration.recordPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--replay") && hasValue) {
+            configuration.replayPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--antialias") && hasValue) {
+            const char *antialias = argv[++i];
+            
+            if (!strcmp(antialias, "none") || !strcmp(antialias, "msaa2") || !strcmp(antialias, "msaa4") || !strcmp(antialias, "msaa8")) {
+                configuration.antialiasSamples = strcmp(antialias, "none") ? atoi(antialias + 4) : 0;
+                configuration.fxaa = false;
+            }
+            else if (!strcmp(antialias, "fxaa")) {
+                configuration.antialiasSamples = 0;
+                configuration.fxaa = true;
+            }
+            else {
+                std::cerr << "Ignoring unknown anti-aliasing " << antialias << std::endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--occlusion") && hasValue) {
+            const char *occlusion = argv[++i];
+            
+            if (!strcmp(occlusion, "on") || !strcmp(occlusion, "off")) {
+                configuration.occlusionCulling = !strcmp(occlusion, "on");
+            }
+            else {
+                std::cerr << "Ignoring unknown occlusion setting " << occlusion << std::endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--impostor-distance") && hasValue) {
+            configuration.impostorDistance = std::max(0.0f, (float)atof(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--train-motion") && hasValue) {
+            const char *motion = argv[++i];
+            
+            if (!strcmp(motion, "cpu") || !strcmp(motion, "gpu")) {
+                configuration.gpuTrainMotion = !strcmp(motion, "gpu");
+            }
+            else {
+                std::cerr << "Ignoring unknown train motion " << motion << std::endl;
+            }
+        }
+        else if (!strcmp(argv[i], "--simulation-threads") && hasValue) {
+            configuration.simulationThreads = std::max(0, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--network") && hasValue) {
+            configuration.networkPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--compile-network") && i + 2 < argc) {
+            configuration.networkSourcePath = argv[++i];
+            configuration.networkPath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--renderer") && hasValue) {
+            const char *renderer = argv[++i];
+            
+            if (!strcmp(renderer, "shader")) {
+                configuration.shaderRenderer = true;
+            }
+            else if (!strcmp(renderer, "fixed")) {
+                configuration.shaderRenderer = false;
+            }
+            else {
+                std::cerr << "Ignoring unknown renderer " << renderer << std::endl;
+            }
+        }
+        else {
+            std::cerr << "Ignoring unknown argument " << argv[i] << std::endl;
+        }
+    }
+}
+
+void createRegistries(Configuration *configuration)
+{
+    /* Tracks alternate sides of the platforms, working outwards, unless there's a network */
+    
+    tracks.count = network ? network->trackCount : configuration->trackCount;
+    tracks.offsetX = new float[tracks.count];
+    tracks.direction = new int[tracks.count];
+    tracks.showTrains = new bool[tracks.count];
+    tracks.firstPiece = new int[tracks.count];
+    tracks.pieceCount = new int[tracks.count];
+    tracks.length = new float[tracks.count];
+    
+    for (int i = 0; i < tracks.count; i++) {
+        float side = (i % 2 == 0) ? 1.0f : -1.0f;
+        
+        if (network) {
+            tracks.offsetX[i] = networkTracks()[i].offsetX;
+            tracks.direction[i] = networkTracks()[i].direction;
+        }
+        else {
+            tracks.offsetX[i] = side * (TRACK_OFFSET + (i / 2) * TRACK_SPACING);
+            tracks.direction[i] = i % 2;
+        }
+        
+        tracks.showTrains[i] = true;
+    }
+    
+    /* Each track's path runs from one end of the line to the other, through its bends */
+    
+    int pieceCount = tracks.count + (network ? network->bendCount : 0);
+    allocateTrackPaths(pieceCount);
+    
+    std::vector<PathPoint> points;
+    
+    for (int i = 0; i < tracks.count; i++) {
+        
+        PathPoint start = {tracks.offsetX[i], -configuration->trackLength};
+        PathPoint end = {tracks.offsetX[i], configuration->trackLength};
+        
+        points.clear();
+        points.push_back(start);
+        
+        if (network) {
+            const NetworkTrack *track = &networkTracks()[i];
+            
+            for (uint32_t j = 0; j < track->bendCount; j++) {
+                const NetworkBend *bend = &networkBends()[track->firstBend + j];
+                PathPoint point = {bend->x, bend->z};
+                points.push_back(point);
+            }
+        }
+        
+        points.push_back(end);
+        
+        buildTrackPath(i, &points[0], (int)points.size());
+    }
+    
+    /* Trains, spaced out along each track */
+    
+    trains.count = network ? network->trainCount : tracks.count * configuration->trainsPerTrack;
+    trains.trackID = new int[trains.count];
+    trains.positionX = new float[trains.count];
+    trains.positionY = new float[trains.count];
+    trains.positionZ = new float[trains.count];
+    trains.distance = new double[trains.count];
+    trains.direction = new int[trains.count];
+    trains.speed = new float[trains.count];
+    trains.velocity = new double[trains.count];
+    trains.trackLength = new double[trains.count];
+    trains.baseTick = new long[trains.count];
+    trains.visible = new bool[trains.count];
+    
+    for (int i = 0; i < trains.count; i++) {
+        trains.trackID[i] = network ? networkTrains()[i].trackID : i % tracks.count;
+        trains.direction[i] = tracks.direction[trains.trackID[i]];
+        trains.speed[i] = network ? networkTrains()[i].speed : TRAIN_SPEED;
+        trains.velocity[i] = trains.direction[i] == 0 ? trains.speed[i] : -trains.speed[i];
+        trains.trackLength[i] = tracks.length[trains.trackID[i]];
+        trains.baseTick[i] = 0;
+        trains.visible[i] = true;
+    }
+    
+    placeTrains(TRAIN_START_Z);
+}
+
+void destroyRegistries()
+{
+    delete [] tracks.offsetX;
+    delete [] tracks.direction;
+    delete [] tracks.showTrains;
+    delete [] tracks.firstPiece;
+    delete [] tracks.pieceCount;
+    delete [] tracks.length;
+    
+    destroyTrackPaths();
+    
+    delete [] trains.trackID;
+    delete [] trains.positionX;
+    delete [] trains.positionY;
+    delete [] trains.positionZ;
+    delete [] trains.distance;
+    delete [] trains.direction;
+    delete [] trains.speed;
+    delete [] trains.velocity;
+    delete [] trains.trackLength;
+    delete [] trains.baseTick;
+    delete [] trains.visible;
+    
+    delete [] stationLights.position;
+    delete [] stationLights.direction;
+    delete [] stationLights.color;
+    delete [] stationLights.radius;
+    delete [] stationLights.cosCutoff;
+    
+    tracks.count = 0;
+    trains.count = 0;
+    stationLights.count = 0;
+    
+    destroySceneGraph();
+}
+
+/*
+ 
+ Lays out the platforms. The first four keep the spots they've
+ always had, and any more alternate ahead and behind, moving out.
+ A network puts them at its stations instead.
+ 
+ */
+
+void placePlatforms(Configuration *configuration)
+{
+    platformCount = network ? network->platformCount : configuration->platformCount;
+    
+    for (int i = 0; i < platformCount; i++) {
+        
+        if (network) {
+            platformOffsetZ[i] = networkPlatforms()[i].offsetZ;
+            continue;
+        }
+        
+        if (i < DEFAULT_PLATFORM_COUNT) {
+            platformOffsetZ[i] = defaultPlatformOffsetZ[i];
+            continue;
+        }
+        
+        int extra = i - DEFAULT_PLATFORM_COUNT;
+        float side = (extra % 2 == 0) ? 1.0f : -1.0f;
+        
+        platformOffsetZ[i] = side * (PLATFORM_LENGTH*3 + PLATFORM_SPACING * (extra / 2 + 1));
+    }
+}
+
+/*
+ 
+ Hangs the ceiling fixtures, evenly spaced down the middle of
+ each platform, pointing down. Call it after placePlatforms().
+ 
+ */
+
+void placeStationLights(Configuration *configuration)
+{
+    stationLights.count = platformCount * configuration->fixturesPerPlatform;
+    stationLights.position = new float[stationLights.count * 3];
+    stationLights.direction = new float[stationLights.count * 3];
+    stationLights.color = new float[stationLights.count * 3];
+    stationLights.radius = new float[stationLights.count];
+    stationLights.cosCutoff = new float[stationLights.count];
+    
+    float spacing = platformLength / std::max(1, configuration->fixturesPerPlatform);
+    
+    for (int i = 0; i < stationLights.count; i++) {
+        
+        int platformID = i / configuration->fixturesPerPlatform;
+        int fixture = i % configuration->fixturesPerPlatform;
+        
+        stationLights.position[i * 3] = 0.0f;
+        stationLights.position[i * 3 + 1] = PLATFORM_Y + FIXTURE_HEIGHT;
+        stationLights.position[i * 3 + 2] = platformOffsetZ[platformID] - platformLength/2 + spacing * (fixture + 0.5f);
+        
+        stationLights.direction[i * 3] = 0.0f;
+        stationLights.direction[i * 3 + 1] = -1.0f;
+        stationLights.direction[i * 3 + 2] = 0.0f;
+        
+        for (int c = 0; c < 3; c++) {
+            stationLights.color[i * 3 + c] = fixtureColor[c];
+        }
+        
+        stationLights.radius[i] = FIXTURE_RADIUS;
+        stationLights.cosCutoff[i] = cosf(FIXTURE_CONE * DEG2RAD);
+    }
+}
+
+/*
+ 
+ Puts each track's first train at firstTrainZ, and the rest behind
+ it. A network's trains keep their spacing, moved along with the
+ first one. Trains are then kept by how far along their track's
+ path they are.
+ 
+ */
+
+void placeTrains(float firstTrainZ)
+{
+    for (int i = 0; i < trains.count; i++) {
+        
+        //  Which train is this on its track?
+        int order = i / tracks.count;
+        
+        float z = firstTrainZ - order * TRAIN_SPACING;
+        
+        if (network) {
+            z = networkTrains()[i].positionZ + (firstTrainZ - TRAIN_START_Z);
+        }
+        
+        trains.positionY[i] = 0.0f;
+        trains.distance[i] = trackDistanceAtZ(trains.trackID[i], z);
+        
+        placeTrainOnTrack(i);
+    }
+}
+
+/* Works out where a train is from how far along its track it is */
+
+void placeTrainOnTrack(int trainID)
+{
+    int trackID = trains.trackID[trainID];
+    
+    PathPoint position, direction;
+    trackPointAt(trackID, trains.distance[trainID], &position, &direction);
+    
+    trains.positionX[trainID] = position.x - tracks.offsetX[trackID];
+    trains.positionZ[trainID] = position.z;
+}
+
+
+#pragma mark - Workers
+
+/*
+ 
+ A small pool of threads, for work that's the same for every
+ item of an array, such as moving the trains. A job is split
+ into chunks, which the workers, and the thread that ran the job,
+ take one at a time until there are none left. runWorkers()
+ returns once every chunk is done, so a job reads like a plain
+ loop to whoever runs it.
+ 
+ */
+
+//  Jobs smaller than this aren't worth waking the workers for
+#define WORKER_CHUNK_SIZE 2048
+
+typedef void (*WorkerJob)(int first, int last);
+
+typedef struct
+{
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake;       //  A job's been posted, or the pool is stopping
+    std::condition_variable finished;   //  The last chunk of a job is done
+    
+    WorkerJob job;
+    int itemCount;
+    int chunkCount;
+    std::atomic<int> nextChunk;
+    
+    int chunksDone;             //  These are all guarded by the mutex
+    int busyWorkers;
+    long generation;            //  Counts jobs, so workers know when there's a new one
+    bool open;                  //  Can workers still join the job?
+    bool stopping;
+} WorkerPool;
+
+WorkerPool workers;
+
+/* Takes chunks of the current job until there are none left, and returns how many it did */
+
+int workOnJob()
+{
+    int done = 0;
+    
+    for (;;) {
+        
+        int chunk = workers.nextChunk++;
+        
+        if (chunk >= workers.chunkCount) {
+            break;
+        }
+        
+        int first = chunk * WORKER_CHUNK_SIZE;
+        workers.job(first, std::min(workers.itemCount, first + WORKER_CHUNK_SIZE));
+        
+        done++;
+    }
+    
+    return done;
+}
+
+void workerLoop()
+{
+    long seenGeneration = 0;
+    
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    
+    for (;;) {
+        
+        while (!workers.stopping && workers.generation == seenGeneration) {
+            workers.wake.wait(lock);
+        }
+        
+        if (workers.stopping) {
+            return;
+        }
+        
+        seenGeneration = workers.generation;
+        
+        //  Woke up too late for it
+        if (!workers.open) {
+            continue;
+        }
+        
+        workers.busyWorkers++;
+        lock.unlock();
+        
+        int done = workOnJob();
+        
+        lock.lock();
+        workers.busyWorkers--;
+        workers.chunksDone += done;
+        
+        if (workers.chunksDone == workers.chunkCount && workers.busyWorkers == 0) {
+            workers.finished.notify_all();
+        }
+    }
+}
+
+/* Starts threadCount - 1 workers, since whoever runs a job works on it too */
+
+void startWorkers(int threadCount)
+{
+    if (threadCount <= 0) {
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+    
+    workers.generation = 0;
+    workers.open = false;
+    workers.stopping = false;
+    
+    for (int i = 1; i < threadCount; i++) {
+        workers.threads.push_back(std::thread(workerLoop));
+    }
+}
+
+void stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(workers.mutex);
+        workers.stopping = true;
+    }
+    
+    workers.wake.notify_all();
+    
+    for (size_t i = 0; i < workers.threads.size(); i++) {
+        workers.threads[i].join();
+    }
+    
+    workers.threads.clear();
+}
+
+/* Runs job over items 0 up to itemCount, in chunks, and waits for it to finish */
+
+void runWorkers(WorkerJob job, int itemCount)
+{
+    if (workers.threads.empty() || itemCount <= WORKER_CHUNK_SIZE) {
+        job(0, itemCount);
+        return;
+    }
+    
+    std::unique_lock<std::mutex> lock(workers.mutex);
+    
+    workers.job = job;
+    workers.itemCount = itemCount;
+    workers.chunkCount = (itemCount + WORKER_CHUNK_SIZE - 1) / WORKER_CHUNK_SIZE;
+    workers.nextChunk = 0;
+    workers.chunksDone = 0;
+    workers.busyWorkers = 0;
+    workers.open = true;
+    workers.generation++;
+    
+    lock.unlock();
+    workers.wake.notify_all();
+    
+    int done = workOnJob();
+    
+    lock.lock();
+    workers.chunksDone += done;
+    
+    while (workers.chunksDone < workers.chunkCount || workers.busyWorkers > 0) {
+        workers.finished.wait(lock);
+    }
+    
+    workers.open = false;
+}
+
+
+#pragma mark - GPU Trains
+
+/*
+ 
+ With a big enough fleet, working out where every car is, every
+ frame, then culling and drawing each train, costs the CPU more
+ than the trains cost the GPU. Instead, the vertex shader can move
+ the trains itself. Every track's path is sent once, in texture
+ buffers, and so is how each train moves: how far along its track
+ it was on some tick, how far it goes each tick, and how long its
+ track is, which is where it wraps around. From those, the shader
+ works out where a train gets to on any later tick, the same way
+ ticks of advanceTrains() would have got it there, and every car
+ of every train is drawn with one instanced draw.
+ 
+ The simulation then only counts ticks. A train is only sent again
+ when a key moves it, or the trains are put back where they began.
+ 
+ */
+
+//  Floats per train, in two texels: distance, velocity, track length,
+//  height, then first piece, piece count, whether it's shown, and nothing
+#define TRAIN_MOTION_FLOATS 8
+
+//  Whole ticks per train, which a float couldn't count for long: its
+//  base tick, the tick it first wraps around, how many ticks a lap
+//  takes after that, and nothing
+#define TRAIN_CLOCK_INTS 4
+
+/* A train whose motion has to be sent again, and what to send */
+
+typedef struct
+{
+    int trainID;
+    GLfloat motion[TRAIN_MOTION_FLOATS];
+    GLint clock[TRAIN_CLOCK_INTS];
+} TrainMotion;
+
+typedef struct
+{
+    GLuint sampleBuffer, sampleTexture;     //  x, z, and the tangent's x and z, at every sample of every path
+    GLuint pieceBuffer, pieceTexture;       //  Where each piece starts along its track, and how long it is
+    GLuint motionBuffer, motionTexture;
+    GLuint clockBuffer, clockTexture;
+    StaticBatch carMesh;
+    
+    bool pathsSent;
+    std::vector<GLfloat> motion;            //  What the GPU has, for every train
+    std::vector<GLint> clocks;
+    std::vector<TrainMotion> changes;       //  Handed over by the simulation, and not sent yet
+} GpuTrainStage;
+
+GpuTrainStage gpuTrains;
+
+//  Ticks that have moved the trains since the simulation started, which is the shader's clock
+long motionTickCount = 0;
+
+//  Where the shader's clock is this frame: a whole tick, and how far on to the next
+long drawnMotionTick = 0;
+float drawnMotionFraction = 0;
+
+//  Trains the simulation changed this tick, and whether that was all of them
+std::vector<int> retimedTrains;
+bool allTrainsRetimed = false;
+
+//  Changes waiting for the renderer, guarded by simulationMutex
+std::vector<TrainMotion> publishedTrainMotion;
+
+/* The tick a train first wraps around on, counting from its base tick, and how many ticks each lap after that takes */
+
+void trainLapTicks(int trainID, int *wrapTick, int *lap)
+{
+    double velocity = trains.velocity[trainID];
+    double length = trains.trackLength[trainID];
+    double speed = fabs(velocity);
+    
+    //  A train that doesn't move never gets to the end
+    if (speed == 0) {
+        *wrapTick = INT32_MAX;
+        *lap = 1;
+        return;
+    }
+    
+    double ahead = velocity > 0 ? length - trains.distance[trainID] : trains.distance[trainID];
+    
+    //  Worked out in doubles, and kept to what an int can count, however slow the train is
+    *wrapTick = (int)std::max(1.0, std::min((double)INT32_MAX, floor(ahead / speed) + 1));
+    *lap = (int)std::min((double)INT32_MAX, floor(length / speed) + 1);
+}
+
+/*
+ 
+ How far along its track a train is on a tick, counting from its
+ base tick. Up to the tick it passes an end of the track, it's a
+ straight line. After that, it goes round from the other end, a
+ lap at a time. Matches trainDistanceAt() in the shader.
+ 
+ */
+
+double trainDistanceAtTick(int trainID, long tick)
+{
+    double distance = trains.distance[trainID];
+    double velocity = trains.velocity[trainID];
+    
+    int ticks = (int)(tick - trains.baseTick[trainID]);
+    int wrapTick, lap;
+    
+    trainLapTicks(trainID, &wrapTick, &lap);
+    
+    if (ticks < wrapTick) {
+        return distance + velocity * ticks;
+    }
+    
+    //  Laps are counted in whole ticks, so a long run never loses a tick
+    double along = ((ticks - wrapTick) % lap) * fabs(velocity);
+    
+    return velocity > 0 ? along : trains.trackLength[trainID] - along;
+}
+
+/* Brings a train's distance up to the current tick, before a key moves it */
+
+void catchUpTrain(int trainID)
+{
+    if (!configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    trains.distance[trainID] = trainDistanceAtTick(trainID, motionTickCount);
+    trains.baseTick[trainID] = motionTickCount;
+}
+
+/* Takes a train's distance as where it is on the current tick, to be sent to the GPU */
+
+void retimeTrain(int trainID)
+{
+    if (!configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    //  A tick would have wrapped it back onto the track anyway
+    trains.distance[trainID] = std::max(0.0, std::min(trains.trackLength[trainID], trains.distance[trainID]));
+    trains.baseTick[trainID] = motionTickCount;
+    
+    retimedTrains.push_back(trainID);
+}
+
+/* Writes down where every train's got to, for when the simulation stops, and the tick count starts over */
+
+void catchUpAllTrains()
+{
+    if (!configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    for (int i = 0; i < trains.count; i++) {
+        catchUpTrain(i);
+        placeTrainOnTrack(i);
+    }
+}
+
+void retimeAllTrains()
+{
+    if (!configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    for (int i = 0; i < trains.count; i++) {
+        trains.distance[i] = std::max(0.0, std::min(trains.trackLength[i], trains.distance[i]));
+        trains.baseTick[i] = motionTickCount;
+    }
+    
+    retimedTrains.clear();
+    allTrainsRetimed = true;
+}
+
+/* Hands this tick's changes to the renderer. Call it with simulationMutex held. */
+
+void publishTrainMotion()
+{
+    int count = allTrainsRetimed ? trains.count : (int)retimedTrains.size();
+    
+    for (int i = 0; i < count; i++) {
+        
+        TrainMotion change;
+        change.trainID = allTrainsRetimed ? i : retimedTrains[i];
+        
+        int trackID = trains.trackID[change.trainID];
+        
+        change.motion[0] = (GLfloat)trains.distance[change.trainID];
+        change.motion[1] = (GLfloat)trains.velocity[change.trainID];
+        change.motion[2] = (GLfloat)trains.trackLength[change.trainID];
+        change.motion[3] = trains.positionY[change.trainID];
+        change.motion[4] = (float)tracks.firstPiece[trackID];
+        change.motion[5] = (float)tracks.pieceCount[trackID];
+        change.motion[6] = tracks.showTrains[trackID] ? 1.0f : 0.0f;
+        change.motion[7] = 0;
+        change.clock[0] = (GLint)trains.baseTick[change.trainID];
+        trainLapTicks(change.trainID, &change.clock[1], &change.clock[2]);
+        change.clock[3] = 0;
+        
+        publishedTrainMotion.push_back(change);
+    }
+    
+    retimedTrains.clear();
+    allTrainsRetimed = false;
+}
+
+/* Takes whatever the simulation's published. Call it with simulationMutex held. */
+
+void takeTrainMotion()
+{
+    gpuTrains.changes.insert(gpuTrains.changes.end(), publishedTrainMotion.begin(), publishedTrainMotion.end());
+    publishedTrainMotion.clear();
+}
+
+void buildGpuTrains()
+{
+    if (!configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    buildTextureBuffer(&gpuTrains.sampleBuffer, &gpuTrains.sampleTexture, GL_RGBA32F, TRACK_SAMPLE_UNIT);
+    buildTextureBuffer(&gpuTrains.pieceBuffer, &gpuTrains.pieceTexture, GL_RG32F, TRACK_PIECE_UNIT);
+    buildTextureBuffer(&gpuTrains.motionBuffer, &gpuTrains.motionTexture, GL_RGBA32F, TRAIN_MOTION_UNIT);
+    buildTextureBuffer(&gpuTrains.clockBuffer, &gpuTrains.clockTexture, GL_RGBA32I, TRAIN_CLOCK_UNIT);
+    
+    glActiveTexture(GL_TEXTURE0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    
+    MeshBuilder builder;
+    appendWholeCar(&builder);
+    
+    gpuTrains.carMesh = uploadStaticBatch(&builder);
+    gpuTrains.pathsSent = false;
+}
+
+void destroyGpuTrains()
+{
+    if (!gpuTrains.carMesh.vertexBuffer) {
+        return;
+    }
+    
+    destroyStaticBatch(&gpuTrains.carMesh);
+    
+    GLuint buffers[4] = {gpuTrains.sampleBuffer, gpuTrains.pieceBuffer, gpuTrains.motionBuffer, gpuTrains.clockBuffer};
+    GLuint textures[4] = {gpuTrains.sampleTexture, gpuTrains.pieceTexture, gpuTrains.motionTexture, gpuTrains.clockTexture};
+    
+    glDeleteBuffers(4, buffers);
+    glDeleteTextures(4, textures);
+    
+    gpuTrains.sampleBuffer = gpuTrains.pieceBuffer = gpuTrains.motionBuffer = gpuTrains.clockBuffer = 0;
+    gpuTrains.sampleTexture = gpuTrains.pieceTexture = gpuTrains.motionTexture = gpuTrains.clockTexture = 0;
+    gpuTrains.pathsSent = false;
+}
+
+/* Sends every track's path, whenever the simulation starts over, since the scene may have been rebuilt */
+
+void sendTrackPaths()
+{
+    int sampleCount = trackPaths.pieceCount * (PATH_SAMPLES_PER_PIECE + 1);
+    
+    std::vector<GLfloat> samples(sampleCount * 4);
+    std::vector<GLfloat> pieces(trackPaths.pieceCount * 2);
+    
+    for (int i = 0; i < sampleCount; i++) {
+        samples[i * 4] = trackPaths.x[i];
+        samples[i * 4 + 1] = trackPaths.z[i];
+        samples[i * 4 + 2] = trackPaths.tangentX[i];
+        samples[i * 4 + 3] = trackPaths.tangentZ[i];
+    }
+    
+    for (int i = 0; i < trackPaths.pieceCount; i++) {
+        pieces[i * 2] = trackPaths.start[i];
+        pieces[i * 2 + 1] = trackPaths.length[i];
+    }
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.sampleBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, samples.size() * sizeof(GLfloat), &samples[0], GL_STATIC_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.pieceBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, pieces.size() * sizeof(GLfloat), &pieces[0], GL_STATIC_DRAW);
+    
+    //  Room for every train, which drawGpuTrains() fills in as they change
+    gpuTrains.motion.assign(trains.count * TRAIN_MOTION_FLOATS, 0.0f);
+    gpuTrains.clocks.assign(trains.count * TRAIN_CLOCK_INTS, 0);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.motionBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, gpuTrains.motion.size() * sizeof(GLfloat), gpuTrains.motion.empty() ? NULL : &gpuTrains.motion[0], GL_DYNAMIC_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.clockBuffer);
+    glBufferData(GL_TEXTURE_BUFFER, gpuTrains.clocks.size() * sizeof(GLint), gpuTrains.clocks.empty() ? NULL : &gpuTrains.clocks[0], GL_DYNAMIC_DRAW);
+    
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    
+    gpuTrains.pathsSent = true;
+}
+
+/*
+ 
+ Draws every car of every train, where the shader works out they
+ are at drawnMotionTick, plus drawnMotionFraction. Only the trains
+ that changed since the last frame are written into the motion and
+ clock buffers, a run of neighboring trains at a time.
+ 
+ */
+
+void drawGpuTrains()
+{
+    SectionTimer timer(STATS_TRAIN);
+    
+    if (!gpuTrains.pathsSent) {
+        sendTrackPaths();
+    }
+    
+    if (!gpuTrains.changes.empty()) {
+        
+        std::vector<int> changedTrains(gpuTrains.changes.size());
+        
+        for (size_t i = 0; i < gpuTrains.changes.size(); i++) {
+            const TrainMotion *change = &gpuTrains.changes[i];
+            memcpy(&gpuTrains.motion[change->trainID * TRAIN_MOTION_FLOATS], change->motion, sizeof(change->motion));
+            memcpy(&gpuTrains.clocks[change->trainID * TRAIN_CLOCK_INTS], change->clock, sizeof(change->clock));
+            changedTrains[i] = change->trainID;
+        }
+        
+        std::sort(changedTrains.begin(), changedTrains.end());
+        changedTrains.erase(std::unique(changedTrains.begin(), changedTrains.end()), changedTrains.end());
+        
+        for (size_t first = 0, last = 0; first < changedTrains.size(); first = last) {
+            
+            int firstTrain = changedTrains[first];
+            
+            //  The run goes on as long as the next train is the next one along
+            while (last < changedTrains.size() && changedTrains[last] == firstTrain + (int)(last - first)) {
+                last++;
+            }
+            
+            int runLength = (int)(last - first);
+            
+            glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.motionBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, firstTrain * TRAIN_MOTION_FLOATS * sizeof(GLfloat), runLength * TRAIN_MOTION_FLOATS * sizeof(GLfloat), &gpuTrains.motion[firstTrain * TRAIN_MOTION_FLOATS]);
+            
+            glBindBuffer(GL_TEXTURE_BUFFER, gpuTrains.clockBuffer);
+            glBufferSubData(GL_TEXTURE_BUFFER, firstTrain * TRAIN_CLOCK_INTS * sizeof(GLint), runLength * TRAIN_CLOCK_INTS * sizeof(GLint), &gpuTrains.clocks[firstTrain * TRAIN_CLOCK_INTS]);
+        }
+        
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+        
+        gpuTrains.changes.clear();
+    }
+    
+    if (trains.count == 0) {
+        return;
+    }
+    
+    //  The scene's view, which each car's own transform goes under
+    pushMatrix();
+    {
+        loadSceneNode(0);
+        prepareShaderDraw(false, SHADER_TRAIN_MOTION);
+    }
+    popMatrix();
+    
+    //  prepareShaderDraw() keeps the last program if this one wouldn't build, and that can't place the cars
+    bool stationLit = stationLightsBinned > 0;
+    
+    if (shaderProgram != shaderPrograms[shaderLightCount][stationLit][SHADER_TRAIN_MOTION]) {
+        return;
+    }
+    
+    const TrainMotionUniforms *uniforms = &trainMotionUniforms[shaderLightCount][stationLit];
+    
+    glUniform1i(uniforms->motionTick, (GLint)drawnMotionTick);
+    glUniform1f(uniforms->motionFraction, drawnMotionFraction);
+    glUniform1i(uniforms->carsPerTrain, sceneGraph.carsPerTrain);
+    
+    int count = trains.count * sceneGraph.carsPerTrain;
+    
+    bindBatchVertices(&gpuTrains.carMesh, true);
+    glDrawElementsInstancedARB(GL_TRIANGLES, gpuTrains.carMesh.indexCount, GL_UNSIGNED_INT, 0, count);
+    unbindBatchVertices(true);
+    
+    frameStats.drawCalls++;
+    frameStats.vertices += (long)gpuTrains.carMesh.indexCount * count;
+}
+
+
+#pragma mark - Animation
+
+/*
+ 
+ Trains are simulated on their own thread, at a fixed rate, no
+ matter how quickly frames are drawn, or whether drawing stalls.
+ After each tick the thread publishes a snapshot of where every
+ train is. Rendering interpolates between the two latest snapshots,
+ so motion stays smooth at any frame rate.
+ 
+ Keys that affect the trains are queued, and applied by the
+ simulation thread at the start of its next tick. Ticks are
+ counted, so recorded input can be replayed on the same ticks.
+ 
+ */
+
+#define SIMULATION_STEP (1.0 / SIMULATION_HZ)
+
+//  Don't try to catch up on more than this many ticks at once
+#define MAX_TICKS_PER_WAKE 10
+
+typedef struct
+{
+    unsigned char key;
+    int trainID;                //  NO_TRAIN for keys that only change the view
+} TrainCommand;
+
+#define NO_TRAIN -1
+
+void recordInputForTick(long tick, std::vector<TrainCommand> *commands);
+void replayInputForTick(long tick, std::vector<TrainCommand> *commands);
+
+std::thread simulationThread;
+std::atomic<bool> simulationRunning(false);
+
+//  Guards the command queue and which snapshot is which
+std::mutex simulationMutex;
+
+std::vector<TrainCommand> pendingCommands;
+std::vector<TrainCommand> commandsThisTick;
+
+//  How many ticks have run since the simulation started
+long simulationTickCount = 0;
+
+//  How long the last tick took to move the trains, in ms
+std::atomic<double> lastTickTime(0.0);
+
+//  Published snapshots rotate through these three
+TrainSnapshot snapshots[3];
+int previousSnapshot = 0;
+int currentSnapshot = 1;
+int freeSnapshot = 2;
+
+//  Headless runs step the simulation themselves, on a virtual clock
+bool simulationThreaded = true;
+double virtualTime = 0;
+
+double secondsNow()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double simulationTime()
+{
+    return simulationThreaded ? secondsNow() : virtualTime;
+}
+
+void allocateSnapshot(TrainSnapshot *snapshot, int count)
+{
+    snapshot->time = 0;
+    snapshot->positionX = new float[count];
+    snapshot->positionY = new float[count];
+    snapshot->positionZ = new float[count];
+    snapshot->distance = new double[count];
+}
+
+void releaseSnapshot(TrainSnapshot *snapshot)
+{
+    delete [] snapshot->positionX;
+    delete [] snapshot->positionY;
+    delete [] snapshot->positionZ;
+    delete [] snapshot->distance;
+}
+
+void copyTrainsInto(TrainSnapshot *snapshot, double time)
+{
+    size_t size = trains.count * sizeof(float);
+    
+    snapshot->time = time;
+    snapshot->motionTick = motionTickCount;
+    
+    //  The shader works out where the trains are from the tick
+    if (configuration.gpuTrainMotion) {
+        return;
+    }
+    
+    memcpy(snapshot->positionX, trains.positionX, size);
+    memcpy(snapshot->positionY, trains.positionY, size);
+    memcpy(snapshot->positionZ, trains.positionZ, size);
+    memcpy(snapshot->distance, trains.distance, trains.count * sizeof(double));
+}
+
+/*
+ 
+ Moves trains first up to last along their tracks by one tick,
+ wrapping them around at the ends of the line, then works out
+ where each one is. The distances are kept in their own array,
+ so they're moved two at a time where there's SSE2 or 64 bit
+ NEON. They're doubles, since on a long enough line, adding a
+ tick to a float distance rounds it, or adds nothing at all.
+ 
+ */
+
+void advanceTrains(int first, int last)
+{
+    int i = first;
+    
+#if defined(__SSE2__)
+    const __m128d zero = _mm_setzero_pd();
+    
+    for (; i + 2 <= last; i += 2) {
+        
+        __m128d distance = _mm_add_pd(_mm_loadu_pd(&trains.distance[i]), _mm_loadu_pd(&trains.velocity[i]));
+        __m128d length = _mm_loadu_pd(&trains.trackLength[i]);
+        
+        //  Back to the start past the end, and to the end before the start
+        distance = _mm_andnot_pd(_mm_cmpgt_pd(distance, length), distance);
+        
+        __m128d beforeStart = _mm_cmplt_pd(distance, zero);
+        distance = _mm_or_pd(_mm_and_pd(beforeStart, length), _mm_andnot_pd(beforeStart, distance));
+        
+        _mm_storeu_pd(&trains.distance[i], distance);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const float64x2_t zero = vdupq_n_f64(0.0);
+    
+    for (; i + 2 <= last; i += 2) {
+        
+        float64x2_t distance = vaddq_f64(vld1q_f64(&trains.distance[i]), vld1q_f64(&trains.velocity[i]));
+        float64x2_t length = vld1q_f64(&trains.trackLength[i]);
+        
+        //  Back to the start past the end, and to the end before the start
+        distance = vbslq_f64(vcgtq_f64(distance, length), zero, distance);
+        distance = vbslq_f64(vcltq_f64(distance, zero), length, distance);
+        
+        vst1q_f64(&trains.distance[i], distance);
+    }
+#endif
+    
+    //  Whatever's left over, or everything, without SIMD
+    for (; i < last; i++) {
+        
+        double distance = trains.distance[i] + trains.velocity[i];
+        
+        if (distance > trains.trackLength[i]) {
+            distance = 0;
+        }
+        else if (distance < 0) {
+            distance = trains.trackLength[i];
+        }
+        
+        trains.distance[i] = distance;
+    }
+    
+    for (i = first; i < last; i++) {
+        placeTrainOnTrack(i);
+    }
+}
+
+/* Applies a queued key press to the trains */
+
+void applyTrainCommand(const TrainCommand *command)
+{
+    int id = command->trainID;
+    float deltaPos = 0.1;
+    
+    if (trains.direction[id] == 0) {
+        deltaPos *= -1;
+    }
+    
+    switch (command->key) {
+        case 'z':
+            catchUpTrain(id);
+            trains.distance[id] += deltaPos;
+            placeTrainOnTrack(id);
+            retimeTrain(id);
+            break;
+        case 'x':
+            catchUpTrain(id);
+            trains.distance[id] -= deltaPos;
+            placeTrainOnTrack(id);
+            retimeTrain(id);
+            break;
+        case 'r':
+            placeTrains(TRAIN_RESET_Z);
+            retimeAllTrains();
+            break;
+        case 'p':
+            paused = !paused;
+            break;
+        default:
+            break;
+    }
+}
+
+void queueTrainCommand(unsigned char key, int trainID)
+{
+    TrainCommand command = {key, trainID};
+    
+    std::lock_guard<std::mutex> lock(simulationMutex);
+    pendingCommands.push_back(command);
+}
+
+/* Advances every train by one fixed step, then publishes where they are */
+
+void simulationTick(double time)
+{
+    {
+        std::lock_guard<std::mutex> lock(simulationMutex);
+        commandsThisTick.swap(pendingCommands);
+    }
+    
+    //  Either write down what happened on this tick, or play it back
+    if (replayingInput()) {
+        replayInputForTick(simulationTickCount, &commandsThisTick);
+    }
+    else {
+        recordInputForTick(simulationTickCount, &commandsThisTick);
+    }
+    
+    for (size_t i = 0; i < commandsThisTick.size(); i++) {
+        
+        //  View keys only come through here to be recorded
+        if (commandsThisTick[i].trainID != NO_TRAIN) {
+            applyTrainCommand(&commandsThisTick[i]);
+        }
+    }
+    
+    commandsThisTick.clear();
+    
+    //  Update each train's position, in chunks across the workers,
+    //  unless the shader does that, and only needs to know it's moved
+    double advanceStart = secondsNow();
+    
+    if (!paused && !configuration.gpuTrainMotion) {
+        runWorkers(advanceTrains, trains.count);
+    }
+    
+    if (!paused) {
+        motionTickCount++;
+    }
+    
+    lastTickTime = 1000.0 * (secondsNow() - advanceStart);
+    
+    simulationTickCount++;
+    
+    /* Nobody reads the free snapshot, so fill it in, then swap it in */
+    
+    copyTrainsInto(&snapshots[freeSnapshot], time);
+    
+    std::lock_guard<std::mutex> lock(simulationMutex);
+    
+    publishTrainMotion();
+    
+    int oldestSnapshot = previousSnapshot;
+    previousSnapshot = currentSnapshot;
+    currentSnapshot = freeSnapshot;
+    freeSnapshot = oldestSnapshot;
+}
+
+void simulationLoop()
+{
+    double nextTick = secondsNow() + SIMULATION_STEP;
+    
+    while (simulationRunning) {
+        
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(nextTick))));
+        
+        /* Run every tick that's due, so the results don't depend on timing */
+        
+        int ticks = 0;
+        
+        while (secondsNow() >= nextTick && ticks < MAX_TICKS_PER_WAKE) {
+            simulationTick(nextTick);
+            nextTick += SIMULATION_STEP;
+            ticks++;
+        }
+        
+        //  If we're too far behind, don't spiral trying to catch up
+        if (ticks == MAX_TICKS_PER_WAKE) {
+            nextTick = secondsNow() + SIMULATION_STEP;
+        }
+    }
+}
+
+/*
+ 
+ Moves the virtual clock along and runs every tick that falls
+ due, for when nobody's running the simulation thread.
+ 
+ */
+
+void stepSimulation(double seconds)
+{
+    double nextTick = snapshots[currentSnapshot].time + SIMULATION_STEP;
+    
+    virtualTime += seconds;
+    
+    while (virtualTime >= nextTick) {
+        simulationTick(nextTick);
+        nextTick += SIMULATION_STEP;
+    }
+}
+
+void startSimulation(bool threaded)
+{
+    for (int i = 0; i < 3; i++) {
+        allocateSnapshot(&snapshots[i], trains.count);
+    }
+    
+    allocateSnapshot(&drawnTrains, trains.count);
+    
+    /* Start out with both snapshots showing where the trains begin */
+    
+    simulationThreaded = threaded;
+    simulationTickCount = 0;
+    motionTickCount = 0;
+    virtualTime = 0;
+    
+    //  The scene may have been rebuilt, so the GPU's told about every train, and track, again
+    gpuTrains.pathsSent = false;
+    gpuTrains.changes.clear();
+    publishedTrainMotion.clear();
+    
+    retimeAllTrains();
+    publishTrainMotion();
+    
+    double now = simulationTime();
+    
+    copyTrainsInto(&snapshots[previousSnapshot], now - SIMULATION_STEP);
+    copyTrainsInto(&snapshots[currentSnapshot], now);
+    copyTrainsInto(&drawnTrains, now);
+    
+    startWorkers(configuration.simulationThreads);
+    
+    if (threaded) {
+        simulationRunning = true;
+        simulationThread = std::thread(simulationLoop);
+    }
+}
+
+void stopSimulation()
+{
+    if (simulationRunning) {
+        simulationRunning = false;
+        simulationThread.join();
+    }
+    
+    catchUpAllTrains();
+    stopWorkers();
+    
+    for (int i = 0; i < 3; i++) {
+        releaseSnapshot(&snapshots[i]);
+    }
+    
+    releaseSnapshot(&drawnTrains);
+}
+
+/*
+ 
+ Works out where to draw the trains. Frames lag the simulation
+ by up to a tick, and blend from the previous snapshot to the
+ current one as time goes on.
+ 
+ */
+
+void interpolateTrains()
+{
+    std::lock_guard<std::mutex> lock(simulationMutex);
+    
+    const TrainSnapshot *from = &snapshots[previousSnapshot];
+    const TrainSnapshot *to = &snapshots[currentSnapshot];
+    
+    float alpha = (float)((simulationTime() - to->time) / SIMULATION_STEP);
+    alpha = std::max(0.0f, std::min(1.0f, alpha));
+    
+    drawnTrains.time = from->time + (to->time - from->time) * alpha;
+    
+    //  The shader only needs to know how far its clock's got
+    if (configuration.gpuTrainMotion) {
+        double ticks = (to->motionTick - from->motionTick) * (double)alpha;
+        
+        drawnMotionTick = from->motionTick + (long)floor(ticks);
+        drawnMotionFraction = (float)(ticks - floor(ticks));
+        takeTrainMotion();
+        return;
+    }
+    
+    for (int i = 0; i < trains.count; i++) {
+        
+        int trackID = trains.trackID[i];
+        double deltaDistance = to->distance[i] - from->distance[i];
+        
+        drawnTrains.distance[i] = from->distance[i] + deltaDistance * alpha;
+        drawnTrains.positionY[i] = from->positionY[i] + (to->positionY[i] - from->positionY[i]) * alpha;
+        
+        //  Don't sweep a train along the whole line when it wraps around
+        if (fabs(deltaDistance) > tracks.length[trackID] / 2) {
+            drawnTrains.distance[i] = to->distance[i];
+            drawnTrains.positionY[i] = to->positionY[i];
+        }
+        
+        PathPoint position, direction;
+        trackPointAt(trackID, drawnTrains.distance[i], &position, &direction);
+        
+        drawnTrains.positionX[i] = position.x - tracks.offsetX[trackID];
+        drawnTrains.positionZ[i] = position.z;
+    }
+}
+
+#pragma mark - Input Recording
+
+/*
+ 
+ A recording holds the size of the scene, then every key that was
+ pressed, stamped with the simulation tick it took effect on. The
+ simulation thread writes it, at the start of each tick. Replays
+ feed the keys back in on the same ticks, so the trains end up in
+ exactly the same places, and the view follows along.
+ 
+ The file is kept small, since sessions can run long:
+ 
+ "IBIN", then a version byte
+ Tracks, trains per track, cars per train and platforms, as varints
+ The track length, as a little endian float
+ 
+ Then, for each key:
+ 
+ Ticks since the last key, as a varint
+ The key, as a byte
+ Which train it moves, plus one, as a varint (0 for view keys)
+ 
+ Version 1 recordings also stored the view's heading after each
+ train key, as a little endian float. Trains follow their tracks
+ now, so it's skipped when they're replayed.
+ 
+ */
+
+#define INPUT_FILE_MAGIC "IBIN"
+#define INPUT_FILE_VERSION 2
+
+//  The last version that stored a heading with each train key
+#define INPUT_FILE_HEADING_VERSION 1
+
+typedef struct
+{
+    long tick;
+    TrainCommand command;
+} RecordedInput;
+
+FILE *inputRecordFile = NULL;
+long lastRecordedTick = 0;
+
+std::vector<RecordedInput> replayedInputs;
+size_t nextReplayedInput = 0;
+std::atomic<bool> replaying(false);
+
+//  Keys the replay has reached, for the render thread to apply to the view
+std::mutex replayedViewKeysMutex;
+std::vector<unsigned char> replayedViewKeys;
+
+void writeVarint(FILE *file, unsigned long value)
+{
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7f) | 0x80, file);
+        value >>= 7;
+    }
+    
+    fputc((int)value, file);
+}
+
+void writeFloat(FILE *file, float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    for (int i = 0; i < 4; i++) {
+        fputc((int)((bits >> (8 * i)) & 0xff), file);
+    }
+}
+
+bool readVarint(const unsigned char **cursor, const unsigned char *end, unsigned long *value)
+{
+    *value = 0;
+    
+    for (int shift = 0; *cursor < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*cursor)++;
+        *value |= (unsigned long)(byte & 0x7f) << shift;
+        
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool readFloat(const unsigned char **cursor, const unsigned char *end, float *value)
+{
+    if (end - *cursor < 4) {
+        return false;
+    }
+    
+    unsigned int bits = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        bits |= (unsigned int)(*(*cursor)++) << (8 * i);
+    }
+    
+    memcpy(value, &bits, sizeof(bits));
+    
+    return true;
+}
+
+/* Reads a whole recording, and sizes the scene to match it */
+
+bool loadInputReplay(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    
+    if (!file) {
+        return false;
+    }
+    
+    std::vector<unsigned char> bytes;
+    unsigned char buffer[4096];
+    size_t count;
+    
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        bytes.insert(bytes.end(), buffer, buffer + count);
+    }
+    
+    fclose(file);
+    
+    size_t magicLength = strlen(INPUT_FILE_MAGIC);
+    
+    if (bytes.size() < magicLength + 1 || memcmp(&bytes[0], INPUT_FILE_MAGIC, magicLength) || bytes[magicLength] < INPUT_FILE_HEADING_VERSION || bytes[magicLength] > INPUT_FILE_VERSION) {
+        return false;
+    }
+    
+    bool hasHeadings = bytes[magicLength] <= INPUT_FILE_HEADING_VERSION;
+    
+    const unsigned char *cursor = &bytes[0] + magicLength + 1;
+    const unsigned char *end = &bytes[0] + bytes.size();
+    
+    /* The scene */
+    
+    unsigned long trackCount, trainsPerTrack, carsPerTrain, platformCount;
+    float trackLength;
+    
+    if (!readVarint(&cursor, end, &trackCount) || !readVarint(&cursor, end, &trainsPerTrack) || !readVarint(&cursor, end, &carsPerTrain) || !readVarint(&cursor, end, &platformCount) || !readFloat(&cursor, end, &trackLength)) {
+        return false;
+    }
+    
+    configuration.trackCount = std::max(1, (int)trackCount);
+    configuration.trainsPerTrack = (int)trainsPerTrack;
+    configuration.carsPerTrain = std::max(1, (int)carsPerTrain);
+    configuration.platformCount = std::max(1, std::min(MAX_PLATFORM_COUNT, (int)platformCount));
+    configuration.trackLength = std::max((float)TRACK_SEGMENT_LENGTH, trackLength);
+    
+    /* The keys, up to the last whole one */
+    
+    long tick = 0;
+    
+    replayedInputs.clear();
+    
+    while (cursor < end) {
+        
+        unsigned long ticksSinceLast, trainID;
+        RecordedInput input;
+        
+        if (!readVarint(&cursor, end, &ticksSinceLast) || cursor >= end) {
+            break;
+        }
+        
+        input.command.key = *cursor++;
+        
+        if (!readVarint(&cursor, end, &trainID)) {
+            break;
+        }
+        
+        //  Too big to be any train, but still checked against the scene before it's applied
+        input.command.trainID = trainID > INT32_MAX ? INT32_MAX : (int)trainID - 1;
+        
+        float heading;
+        
+        if (hasHeadings && input.command.trainID != NO_TRAIN && !readFloat(&cursor, end, &heading)) {
+            break;
+        }
+        
+        tick += ticksSinceLast;
+        input.tick = tick;
+        
+        replayedInputs.push_back(input);
+    }
+    
+    nextReplayedInput = 0;
+    
+    return true;
+}
+
+void openInputFiles()
+{
+    if (configuration.replayPath) {
+        
+        if (loadInputReplay(configuration.replayPath)) {
+            replaying = !replayedInputs.empty();
+        }
+        else {
+            std::cerr << "Couldn't replay " << configuration.replayPath << "." << std::endl;
+        }
+    }
+    
+    if (configuration.recordPath && configuration.replayPath) {
+        std::cerr << "Not recording while replaying." << std::endl;
+        return;
+    }
+    
+    if (configuration.recordPath) {
+        
+        inputRecordFile = fopen(configuration.recordPath, "wb");
+        
+        if (!inputRecordFile) {
+            std::cerr << "Couldn't open " << configuration.recordPath << " to record input." << std::endl;
+            return;
+        }
+        
+        fwrite(INPUT_FILE_MAGIC, 1, strlen(INPUT_FILE_MAGIC), inputRecordFile);
+        fputc(INPUT_FILE_VERSION, inputRecordFile);
+        
+        writeVarint(inputRecordFile, configuration.trackCount);
+        writeVarint(inputRecordFile, configuration.trainsPerTrack);
+        writeVarint(inputRecordFile, configuration.carsPerTrain);
+        writeVarint(inputRecordFile, configuration.platformCount);
+        writeFloat(inputRecordFile, configuration.trackLength);
+        
+        lastRecordedTick = 0;
+    }
+}
+
+void closeInputFiles()
+{
+    if (inputRecordFile) {
+        fclose(inputRecordFile);
+        inputRecordFile = NULL;
+    }
+}
+
+bool replayingInput()
+{
+    return replaying;
+}
+
+/* Queues a key that only changes the view, so that it's recorded in order */
+
+void recordViewKey(unsigned char key)
+{
+    if (!inputRecordFile) {
+        return;
+    }
+    
+    TrainCommand command = {key, NO_TRAIN};
+    
+    std::lock_guard<std::mutex> lock(simulationMutex);
+    pendingCommands.push_back(command);
+}
+
+void recordInputForTick(long tick, std::vector<TrainCommand> *commands)
+{
+    if (!inputRecordFile) {
+        return;
+    }
+    
+    for (size_t i = 0; i < commands->size(); i++) {
+        
+        const TrainCommand *command = &(*commands)[i];
+        
+        writeVarint(inputRecordFile, tick - lastRecordedTick);
+        fputc(command->key, inputRecordFile);
+        writeVarint(inputRecordFile, command->trainID + 1);
+        
+        lastRecordedTick = tick;
+    }
+}
+
+/* Hands back the keys recorded on this tick, and passes them on to the view */
+
+void replayInputForTick(long tick, std::vector<TrainCommand> *commands)
+{
+    std::lock_guard<std::mutex> lock(replayedViewKeysMutex);
+    
+    while (nextReplayedInput < replayedInputs.size() && replayedInputs[nextReplayedInput].tick <= tick) {
+        
+        const TrainCommand *command = &replayedInputs[nextReplayedInput].command;
+        
+        //  A replay can name any train, including ones this scene doesn't have
+        if (command->trainID < NO_TRAIN || command->trainID >= trains.count) {
+            std::cerr << "Skipping a key for train " << command->trainID << ", which isn't in the scene" << std::endl;
+        }
+        else {
+            commands->push_back(*command);
+        }
+        
+        replayedViewKeys.push_back(command->key);
+        
+        nextReplayedInput++;
+    }
+    
+    //  Once the recording runs out, the keyboard takes over again
+    if (nextReplayedInput == replayedInputs.size()) {
+        replaying = false;
+        std::cerr << "Replay finished, on tick " << tick << "." << std::endl;
+    }
+}
+
+/* Runs on the render thread, which owns the view */
+
+void applyReplayedViewKeys()
+{
+    std::vector<unsigned char> keys;
+    
+    {
+        std::lock_guard<std::mutex> lock(replayedViewKeysMutex);
+        keys.swap(replayedViewKeys);
+    }
+    
+    for (size_t i = 0; i < keys.size(); i++) {
+        viewKey(keys[i]);
+    }
+}
+
+#pragma mark - Statistics
+
+const char *statsSectionNames[STATS_SECTION_COUNT] = {"display", "scene", "track", "platform", "train", "lights", "submit"};
+const char *gpuPassNames[GPU_PASS_COUNT] = {"clear", "platform", "track", "train", "post"};
+
+FILE *statsCSVFile = NULL;
+FILE *statsJSONFile = NULL;
+
+void beginPrimitives(GLenum mode)
+{
+    frameStats.beginEndPairs++;
+    glBegin(mode);
+}
+
+void endPrimitives()
+{
+    glEnd();
+}
+
+void openStatsFiles()
+{
+    if (configuration.statsCSVPath) {
+        statsCSVFile = fopen(configuration.statsCSVPath, "w");
+        
+        if (!statsCSVFile) {
+            std::cerr << "Couldn't open " << configuration.statsCSVPath << " for statistics." << std::endl;
+        }
+        else {
+            fprintf(statsCSVFile, "frame");
+            
+            for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+                fprintf(statsCSVFile, ",%s_ms", statsSectionNames[i]);
+            }
+            
+            fprintf(statsCSVFile, ",draw_calls,begin_end_pairs,vertices,matrix_pushes,light_changes,filtered_changes,transform_updates,streamed_segments,station_lights,occluded,impostors,tick_ms");
+            
+            for (int i = 0; i < GPU_PASS_COUNT; i++) {
+                fprintf(statsCSVFile, ",gpu_%s_ms", gpuPassNames[i]);
+            }
+            
+            fprintf(statsCSVFile, ",gpu_frame\n");
+        }
+    }
+    
+    if (configuration.statsJSONPath) {
+        statsJSONFile = fopen(configuration.statsJSONPath, "w");
+        
+        if (!statsJSONFile) {
+            std::cerr << "Couldn't open " << configuration.statsJSONPath << " for statistics." << std::endl;
+        }
+        else {
+            fprintf(statsJSONFile, "[");
+        }
+    }
+}
+
+void closeStatsFiles()
+{
+    if (statsCSVFile) {
+        fclose(statsCSVFile);
+        statsCSVFile = NULL;
+    }
+    
+    //  The array is only valid once it's closed
+    if (statsJSONFile) {
+        fprintf(statsJSONFile, "\n]\n");
+        fclose(statsJSONFile);
+        statsJSONFile = NULL;
+    }
+}
+
+void writeStatsCSV(FrameStats *stats)
+{
+    fprintf(statsCSVFile, "%ld", stats->frame);
+    
+    for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+        fprintf(statsCSVFile, ",%.4f", stats->sectionTime[i]);
+    }
+    
+    fprintf(statsCSVFile, ",%d,%d,%ld,%d,%d,%d,%d,%d,%d,%d,%d,%.4f", stats->drawCalls, stats->beginEndPairs, stats->vertices, stats->matrixPushes, stats->lightChanges, stats->filteredChanges, stats->transformUpdates, stats->streamedSegments, stats->stationLights, stats->occluded, stats->impostors, stats->tickTime);
+    
+    //  Left empty until the first GPU times come back
+    for (int i = 0; i < GPU_PASS_COUNT; i++) {
+        if (stats->gpuFrame >= 0) {
+            fprintf(statsCSVFile, ",%.4f", stats->gpuTime[i]);
+        }
+        else {
+            fprintf(statsCSVFile, ",");
+        }
+    }
+    
+    fprintf(statsCSVFile, ",%ld\n", stats->gpuFrame);
+}
+
+void writeStatsJSON(FrameStats *stats)
+{
+    fprintf(statsJSONFile, "%s\n  {\"frame\": %ld", stats->frame ? "," : "", stats->frame);
+    
+    for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+        fprintf(statsJSONFile, ", \"%s_ms\": %.4f", statsSectionNames[i], stats->sectionTime[i]);
+    }
+    
+    fprintf(statsJSONFile, ", \"draw_calls\": %d, \"begin_end_pairs\": %d, \"vertices\": %ld, \"matrix_pushes\": %d, \"light_changes\": %d, \"filtered_changes\": %d, \"transform_updates\": %d, \"streamed_segments\": %d, \"station_lights\": %d, \"occluded\": %d, \"impostors\": %d, \"tick_ms\": %.4f", stats->drawCalls, stats->beginEndPairs, stats->vertices, stats->matrixPushes, stats->lightChanges, stats->filteredChanges, stats->transformUpdates, stats->streamedSegments, stats->stationLights, stats->occluded, stats->impostors, stats->tickTime);
+    
+    for (int i = 0; i < GPU_PASS_COUNT; i++) {
+        if (stats->gpuFrame >= 0) {
+            fprintf(statsJSONFile, ", \"gpu_%s_ms\": %.4f", gpuPassNames[i], stats->gpuTime[i]);
+        }
+        else {
+            fprintf(statsJSONFile, ", \"gpu_%s_ms\": null", gpuPassNames[i]);
+        }
+    }
+    
+    fprintf(statsJSONFile, ", \"gpu_frame\": %ld}", stats->gpuFrame);
+}
+
+/* Writes out the frame that just finished, and starts counting the next one */
+
+void finishFrameStats()
+{
+    frameStats.tickTime = lastTickTime;
+    
+    if (statsCSVFile) {
+        writeStatsCSV(&frameStats);
+    }
+    
+    if (statsJSONFile) {
+        writeStatsJSON(&frameStats);
+    }
+    
+    lastFrameStats = frameStats;
+    
+    memset(&frameStats, 0, sizeof(frameStats));
+    frameStats.frame = lastFrameStats.frame + 1;
+}
+
+void drawStatsText(int x, int y, const char *text)
+{
+    glRasterPos2i(x, y);
+    
+    for (const char *c = text; *c; c++) {
+        glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *c);
+    }
+}
+
+/*
+ 
+ Draws the last frame's statistics in the corner of the window.
+ This uses GL directly, so the overlay doesn't count itself.
+ 
+ */
+
+void drawStatsOverlay()
+{
+    //  Bitmap fonts need GLUT, which headless runs don't start
+    if (configuration.headless) {
+        return;
+    }
+    
+    FrameStats *stats = &lastFrameStats;
+    
+    //  A core profile can't draw bitmap fonts, so use the title bar
+    if (configuration.shaderRenderer) {
+        char title[256];
+        
+        double gpuTime = 0;
+        
+        for (int i = 0; i < GPU_PASS_COUNT; i++) {
+            gpuTime += stats->gpuTime[i];
+        }
+        
+        snprintf(title, sizeof(title), "Interborough Rapid Transit - Frame %ld: %.2f ms, GPU %.2f ms, %d draws, %ld vertices, %d station lights, %d occluded, %d impostors", stats->frame, stats->sectionTime[STATS_DISPLAY], gpuTime, stats->drawCalls, stats->vertices, stats->stationLights, stats->occluded, stats->impostors);
+        glutSetWindowTitle(title);
+        
+        return;
+    }
+    
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, viewport[2], 0, viewport[3]);
+    
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    
+    glColor3f(1.0f, 1.0f, 1.0f);
+    
+    char line[128];
+    int y = viewport[3] - 15;
+    
+    snprintf(line, sizeof(line), "Frame %ld: %.2f ms, scene %.2f ms", stats->frame, stats->sectionTime[STATS_DISPLAY], stats->sectionTime[STATS_SCENE]);
+    drawStatsText(5, y, line);
+    y -= 15;
+    
+    snprintf(line, sizeof(line), "Track %.2f  Platform %.2f  Train %.2f  Tick %.2f ms", stats->sectionTime[STATS_TRACK], stats->sectionTime[STATS_PLATFORM], stats->sectionTime[STATS_TRAIN], stats->tickTime);
+    drawStatsText(5, y, line);
+    y -= 15;
+    
+    snprintf(line, sizeof(line), "Draws %d  glBegin/glEnd %d  Vertices %ld  Occluded %d  Impostors %d", stats->drawCalls, stats->beginEndPairs, stats->vertices, stats->occluded, stats->impostors);
+    drawStatsText(5, y, line);
+    y -= 15;
+    
+    snprintf(line, sizeof(line), "Matrix pushes %d  Light changes %d  Filtered %d  Transforms %d  Streamed %d", stats->matrixPushes, stats->lightChanges, stats->filteredChanges, stats->transformUpdates, stats->streamedSegments);
+    drawStatsText(5, y, line);
+    y -= 15;
+    
+    if (stats->gpuFrame >= 0) {
+        snprintf(line, sizeof(line), "GPU clear %.2f  Platform %.2f  Track %.2f  Train %.2f  Post %.2f ms", stats->gpuTime[GPU_PASS_CLEAR], stats->gpuTime[GPU_PASS_PLATFORM], stats->gpuTime[GPU_PASS_TRACK], stats->gpuTime[GPU_PASS_TRAIN], stats->gpuTime[GPU_PASS_POST]);
+        drawStatsText(5, y, line);
+    }
+    
+    glPopMatrix();
+    
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+}
+
+#pragma mark - GPU Timers
+
+/*
+ 
+ CPU timers only say how long it took to ask for a frame. To see
+ where the GPU spends its time, a timestamp query goes into the
+ command stream wherever the frame moves from one pass to the
+ next, and the time between two stamps is charged to the pass
+ that started at the first. The queries go into a ring, a set per
+ frame, and are only read back once they're done, a few frames
+ later, so the pipeline never waits on them. If a set still isn't
+ done when its turn comes round again, it's dropped.
+ 
+ Time the GPU spends waiting on the CPU between two stamps is
+ charged to the pass too.
+ 
+ */
+
+//  Frames in flight before a set of queries is reused
+#define GPU_TIMER_FRAMES 4
+
+//  Stamps a frame can take, the last one being its end
+#define MAX_GPU_STAMPS 32
+
+typedef struct
+{
+    GLuint queries[MAX_GPU_STAMPS];
+    GpuPass pass[MAX_GPU_STAMPS];   //  What the GPU did from each stamp to the next
+    int stampCount;
+    long frame;                     //  Which frame the stamps were taken in
+    bool pending;                   //  Are there results to read back?
+} GpuTimerFrame;
+
+typedef struct
+{
+    bool supported;
+    GpuTimerFrame frames[GPU_TIMER_FRAMES];
+    int current;
+    bool timing;                    //  Between beginGpuFrame() and endGpuFrame()?
+    int pass;                       //  The pass of the last stamp, or -1
+} GpuTimers;
+
+GpuTimers gpuTimers;
+void buildGpuTimers()
+{
+    memset(&gpuTimers, 0, sizeof(gpuTimers));
+    
+    gpuTimers.supported = hasExtension("GL_ARB_timer_query");
+    
+    if (!gpuTimers.supported) {
+        return;
+    }
+    
+    for (int i = 0; i < GPU_TIMER_FRAMES; i++) {
+        glGenQueries(MAX_GPU_STAMPS, gpuTimers.frames[i].queries);
+    }
+}
+
+void destroyGpuTimers()
+{
+    if (!gpuTimers.supported) {
+        return;
+    }
+    
+    for (int i = 0; i < GPU_TIMER_FRAMES; i++) {
+        glDeleteQueries(MAX_GPU_STAMPS, gpuTimers.frames[i].queries);
+    }
+    
+    gpuTimers.supported = false;
+}
+
+/* Charges a frame's stamps to their passes, if the GPU's got to the end of them */
+
+bool readGpuTimerFrame(GpuTimerFrame *frame, FrameStats *stats)
+{
+    GLint available = GL_FALSE;
+    glGetQueryObjectiv(frame->queries[frame->stampCount - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+    
+    if (!available) {
+        return false;
+    }
+    
+    //  Queries finish in order, so all the earlier ones are done too
+    GLuint64 stamps[MAX_GPU_STAMPS];
+    
+    for (int i = 0; i < frame->stampCount; i++) {
+        glGetQueryObjectui64v(frame->queries[i], GL_QUERY_RESULT, &stamps[i]);
+    }
+    
+    for (int i = 0; i < GPU_PASS_COUNT; i++) {
+        stats->gpuTime[i] = 0;
+    }
+    
+    for (int i = 0; i + 1 < frame->stampCount; i++) {
+        stats->gpuTime[frame->pass[i]] += (stamps[i + 1] - stamps[i]) / 1000000.0;
+    }
+    
+    stats->gpuFrame = frame->frame;
+    
+    return true;
+}
+
+/* Starts stamping a frame, and picks up the times of the oldest one still in flight */
+
+void beginGpuFrame()
+{
+    frameStats.gpuFrame = -1;
+    
+    if (gpuTimers.supported) {
+        
+        gpuTimers.current = (gpuTimers.current + 1) % GPU_TIMER_FRAMES;
+        
+        GpuTimerFrame *frame = &gpuTimers.frames[gpuTimers.current];
+        
+        if (frame->pending) {
+            readGpuTimerFrame(frame, &frameStats);
+        }
+        
+        frame->stampCount = 0;
+        frame->frame = frameStats.frame;
+        frame->pending = false;
+        
+        gpuTimers.timing = true;
+        gpuTimers.pass = -1;
+    }
+    
+    markGpuPass(GPU_PASS_CLEAR);
+}
+
+/* Whatever's submitted from here on counts towards pass */
+
+void markGpuPass(GpuPass pass)
+{
+    GpuTimerFrame *frame = &gpuTimers.frames[gpuTimers.current];
+    
+    scenePass = pass;
+    
+    //  Keep the last stamp for the end of the frame
+    if (!gpuTimers.timing || (int)pass == gpuTimers.pass || frame->stampCount == MAX_GPU_STAMPS - 1) {
+        return;
+    }
+    
+    glQueryCounter(frame->queries[frame->stampCount], GL_TIMESTAMP);
+    frame->pass[frame->stampCount] = pass;
+    frame->stampCount++;
+    
+    gpuTimers.pass = pass;
+}
+
+void endGpuFrame()
+{
+    if (!gpuTimers.timing) {
+        return;
+    }
+    
+    GpuTimerFrame *frame = &gpuTimers.frames[gpuTimers.current];
+    
+    glQueryCounter(frame->queries[frame->stampCount], GL_TIMESTAMP);
+    frame->stampCount++;
+    frame->pending = true;
+    
+    gpuTimers.timing = false;
+}
+
+
+#pragma mark - Anti-aliasing
+
+/*
+ 
+ The scene is drawn into a framebuffer of its own, and then
+ smoothed on its way to wherever it's shown, the window or the
+ headless framebuffer. Multisampling draws it with 2, 4 or 8
+ samples a pixel, and resolves them with a blit. FXAA draws it
+ once, at a sample a pixel, and then blurs along the edges it
+ finds in a full screen pass. Either way, opaque geometry is drawn
+ without blending, which GL_POLYGON_SMOOTH used to need.
+ 
+ */
+
+typedef struct
+{
+    GLuint framebuffer;         //  Where the scene is drawn
+    GLuint colorBuffer;         //  A multisampled renderbuffer, or nothing for FXAA
+    GLuint colorTexture;        //  What FXAA reads, or nothing for multisampling
+    GLuint depthBuffer;
+    GLint presentFramebuffer;   //  Where the smoothed frame goes
+    int samples;
+    int width;
+    int height;
+    
+    GLuint fxaaProgram;
+    GLuint fxaaVertexArray;     //  The core profile draws nothing without one
+    GLint texelSizeUniform;
+} AntialiasingStage;
+
+AntialiasingStage antialiasing;
+
+/*
+ 
+ FXAA, after Timothy Lottes: finds the direction of the edge
+ through each pixel from the luma of its corners, and blends
+ along it, unless that overshoots the neighborhood's contrast.
+ 
+ */
+
+static const char *fxaaCoreVertexShader =
+    "#version 150\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    //  One triangle that covers the screen\n"
+    "    vec2 corner = vec2(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0);\n"
+    "    gl_Position = vec4(corner, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fxaaLegacyVertexShader =
+    "#version 120\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    gl_Position = gl_Vertex;\n"
+    "}\n";
+
+static const char *fxaaFragmentSource =
+    "uniform sampler2D scene;\n"
+    "uniform vec2 texelSize;\n"
+    "\n"
+    "#define FXAA_REDUCE_MIN (1.0 / 128.0)\n"
+    "#define FXAA_REDUCE_MUL (1.0 / 8.0)\n"
+    "#define FXAA_SPAN_MAX 8.0\n"
+    "\n"
+    "vec3 sceneAt(vec2 uv)\n"
+    "{\n"
+    "    return SAMPLE(scene, uv).rgb;\n"
+    "}\n"
+    "\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 uv = gl_FragCoord.xy * texelSize;\n"
+    "    vec3 luma = vec3(0.299, 0.587, 0.114);\n"
+    "\n"
+    "    float lumaNW = dot(sceneAt(uv + vec2(-1.0, -1.0) * texelSize), luma);\n"
+    "    float lumaNE = dot(sceneAt(uv + vec2(1.0, -1.0) * texelSize), luma);\n"
+    "    float lumaSW = dot(sceneAt(uv + vec2(-1.0, 1.0) * texelSize), luma);\n"
+    "    float lumaSE = dot(sceneAt(uv + vec2(1.0, 1.0) * texelSize), luma);\n"
+    "    vec3 middle = sceneAt(uv);\n"
+    "    float lumaM = dot(middle, luma);\n"
+    "\n"
+    "    float lumaMin = min(lumaM, min(min(lumaNW, lumaNE), min(lumaSW, lumaSE)));\n"
+    "    float lumaMax = max(lumaM, max(max(lumaNW, lumaNE), max(lumaSW, lumaSE)));\n"
+    "\n"
+    "    vec2 direction = vec2(-((lumaNW + lumaNE) - (lumaSW + lumaSE)), (lumaNW + lumaSW) - (lumaNE + lumaSE));\n"
+    "\n"
+    "    float reduce = max((lumaNW + lumaNE + lumaSW + lumaSE) * (0.25 * FXAA_REDUCE_MUL), FXAA_REDUCE_MIN);\n"
+    "    float scale = 1.0 / (min(abs(direction.x), abs(direction.y)) + reduce);\n"
+    "\n"
+    "    direction = clamp(direction * scale, vec2(-FXAA_SPAN_MAX), vec2(FXAA_SPAN_MAX)) * texelSize;\n"
+    "\n"
+    "    vec3 near = 0.5 * (sceneAt(uv + direction * (1.0 / 3.0 - 0.5)) + sceneAt(uv + direction * (2.0 / 3.0 - 0.5)));\n"
+    "    vec3 far = near * 0.5 + 0.25 * (sceneAt(uv - direction * 0.5) + sceneAt(uv + direction * 0.5));\n"
+    "\n"
+    "    float lumaFar = dot(far, luma);\n"
+    "\n"
+    "    //  Not an edge at all\n"
+    "    if (lumaMax - lumaMin < FXAA_REDUCE_MIN) {\n"
+    "        near = far = middle;\n"
+    "    }\n"
+    "\n"
+    "    OUTPUT = vec4((lumaFar < lumaMin || lumaFar > lumaMax) ? near : far, 1.0);\n"
+    "}\n";
+
+/* Builds the FXAA program, if it's wanted. The buffers wait for the first resize. */
+
+void buildAntialiasing()
+{
+    memset(&antialiasing, 0, sizeof(antialiasing));
+    
+    //  Whatever's bound now is where frames are shown
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &antialiasing.presentFramebuffer);
+    
+    if (configuration.antialiasSamples > 1) {
+        
+        GLint maxSamples = 0;
+        glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+        
+        antialiasing.samples = std::min(configuration.antialiasSamples, (int)maxSamples);
+        
+        if (antialiasing.samples < configuration.antialiasSamples) {
+            std::cerr << "Only " << maxSamples << " samples a pixel to be had." << std::endl;
+        }
+    }
+    
+    if (!configuration.fxaa) {
+        return;
+    }
+    
+    std::string fragmentSource;
+    
+    if (configuration.shaderRenderer) {
+        fragmentSource = "#version 150\n#define SAMPLE texture\n#define OUTPUT fragmentColor\nout vec4 fragmentColor;\n";
+    }
+    else {
+        fragmentSource = "#version 120\n#define SAMPLE texture2D\n#define OUTPUT gl_FragColor\n";
+    }
+    
+    fragmentSource += fxaaFragmentSource;
+    
+    const char *vertexSource = configuration.shaderRenderer ? fxaaCoreVertexShader : fxaaLegacyVertexShader;
+    
+    antialiasing.fxaaProgram = linkProgram(vertexSource, fragmentSource.c_str(), NULL, NULL, 0);
+    
+    if (!antialiasing.fxaaProgram) {
+        std::cerr << "Couldn't build FXAA, so edges stay rough." << std::endl;
+        return;
+    }
+    
+    glUseProgram(antialiasing.fxaaProgram);
+    glUniform1i(glGetUniformLocation(antialiasing.fxaaProgram, "scene"), 0);
+    antialiasing.texelSizeUniform = glGetUniformLocation(antialiasing.fxaaProgram, "texelSize");
+    glUseProgram(configuration.shaderRenderer ? shaderProgram : 0);
+    
+    if (configuration.shaderRenderer) {
+        glGenVertexArrays(1, &antialiasing.fxaaVertexArray);
+    }
+}
+
+void destroyAntialiasingBuffers()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.presentFramebuffer);
+    
+    glDeleteFramebuffers(1, &antialiasing.framebuffer);
+    glDeleteRenderbuffers(1, &antialiasing.colorBuffer);
+    glDeleteRenderbuffers(1, &antialiasing.depthBuffer);
+    glDeleteTextures(1, &antialiasing.colorTexture);
+    
+    antialiasing.framebuffer = 0;
+    antialiasing.colorBuffer = 0;
+    antialiasing.depthBuffer = 0;
+    antialiasing.colorTexture = 0;
+}
+
+/* (Re)allocates the scene's framebuffer at the size of the window */
+
+void resizeAntialiasing(int width, int height)
+{
+    bool multisampled = antialiasing.samples > 1;
+    bool fxaa = antialiasing.fxaaProgram != 0;
+    
+    if ((!multisampled && !fxaa) || (width == antialiasing.width && height == antialiasing.height)) {
+        return;
+    }
+    
+    destroyAntialiasingBuffers();
+    
+    antialiasing.width = width;
+    antialiasing.height = height;
+    
+    glGenFramebuffers(1, &antialiasing.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.framebuffer);
+    
+    if (fxaa) {
+        glGenTextures(1, &antialiasing.colorTexture);
+        glBindTexture(GL_TEXTURE_2D, antialiasing.colorTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, antialiasing.colorTexture, 0);
+    }
+    else {
+        glGenRenderbuffers(1, &antialiasing.colorBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, antialiasing.colorBuffer);
+        glRenderbufferStorageMultisample(GL_RENDERBUFFER, antialiasing.samples, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, antialiasing.colorBuffer);
+    }
+    
+    //  FXAA draws the scene at a sample a pixel, so its depth does too
+    glGenRenderbuffers(1, &antialiasing.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, antialiasing.depthBuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, fxaa ? 0 : antialiasing.samples, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, antialiasing.depthBuffer);
+    
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        std::cerr << "Couldn't create a framebuffer to smooth the scene in, so edges stay rough." << std::endl;
+        destroyAntialiasingBuffers();
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.presentFramebuffer);
+}
+
+/* Points drawing at the scene's framebuffer, if there is one */
+
+void beginAntialiasedFrame()
+{
+    if (antialiasing.framebuffer) {
+        glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.framebuffer);
+    }
+}
+
+/* Smooths the scene into wherever it's shown, and leaves that bound for the overlay and screenshots */
+
+void finishAntialiasedFrame()
+{
+    if (!antialiasing.framebuffer) {
+        return;
+    }
+    
+    if (!antialiasing.colorTexture) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, antialiasing.framebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, antialiasing.presentFramebuffer);
+        glBlitFramebuffer(0, 0, antialiasing.width, antialiasing.height, 0, 0, antialiasing.width, antialiasing.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.presentFramebuffer);
+        
+        frameStats.drawCalls++;
+        return;
+    }
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, antialiasing.presentFramebuffer);
+    
+    bool depthTest = stateEnabled(GL_DEPTH_TEST);
+    disableState(GL_DEPTH_TEST);
+    
+    glUseProgram(antialiasing.fxaaProgram);
+    glUniform2f(antialiasing.texelSizeUniform, 1.0f / antialiasing.width, 1.0f / antialiasing.height);
+    
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, antialiasing.colorTexture);
+    
+    if (configuration.shaderRenderer) {
+        glBindVertexArray(antialiasing.fxaaVertexArray);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glBindVertexArray(shaderVertexArray);
+        glUseProgram(shaderProgram);
+        
+        frameStats.drawCalls++;
+    }
+    else {
+        //  The program ignores the matrices, so this covers the screen too
+        beginPrimitives(GL_TRIANGLES);
+        glVertex2f(-1, -1);
+        glVertex2f(3, -1);
+        glVertex2f(-1, 3);
+        endPrimitives();
+        
+        frameStats.vertices += 3;
+        glUseProgram(0);
+    }
+    
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    if (depthTest) {
+        enableState(GL_DEPTH_TEST);
+    }
+}
+
+void destroyAntialiasing()
+{
+    destroyAntialiasingBuffers();
+    
+    if (antialiasing.fxaaProgram) {
+        glDeleteProgram(antialiasing.fxaaProgram);
+    }
+    
+    if (antialiasing.fxaaVertexArray) {
+        glDeleteVertexArrays(1, &antialiasing.fxaaVertexArray);
+    }
+    
+    antialiasing.fxaaProgram = 0;
+    antialiasing.fxaaVertexArray = 0;
+    antialiasing.width = antialiasing.height = 0;
+}
+
+
+#pragma mark - Headless
+
+/*
+ 
+ Headless runs draw into a framebuffer object on a context that
+ has no window, so they work on build machines without a display.
+ Frames are timed with glFinish, so the numbers include the GPU.
+ 
+ */
+
+#ifdef __APPLE__
+
+CGLContextObj headlessContext = NULL;
+
+bool createHeadlessContext()
+{
+    CGLPixelFormatAttribute attributes[] = {
+        kCGLPFAAccelerated,
+        kCGLPFAAllowOfflineRenderers,
+        kCGLPFAOpenGLProfile, (CGLPixelFormatAttribute)kCGLOGLPVersion_3_2_Core,
+        (CGLPixelFormatAttribute)0
+    };
+    
+    //  Without the shader renderer, stop short of asking for a core profile
+    if (!configuration.shaderRenderer) {
+        attributes[2] = (CGLPixelFormatAttribute)0;
+    }
+    
+    CGLPixelFormatObj pixelFormat = NULL;
+    GLint formatCount = 0;
+    
+    if (CGLChoosePixelFormat(attributes, &pixelFormat, &formatCount) != kCGLNoError || !pixelFormat) {
+        
+        if (!configuration.shaderRenderer) {
+            return false;
+        }
+        
+        std::cerr << "No core profile to be had, so falling back to fixed function." << std::endl;
+        configuration.shaderRenderer = false;
+        
+        return createHeadlessContext();
+    }
+    
+    CGLError error = CGLCreateContext(pixelFormat, NULL, &headlessContext);
+    CGLDestroyPixelFormat(pixelFormat);
+    
+    return error == kCGLNoError && CGLSetCurrentContext(headlessContext) == kCGLNoError;
+}
+
+void destroyHeadlessContext()
+{
+    CGLSetCurrentContext(NULL);
+    CGLDestroyContext(headlessContext);
+}
+
+#else
+
+EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+EGLContext headlessContext = EGL_NO_CONTEXT;
+
+bool createHeadlessContext()
+{
+    /* Prefer a display that doesn't need a window system at all */
+    
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    
+    if (getPlatformDisplay) {
+        headlessDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    
+    if (headlessDisplay == EGL_NO_DISPLAY) {
+        headlessDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
+    
+    if (headlessDisplay == EGL_NO_DISPLAY || !eglInitialize(headlessDisplay, NULL, NULL)) {
+        return false;
+    }
+    
+    if (!eglBindAPI(EGL_OPENGL_API)) {
+        return false;
+    }
+    
+    if (configuration.shaderRenderer) {
+        EGLint coreAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+            EGL_CONTEXT_MINOR_VERSION_KHR, 2,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+            EGL_NONE
+        };
+        
+        headlessContext = eglCreateContext(headlessDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, coreAttributes);
+        
+        if (headlessContext == EGL_NO_CONTEXT) {
+            std::cerr << "No core profile to be had, so falling back to fixed function." << std::endl;
+            configuration.shaderRenderer = false;
+        }
+    }
+    
+    if (headlessContext == EGL_NO_CONTEXT) {
+        headlessContext = eglCreateContext(headlessDisplay, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+    }
+    
+    if (headlessContext == EGL_NO_CONTEXT) {
+        return false;
+    }
+    
+    return eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, headlessContext);
+}
+
+void destroyHeadlessContext()
+{
+    eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(headlessDisplay, headlessContext);
+    eglTerminate(headlessDisplay);
+}
+
+#endif
+
+GLuint headlessFramebuffer = 0;
+GLuint headlessColorBuffer = 0;
+GLuint headlessDepthBuffer = 0;
+
+bool createHeadlessFramebuffer(int width, int height)
+{
+    glGenFramebuffers(1, &headlessFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headlessFramebuffer);
+    
+    glGenRenderbuffers(1, &headlessColorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headlessColorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headlessColorBuffer);
+    
+    glGenRenderbuffers(1, &headlessDepthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headlessDepthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headlessDepthBuffer);
+    
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void destroyHeadlessFramebuffer()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteRenderbuffers(1, &headlessDepthBuffer);
+    glDeleteRenderbuffers(1, &headlessColorBuffer);
+    glDeleteFramebuffers(1, &headlessFramebuffer);
+}
+
+/* Writes whatever's in the framebuffer out as a binary PPM */
+
+bool saveScreenshot(const char *path, int width, int height)
+{
+    std::vector<unsigned char> pixels(width * height * 3);
+    
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    
+    FILE *file = fopen(path, "wb");
+    
+    if (!file) {
+        return false;
+    }
+    
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    
+    //  OpenGL's rows go bottom to top, and PPM's go top to bottom
+    for (int row = height - 1; row >= 0; row--) {
+        fwrite(&pixels[row * width * 3], 1, width * 3, file);
+    }
+    
+    fclose(file);
+    
+    return true;
+}
+
+int runHeadless()
+{
+    if (!createHeadlessContext()) {
+        std::cerr << "Couldn't create an offscreen OpenGL context." << std::endl;
+        return EXIT_FAILURE;
+    }
+    
+    if (!createHeadlessFramebuffer(WINDOW_WIDTH, WINDOW_HEIGHT)) {
+        std::cerr << "Couldn't create an offscreen framebuffer." << std::endl;
+        destroyHeadlessContext();
+        return EXIT_FAILURE;
+    }
+    
+    init();
+    reshape(WINDOW_WIDTH, WINDOW_HEIGHT);
+    
+    int result = configuration.benchmark ? runBenchmark() : timeHeadlessRun();
+    
+    cleanup();
+    destroyHeadlessFramebuffer();
+    destroyHeadlessContext();
+    
+    return result;
+}
+
+/*
+ 
+ Draws and times a single frame. Every frame advances the
+ trains by exactly one tick, so runs repeat exactly.
+ 
+ */
+
+double timeHeadlessFrame()
+{
+    double frameStart = secondsNow();
+    
+    stepSimulation(SIMULATION_STEP);
+    display();
+    glFinish();
+    
+    return secondsNow() - frameStart;
+}
+
+int timeHeadlessRun()
+{
+    startSimulation(false);
+    
+    int frameCount = configuration.headlessFrames;
+    std::vector<double> frameTimes(frameCount);
+    
+    double startTime = secondsNow();
+    
+    for (int frame = 0; frame < frameCount; frame++) {
+        frameTimes[frame] = timeHeadlessFrame();
+    }
+    
+    double totalTime = secondsNow() - startTime;
+    
+    double minimum = *std::min_element(frameTimes.begin(), frameTimes.end());
+    double maximum = *std::max_element(frameTimes.begin(), frameTimes.end());
+    
+    std::cout << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
+    std::cout << "Frames: " << frameCount << " in " << totalTime << " s" << std::endl;
+    std::cout << "Frame time (ms): mean " << 1000.0 * totalTime / frameCount << ", min " << 1000.0 * minimum << ", max " << 1000.0 * maximum << std::endl;
+    std::cout << "FPS: " << frameCount / totalTime << std::endl;
+    
+    int result = EXIT_SUCCESS;
+    
+    if (configuration.screenshotPath && !saveScreenshot(configuration.screenshotPath, WINDOW_WIDTH, WINDOW_HEIGHT)) {
+        std::cerr << "Couldn't write a screenshot to " << configuration.screenshotPath << "." << std::endl;
+        result = EXIT_FAILURE;
+    }
+    
+    stopSimulation();
+    
+    return result;
+}
+
+#pragma mark - Benchmark
+
+/*
+ 
+ The benchmark flies the camera along a few scripted paths, over
+ a range of scene sizes, and prints the spread of frame times for
+ each as CSV. Each sweep varies one size and leaves the others as
+ they were given on the command line, so every sweep is a curve.
+ 
+ */
+
+#define BENCHMARK_WARMUP_FRAMES 10
+
+typedef struct
+{
+    float alongTrack;           //  Where the camera is on the line, from -1 to 1 of the track length
+    float translate[3];         //  Where it is from there, after turning
+    float pitch;
+    float heading;
+} CameraKeyframe;
+
+#define MAX_CAMERA_KEYFRAMES 4
+
+typedef struct
+{
+    const char *name;
+    int keyframeCount;
+    CameraKeyframe keyframes[MAX_CAMERA_KEYFRAMES];
+} CameraPath;
+
+#define CAMERA_PATH_COUNT 3
+
+const CameraPath cameraPaths[CAMERA_PATH_COUNT] = {
+    
+    //  Down the middle of the line, past every platform, looking around a little
+    {"flythrough", 4, {
+        {0.95f, {0.0f, -1.1f, 0.0f}, 0.0f, 0.0f},
+        {0.3f, {0.0f, -1.1f, 0.0f}, 0.0f, 15.0f},
+        {-0.3f, {0.0f, -1.1f, 0.0f}, 0.0f, -15.0f},
+        {-0.95f, {0.0f, -1.1f, 0.0f}, 0.0f, 0.0f}}},
+    
+    //  High above the stations, looking down on the platforms and trains
+    {"birdseye", 3, {
+        {0.15f, {0.0f, -25.0f, -50.0f}, 60.0f, 0.0f},
+        {0.0f, {0.0f, -40.0f, -70.0f}, 50.0f, 30.0f},
+        {-0.15f, {0.0f, -25.0f, -50.0f}, 60.0f, 0.0f}}},
+    
+    //  Low, beside the outside track, past the trains and through the stations
+    {"tunnel", 2, {
+        {0.1f, {-3.0f, -0.2f, 0.0f}, 0.0f, 0.0f},
+        {-0.3f, {-3.0f, -0.2f, 0.0f}, 0.0f, 0.0f}}}
+};
+
+bool cameraPathSelected[CAMERA_PATH_COUNT] = {true, true, true};
+
+typedef enum
+{
+    SWEEP_TRACKS,
+    SWEEP_TRAINS_PER_TRACK,
+    SWEEP_CARS_PER_TRAIN,
+    SWEEP_TRACK_LENGTH,
+    SWEEP_PLATFORMS,
+    SWEEP_FIXTURES,
+    SWEEP_COUNT
+} SweepParameter;
+
+const char *sweepNames[SWEEP_COUNT] = {"tracks", "trains-per-track", "cars-per-train", "track-length", "platforms", "fixtures"};
+
+#define DEFAULT_SWEEP_LENGTH 5
+
+const float defaultSweepValues[SWEEP_COUNT][DEFAULT_SWEEP_LENGTH] = {
+    {1, 2, 4, 8, 16},
+    {1, 2, 4, 8, 16},
+    {1, 5, 10, 20, 40},
+    {125, 250, 500, 1000, 2000},
+    {1, 4, 8, 16, 32},
+    {0, 4, 16, 32, 64}
+};
+
+//  Sweeps given on the command line replace all of the defaults
+std::vector<float> requestedSweepValues[SWEEP_COUNT];
+bool sweepsRequested = false;
+
+/* Takes a sweep like "tracks=1,2,4" */
+
+bool addBenchmarkSweep(const char *sweep)
+{
+    const char *values = strchr(sweep, '=');
+    
+    if (!values) {
+        return false;
+    }
+    
+    for (int i = 0; i < SWEEP_COUNT; i++) {
+        
+        if (strlen(sweepNames[i]) != (size_t)(values - sweep) || strncmp(sweep, sweepNames[i], values - sweep)) {
+            continue;
+        }
+        
+        requestedSweepValues[i].clear();
+        
+        for (const char *value = values + 1; *value; ) {
+            char *end = NULL;
+            float number = (float)strtod(value, &end);
+            
+            if (end == value) {
+                break;
+            }
+            
+            requestedSweepValues[i].push_back(number);
+            value = (*end == ',') ? end + 1 : end;
+        }
+        
+        sweepsRequested = true;
+        return !requestedSweepValues[i].empty();
+    }
+    
+    return false;
+}
+
+/* Takes a list of paths like "flythrough,tunnel" */
+
+bool selectBenchmarkPaths(const char *names)
+{
+    bool recognized = true;
+    
+    for (int i = 0; i < CAMERA_PATH_COUNT; i++) {
+        cameraPathSelected[i] = false;
+    }
+    
+    for (const char *name = names; *name; ) {
+        size_t length = strcspn(name, ",");
+        bool found = false;
+        
+        for (int i = 0; i < CAMERA_PATH_COUNT; i++) {
+            if (strlen(cameraPaths[i].name) == length && !strncmp(name, cameraPaths[i].name, length)) {
+                cameraPathSelected[i] = true;
+                found = true;
+            }
+        }
+        
+        recognized = recognized && found;
+        name += length + (name[length] == ',' ? 1 : 0);
+    }
+    
+    return recognized;
+}
+
+void applySweepValue(Configuration *configuration, SweepParameter parameter, float value)
+{
+    switch (parameter) {
+        case SWEEP_TRACKS:
+            configuration->trackCount = std::max(1, (int)value);
+            break;
+        case SWEEP_TRAINS_PER_TRACK:
+            configuration->trainsPerTrack = std::max(0, (int)value);
+            break;
+        case SWEEP_CARS_PER_TRAIN:
+            configuration->carsPerTrain = std::max(1, (int)value);
+            break;
+        case SWEEP_TRACK_LENGTH:
+            configuration->trackLength = std::max((float)TRACK_SEGMENT_LENGTH, value);
+            break;
+        case SWEEP_PLATFORMS:
+            configuration->platformCount = std::max(1, std::min(MAX_PLATFORM_COUNT, (int)value));
+            break;
+        case SWEEP_FIXTURES:
+            configuration->fixturesPerPlatform = std::max(0, std::min(MAX_FIXTURES_PER_PLATFORM, (int)value));
+            break;
+        default:
+            break;
+    }
+}
+
+/* Throws away the scene, and builds it again at a new size */
+
+void rebuildScene(Configuration *newConfiguration)
+{
+    destroyStaticTrackBatch();
+    destroyInstancedTiles();
+    destroyRegistries();
+    
+    configuration = *newConfiguration;
+    
+    createRegistries(&configuration);
+    placePlatforms(&configuration);
+    placeStationLights(&configuration);
+    createSceneGraph(&configuration);
+    
+    buildStaticTrackBatch();
+    buildInstancedTiles();
+}
+
+/* Moves the camera to somewhere between two keyframes, with t from 0 to 1 */
+
+void placeCamera(const CameraPath *path, float t)
+{
+    float position = t * (path->keyframeCount - 1);
+    int first = std::max(0, std::min(path->keyframeCount - 2, (int)position));
+    float blend = position - first;
+    
+    const CameraKeyframe *from = &path->keyframes[first];
+    const CameraKeyframe *to = &path->keyframes[first + 1];
+    
+    float alongTrack = from->alongTrack + (to->alongTrack - from->alongTrack) * blend;
+    float pitch = from->pitch + (to->pitch - from->pitch) * blend;
+    float heading = from->heading + (to->heading - from->heading) * blend;
+    
+    for (int i = 0; i < 3; i++) {
+        translate[i] = from->translate[i] + (to->translate[i] - from->translate[i]) * blend;
+        worldRotation[i] = 0;
+    }
+    
+    /* The scene turns before it moves, so turn the trip along the track too */
+    
+    float distance = -alongTrack * configuration.trackLength;
+    
+    translate[0] += distance * cosf(pitch * DEG2RAD) * sinf(heading * DEG2RAD);
+    translate[1] -= distance * sinf(pitch * DEG2RAD);
+    translate[2] += distance * cosf(pitch * DEG2RAD) * cosf(heading * DEG2RAD);
+    
+    trackRotation[0] = pitch;
+    trackRotation[1] = heading;
+    trackRotation[2] = 0;
+}
+
+/* Nearest rank, on sorted times */
+
+double percentile(const std::vector<double> &sortedTimes, double fraction)
+{
+    size_t rank = (size_t)ceil(fraction * sortedTimes.size());
+    return sortedTimes[std::max((size_t)1, rank) - 1];
+}
+
+void benchmarkPath(const CameraPath *path)
+{
+    int frameCount = configuration.headlessFrames;
+    std::vector<double> frameTimes;
+    
+    startSimulation(false);
+    
+    //  The first few frames warm up the driver, and don't count
+    for (int frame = -BENCHMARK_WARMUP_FRAMES; frame < frameCount; frame++) {
+        
+        placeCamera(path, frame < 0 ? 0.0f : (float)frame / std::max(1, frameCount - 1));
+        double time = timeHeadlessFrame();
+        
+        if (frame >= 0) {
+            frameTimes.push_back(1000.0 * time);
+        }
+    }
+    
+    stopSimulation();
+    
+    double total = 0;
+    
+    for (size_t i = 0; i < frameTimes.size(); i++) {
+        total += frameTimes[i];
+    }
+    
+    std::sort(frameTimes.begin(), frameTimes.end());
+    
+    //  What the scene has, which a network may not have taken from the configuration
+    double trainsPerTrack = (double)trains.count / tracks.count;
+    
+    printf("%s,%d,%g,%d,%g,%d,%d,%d,%.3f,%.3f,%.3f,%.3f\n", path->name, tracks.count, trainsPerTrack, configuration.carsPerTrain, configuration.trackLength, platformCount, configuration.fixturesPerPlatform, frameCount, total / frameCount, percentile(frameTimes, 0.5), percentile(frameTimes, 0.95), percentile(frameTimes, 0.99));
+    fflush(stdout);
+}
+
+int runBenchmark()
+{
+    Configuration baseConfiguration = configuration;
+    
+    std::cerr << "Renderer: " << glGetString(GL_RENDERER) << std::endl;
+    
+    printf("path,tracks,trains_per_track,cars_per_train,track_length,platforms,fixtures,frames,mean_ms,p50_ms,p95_ms,p99_ms\n");
+    
+    for (int sweep = 0; sweep < SWEEP_COUNT; sweep++) {
+        
+        std::vector<float> values;
+        
+        if (sweepsRequested) {
+            values = requestedSweepValues[sweep];
+        }
+        else {
+            values.assign(defaultSweepValues[sweep], defaultSweepValues[sweep] + DEFAULT_SWEEP_LENGTH);
+        }
+        
+        //  A network lays out its own tracks, trains, platforms and line, and its bends only fit its own line
+        bool networkFixed = sweep == SWEEP_TRACKS || sweep == SWEEP_TRAINS_PER_TRACK || sweep == SWEEP_TRACK_LENGTH || sweep == SWEEP_PLATFORMS;
+        
+        if (network && networkFixed && !values.empty()) {
+            std::cerr << "Skipping the " << sweepNames[sweep] << " sweep, which the network fixes" << std::endl;
+            continue;
+        }
+        
+        for (size_t i = 0; i < values.size(); i++) {
+            
+            Configuration sweepConfiguration = baseConfiguration;
+            applySweepValue(&sweepConfiguration, (SweepParameter)sweep, values[i]);
+            rebuildScene(&sweepConfiguration);
+            
+            for (int path = 0; path < CAMERA_PATH_COUNT; path++) {
+                if (cameraPathSelected[path]) {
+                    benchmarkPath(&cameraPaths[path]);
+                }
+            }
+        }
+    }
     
-    //Run frame one more time
-    glutTimerFunc( 1000 / SCREEN_FPS, timedLoop, val );
+    return EXIT_SUCCESS;
 }
 
 #pragma mark - Utility Functions
@@ -1103,5 +9596,5 @@ void alternateColor(float *firstColor, float *secondColor)
         alternatingColor = firstColor;
     }
     
-    glColor4fv(alternatingColor);
+    setColor4fv(alternatingColor);
 }